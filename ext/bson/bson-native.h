@@ -28,7 +28,28 @@ rb_bson_utf8_validate (const char *utf8, /* IN */
                     bool allow_null, /* IN */
                     const char *data_type);  /* IN */
 
-#define BSON_BYTE_BUFFER_SIZE 1024
+extern const char *const rb_bson_utf8_null_byte_reason;
+extern const char *const rb_bson_utf8_code_point_reason;
+
+const char *
+rb_bson_utf8_check (const char *utf8, /* IN */
+                    size_t utf8_len,  /* IN */
+                    bool allow_null, /* IN */
+                    size_t *error_offset, /* OUT */
+                    uint32_t *code_point);  /* OUT */
+
+/* Byte buffers are allocated in three size classes: contents of up to
+ * BSON_BYTE_BUFFER_SIZE bytes are stored in the buffer object itself, which
+ * is enough for single values and small documents. Larger contents are
+ * moved to the heap, into at least BSON_BYTE_BUFFER_HEAP_MIN_SIZE bytes so
+ * that medium documents need one allocation, and beyond that the storage
+ * doubles as it grows. */
+#define BSON_BYTE_BUFFER_SIZE 128
+#define BSON_BYTE_BUFFER_HEAP_MIN_SIZE 1024
+
+/* Strings and binary payloads of at least this many bytes are shared with
+ * the source String of a buffer created with `shared: true`. */
+#define BSON_BYTE_BUFFER_SHARE_THRESHOLD 1024
 
 #ifndef HOST_NAME_HASH_MAX
 #define HOST_NAME_HASH_MAX 256
@@ -39,10 +60,27 @@ rb_bson_utf8_validate (const char *utf8, /* IN */
 #define BSON_TYPE_STRING        2
 #define BSON_TYPE_DOCUMENT      3
 #define BSON_TYPE_ARRAY         4
+#define BSON_TYPE_BINARY        5
+#define BSON_TYPE_UNDEFINED     6
+#define BSON_TYPE_OBJECT_ID     7
 #define BSON_TYPE_BOOLEAN       8
+#define BSON_TYPE_DATETIME      9
+#define BSON_TYPE_NULL          0x0A
+#define BSON_TYPE_REGEX         0x0B
+#define BSON_TYPE_DB_POINTER    0x0C
+#define BSON_TYPE_CODE          0x0D
 #define BSON_TYPE_SYMBOL        0x0E
+#define BSON_TYPE_CODE_WITH_SCOPE 0x0F
 #define BSON_TYPE_INT32         0x10
+#define BSON_TYPE_TIMESTAMP     0x11
 #define BSON_TYPE_INT64         0x12
+#define BSON_TYPE_DECIMAL128    0x13
+#define BSON_TYPE_MAX_KEY       0x7F
+#define BSON_TYPE_MIN_KEY       0xFF
+
+/* Maximum number of nested BSON documents or arrays the decoder will accept.
+ * Mirrors BSON::MAX_NESTING_DEPTH in lib/bson.rb. */
+#define BSON_RUBY_MAX_NESTING_DEPTH 200
 
 typedef struct {
   size_t size;
@@ -50,8 +88,29 @@ typedef struct {
   size_t read_position;
   char   buffer[BSON_BYTE_BUFFER_SIZE];
   char   *b_ptr;
+  /* The frozen String the buffer was created from, whose bytes are
+   * identical to the start of the buffer, or nil. */
+  VALUE  source;
+  /* The String whose storage the buffer writes into, while BSON.encode
+   * encodes into it, or nil. */
+  VALUE  target;
+  /* The minimum length of values handed out as shared substrings of
+   * `source`; zero if values are always copied. */
+  size_t share_threshold;
+  /* Non-zero if the buffer reads the memory of `source` in place (see
+   * ByteBuffer.wrap) and must not be written to. */
+  int    read_only;
+  /* The length of the file mapping the buffer reads (see ByteBuffer.mmap),
+   * which is unmapped when the buffer is freed, or zero. */
+  size_t mapped_length;
 } byte_buffer_t;
 
+/* Whether the storage of the buffer is a heap allocation owned by the
+ * buffer, rather than its embedded array or the memory of a String. */
+#define BSON_BUFFER_OWNS_HEAP(byte_buffer_ptr) \
+  (byte_buffer_ptr->b_ptr != byte_buffer_ptr->buffer && \
+   NIL_P(byte_buffer_ptr->target) && !byte_buffer_ptr->read_only)
+
 #define READ_PTR(byte_buffer_ptr) \
   (byte_buffer_ptr->b_ptr + byte_buffer_ptr->read_position)
 
@@ -70,6 +129,9 @@ typedef struct {
 
 VALUE rb_bson_byte_buffer_allocate(VALUE klass);
 VALUE rb_bson_byte_buffer_initialize(int argc, VALUE *argv, VALUE self);
+VALUE rb_bson_byte_buffer_wrap(int argc, VALUE *argv, VALUE klass);
+VALUE rb_bson_byte_buffer_mmap(int argc, VALUE *argv, VALUE klass);
+VALUE rb_bson_byte_buffer_is_read_only(VALUE self);
 VALUE rb_bson_byte_buffer_length(VALUE self);
 VALUE rb_bson_byte_buffer_get_byte(VALUE self);
 VALUE rb_bson_byte_buffer_get_bytes(VALUE self, VALUE i);
@@ -82,6 +144,8 @@ VALUE rb_bson_byte_buffer_get_int64(VALUE self);
 VALUE rb_bson_byte_buffer_get_string(VALUE self);
 VALUE rb_bson_byte_buffer_get_hash(int argc, VALUE *argv, VALUE self);
 VALUE rb_bson_byte_buffer_get_array(int argc, VALUE *argv, VALUE self);
+VALUE rb_bson_byte_buffer_get_documents(int argc, VALUE *argv, VALUE self);
+VALUE rb_bson_byte_buffer_each_document(int argc, VALUE *argv, VALUE self);
 VALUE rb_bson_byte_buffer_put_byte(VALUE self, VALUE byte);
 VALUE rb_bson_byte_buffer_put_bytes(VALUE self, VALUE bytes);
 VALUE rb_bson_byte_buffer_put_cstring(VALUE self, VALUE string);
@@ -92,21 +156,87 @@ VALUE rb_bson_byte_buffer_put_uint32(VALUE self, VALUE i);
 VALUE rb_bson_byte_buffer_put_int64(VALUE self, VALUE i);
 VALUE rb_bson_byte_buffer_put_string(VALUE self, VALUE string);
 VALUE rb_bson_byte_buffer_put_symbol(VALUE self, VALUE symbol);
-VALUE rb_bson_byte_buffer_put_hash(VALUE self, VALUE hash);
+VALUE rb_bson_byte_buffer_put_hash(int argc, VALUE *argv, VALUE self);
 VALUE rb_bson_byte_buffer_put_array(VALUE self, VALUE array);
+VALUE rb_bson_byte_buffer_put_documents(VALUE self, VALUE documents);
 VALUE rb_bson_byte_buffer_read_position(VALUE self);
 VALUE rb_bson_byte_buffer_replace_int32(VALUE self, VALUE index, VALUE i);
 VALUE rb_bson_byte_buffer_rewind(VALUE self);
+VALUE rb_bson_byte_buffer_reserve(VALUE self, VALUE length);
+VALUE rb_bson_byte_buffer_shrink_to_fit(VALUE self);
+VALUE rb_bson_byte_buffer_capacity(VALUE self);
+VALUE rb_bson_byte_buffer_clear(VALUE self);
+VALUE rb_bson_byte_buffer_truncate(VALUE self, VALUE length);
 VALUE rb_bson_byte_buffer_write_position(VALUE self);
 VALUE rb_bson_byte_buffer_to_s(VALUE self);
+VALUE rb_bson_byte_buffer_field_name_cache_size(VALUE klass);
+VALUE rb_bson_byte_buffer_set_field_name_cache_size(VALUE klass, VALUE size);
+VALUE rb_bson_byte_buffer_key_cache_size(VALUE klass);
+VALUE rb_bson_byte_buffer_set_key_cache_size(VALUE klass, VALUE size);
+
+VALUE rb_bson_raw_document_aref(VALUE self, VALUE key);
+VALUE rb_bson_raw_document_has_key(VALUE self, VALUE key);
+VALUE rb_bson_raw_document_each(VALUE self);
+VALUE rb_bson_raw_document_keys(VALUE self);
+VALUE rb_bson_raw_document_splice(VALUE self, VALUE edits);
+VALUE rb_bson_raw_document_new(const char *ptr, int32_t length, VALUE options);
+
+VALUE rb_bson_stream_decoder_feed(VALUE self, VALUE bytes);
+
+VALUE rb_bson_byte_buffer_document(VALUE self);
+VALUE rb_bson_builder_int32(int argc, VALUE *argv, VALUE self);
+VALUE rb_bson_builder_int64(int argc, VALUE *argv, VALUE self);
+VALUE rb_bson_builder_double(int argc, VALUE *argv, VALUE self);
+VALUE rb_bson_builder_boolean(int argc, VALUE *argv, VALUE self);
+VALUE rb_bson_builder_string(int argc, VALUE *argv, VALUE self);
+VALUE rb_bson_builder_null(int argc, VALUE *argv, VALUE self);
+VALUE rb_bson_builder_value(int argc, VALUE *argv, VALUE self);
+VALUE rb_bson_builder_document(int argc, VALUE *argv, VALUE self);
+VALUE rb_bson_builder_array(int argc, VALUE *argv, VALUE self);
+
+VALUE rb_bson_validate(VALUE self, VALUE data);
+VALUE rb_bson_byte_buffer_is_valid_bson(VALUE self);
+
+VALUE rb_bson_encoded_size(VALUE self, VALUE obj);
+VALUE rb_bson_encode(VALUE self, VALUE obj);
+
+VALUE rb_bson_type_cache_method_changed(VALUE self, VALUE name);
+VALUE rb_bson_type_cache_ancestors_changed(int argc, VALUE *argv, VALUE self);
+VALUE rb_bson_type_cache_clear(VALUE self);
 
 VALUE rb_bson_object_id_generator_next(int argc, VALUE* args, VALUE self);
 VALUE rb_bson_object_id_generator_reset_counter(int argc, VALUE* args, VALUE self);
 
 size_t rb_bson_byte_buffer_memsize(const void *ptr);
+void rb_bson_byte_buffer_mark(void *ptr);
+VALUE pvt_buffer_substring(byte_buffer_t *b, const char *ptr, size_t length);
 void rb_bson_byte_buffer_free(void *ptr);
 void rb_bson_expand_buffer(byte_buffer_t* buffer_ptr, size_t length);
+void rb_bson_reserve_buffer(byte_buffer_t *buffer_ptr, size_t length);
+void pvt_check_writable(byte_buffer_t *b);
+void pvt_truncate(byte_buffer_t *b, size_t length);
+void rb_bson_byte_buffer_attach_target(byte_buffer_t *b, VALUE string);
+VALUE rb_bson_byte_buffer_detach_target(byte_buffer_t *b);
 void rb_bson_generate_machine_id(VALUE rb_md5_class, char *rb_bson_machine_id);
+void rb_bson_init_registry_defaults(void);
+void rb_bson_field_name_cache_resize(long size);
+void rb_bson_key_cache_resize(long size);
+void rb_bson_init_validation(void);
+void rb_bson_init_encoder(void);
+void rb_bson_init_builder(void);
+int pvt_is_default_class(uint8_t type);
+VALUE pvt_get_field_name(const char *ptr, long length);
+size_t pvt_encoded_size(VALUE val);
+
+void pvt_put_byte(byte_buffer_t *b, const char byte);
+void pvt_put_int32(byte_buffer_t *b, const int32_t i32);
+void pvt_put_int64(byte_buffer_t *b, const int64_t i);
+void pvt_put_double(byte_buffer_t *b, double f);
+void pvt_put_type_byte(byte_buffer_t *b, VALUE val);
+void pvt_put_key(byte_buffer_t *b, VALUE rb_buffer, VALUE key);
+void pvt_put_array_index(byte_buffer_t *b, int32_t index);
+void pvt_put_field(byte_buffer_t *b, VALUE rb_buffer, VALUE val);
+void pvt_replace_int32(byte_buffer_t *b, int32_t position, int32_t newval);
 
 VALUE pvt_const_get_2(const char *c1, const char *c2);
 VALUE pvt_const_get_3(const char *c1, const char *c2, const char *c3);
@@ -114,8 +244,36 @@ VALUE pvt_const_get_3(const char *c1, const char *c2, const char *c3);
 #define BSON_MODE_DEFAULT       0
 #define BSON_MODE_BSON          1
 
+VALUE pvt_get_options_hash(int argc, VALUE *argv);
 int pvt_get_mode_option(int argc, VALUE *argv);
 
+NORETURN(void pvt_raise_decode_error(volatile VALUE msg));
+void pvt_check_nesting_depth(int depth);
+int64_t pvt_value_length(uint8_t type, const char *ptr, size_t available);
+
+/**
+ * The state shared by all the values read by a single call into the
+ * decoder, set up once by pvt_init_decode_context.
+ */
+typedef struct {
+  byte_buffer_t *b;
+  VALUE rb_buffer;
+  /* The options to pass to the from_bson methods of registered classes. */
+  int argc;
+  VALUE *argv;
+  /* The :mode option, as one of the BSON_MODE_* values, or -1 until it is
+   * first needed. Like the classes below it is resolved lazily, so that
+   * an invalid mode is only reported for documents it applies to. */
+  int mode;
+  /* The classes registered for int64 and symbol values, or Qundef until
+   * they are first needed. */
+  VALUE int64_class;
+  VALUE symbol_class;
+} decode_context_t;
+
+void pvt_init_decode_context(decode_context_t *ctx, VALUE rb_buffer, int argc, VALUE *argv);
+VALUE pvt_read_field(decode_context_t *ctx, uint8_t type, int depth);
+
 #define BSON_OBJECT_ID_RANDOM_VALUE_LENGTH  ( 5 )
 
 uint8_t* pvt_get_object_id_random_value();
@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2009-2020 MongoDB Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bson-native.h"
+
+/**
+ * The state of a BSON::Builder, which writes the elements of one document
+ * or array directly into a byte buffer.
+ *
+ * `index` is the index of the next element of an array, or -1 if the
+ * builder writes a document. `busy` is set while a nested document or
+ * array is being built with another builder, and `closed` once the block
+ * the builder was yielded to has returned; the builder cannot be used in
+ * either state.
+ */
+typedef struct {
+  VALUE buffer;
+  byte_buffer_t *b;
+  int32_t index;
+  int busy;
+  int closed;
+} builder_t;
+
+static void pvt_builder_mark(void *ptr)
+{
+  rb_gc_mark(((builder_t *)ptr)->buffer);
+}
+
+static size_t pvt_builder_memsize(const void *ptr)
+{
+  return sizeof(builder_t);
+}
+
+static const rb_data_type_t pvt_builder_data_type = {
+  "bson/builder",
+  { pvt_builder_mark, RUBY_TYPED_DEFAULT_FREE, pvt_builder_memsize }
+};
+
+static VALUE pvt_builder_class = Qnil;
+
+/**
+ * Resolves the builder class. Builders are only created by
+ * ByteBuffer#document, so the class has no allocator.
+ */
+void rb_bson_init_builder(void)
+{
+  pvt_builder_class = pvt_const_get_2("BSON", "Builder");
+  rb_gc_register_mark_object(pvt_builder_class);
+  rb_undef_alloc_func(pvt_builder_class);
+}
+
+/**
+ * Writes a length placeholder, yields a new builder for the elements of
+ * the document (or, if `index` is 0, the array) and then writes the
+ * terminator and the actual length.
+ *
+ * If the block raises or otherwise exits early, the buffer is truncated
+ * back to the placeholder, removing the elements written for the document.
+ * The position of the placeholder is relative to the read position, since
+ * the buffer moves its contents when it grows.
+ */
+static void pvt_build(VALUE buffer, byte_buffer_t *b, builder_t *parent, int32_t index)
+{
+  builder_t *builder;
+  VALUE obj = TypedData_Make_Struct(pvt_builder_class, builder_t, &pvt_builder_data_type, builder);
+  size_t position;
+  int state = 0;
+
+  builder->buffer = buffer;
+  builder->b = b;
+  builder->index = index;
+
+  position = READ_SIZE(b);
+  pvt_put_int32(b, 0);
+
+  if (parent) {
+    parent->busy = 1;
+  }
+  rb_protect(rb_yield, obj, &state);
+  if (parent) {
+    parent->busy = 0;
+  }
+  builder->closed = 1;
+
+  if (state) {
+    pvt_truncate(b, position);
+    rb_jump_tag(state);
+  }
+
+  pvt_put_byte(b, 0);
+  pvt_replace_int32(b, (int32_t)position, (int32_t)(READ_SIZE(b) - position));
+  RB_GC_GUARD(obj);
+}
+
+/**
+ * Checks that the builder can be used and that it was given a key (unless
+ * it builds an array) followed by `with_value` values. Stores the value in
+ * `value`. Nothing is written, so that the value can be converted before
+ * the element is begun.
+ */
+static builder_t *pvt_builder_args(VALUE self, int argc, VALUE *argv, int with_value, VALUE *value)
+{
+  builder_t *builder;
+  int expected;
+
+  TypedData_Get_Struct(self, builder_t, &pvt_builder_data_type, builder);
+  if (builder->closed) {
+    rb_raise(rb_eRuntimeError, "BSON::Builder used after its block returned");
+  }
+  if (builder->busy) {
+    rb_raise(rb_eRuntimeError, "BSON::Builder used while a nested document is being built");
+  }
+
+  expected = (builder->index < 0 ? 1 : 0) + with_value;
+  rb_check_arity(argc, expected, expected);
+  *value = with_value ? argv[argc - 1] : Qnil;
+  return builder;
+}
+
+/**
+ * Begins an element by writing its type byte, or the type of `value` if
+ * `type` is 0, followed by its key or array index.
+ */
+static void pvt_builder_begin(builder_t *builder, VALUE *argv, uint8_t type, VALUE value)
+{
+  if (type) {
+    pvt_put_byte(builder->b, (char)type);
+  } else {
+    pvt_put_type_byte(builder->b, value);
+  }
+
+  if (builder->index < 0) {
+    pvt_put_key(builder->b, builder->buffer, argv[0]);
+  } else {
+    pvt_put_array_index(builder->b, builder->index++);
+  }
+}
+
+/**
+ * Writes the type byte, key and value of one element.
+ */
+typedef void (*builder_put_t)(builder_t *builder, VALUE *argv, VALUE value);
+
+typedef struct {
+  builder_t *builder;
+  VALUE *argv;
+  VALUE value;
+  builder_put_t put;
+} builder_element_t;
+
+static VALUE pvt_builder_put_element(VALUE arg)
+{
+  builder_element_t *element = (builder_element_t *)arg;
+
+  element->put(element->builder, element->argv, element->value);
+  return Qnil;
+}
+
+/**
+ * Writes an element with `put`. If the key or the value turns out to be
+ * invalid, or anything else raises, the bytes written for the element are
+ * removed and its array index is given back, so that a caller rescuing
+ * the error can go on building the document.
+ */
+static VALUE pvt_builder_put(VALUE self, builder_t *builder, VALUE *argv, VALUE value, builder_put_t put)
+{
+  builder_element_t element = { builder, argv, value, put };
+  const size_t length = READ_SIZE(builder->b);
+  const int32_t index = builder->index;
+  int state = 0;
+
+  rb_protect(pvt_builder_put_element, (VALUE)&element, &state);
+  if (state) {
+    pvt_truncate(builder->b, length);
+    builder->index = index;
+    rb_jump_tag(state);
+  }
+  return self;
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_byte_buffer_document(VALUE self)
+{
+  byte_buffer_t *b;
+
+  rb_need_block();
+  TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
+  pvt_check_writable(b);
+
+  pvt_build(self, b, NULL, -1);
+  return self;
+}
+
+static void pvt_builder_put_int32(builder_t *builder, VALUE *argv, VALUE value)
+{
+  const int32_t i32 = NUM2INT(value);
+
+  pvt_builder_begin(builder, argv, BSON_TYPE_INT32, value);
+  pvt_put_int32(builder->b, i32);
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_builder_int32(int argc, VALUE *argv, VALUE self)
+{
+  VALUE value;
+  builder_t *builder = pvt_builder_args(self, argc, argv, 1, &value);
+
+  return pvt_builder_put(self, builder, argv, value, pvt_builder_put_int32);
+}
+
+static void pvt_builder_put_int64(builder_t *builder, VALUE *argv, VALUE value)
+{
+  const int64_t i64 = NUM2LL(value);
+
+  pvt_builder_begin(builder, argv, BSON_TYPE_INT64, value);
+  pvt_put_int64(builder->b, i64);
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_builder_int64(int argc, VALUE *argv, VALUE self)
+{
+  VALUE value;
+  builder_t *builder = pvt_builder_args(self, argc, argv, 1, &value);
+
+  return pvt_builder_put(self, builder, argv, value, pvt_builder_put_int64);
+}
+
+static void pvt_builder_put_double(builder_t *builder, VALUE *argv, VALUE value)
+{
+  const double f = NUM2DBL(value);
+
+  pvt_builder_begin(builder, argv, BSON_TYPE_DOUBLE, value);
+  pvt_put_double(builder->b, f);
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_builder_double(int argc, VALUE *argv, VALUE self)
+{
+  VALUE value;
+  builder_t *builder = pvt_builder_args(self, argc, argv, 1, &value);
+
+  return pvt_builder_put(self, builder, argv, value, pvt_builder_put_double);
+}
+
+static void pvt_builder_put_boolean(builder_t *builder, VALUE *argv, VALUE value)
+{
+  if (value != Qtrue && value != Qfalse) {
+    rb_raise(rb_eTypeError, "Expected true or false, got %"PRIsVALUE, rb_obj_class(value));
+  }
+
+  pvt_builder_begin(builder, argv, BSON_TYPE_BOOLEAN, value);
+  pvt_put_byte(builder->b, value == Qtrue ? 1 : 0);
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_builder_boolean(int argc, VALUE *argv, VALUE self)
+{
+  VALUE value;
+  builder_t *builder = pvt_builder_args(self, argc, argv, 1, &value);
+
+  return pvt_builder_put(self, builder, argv, value, pvt_builder_put_boolean);
+}
+
+static void pvt_builder_put_string(builder_t *builder, VALUE *argv, VALUE value)
+{
+  StringValue(value);
+  pvt_builder_begin(builder, argv, BSON_TYPE_STRING, value);
+  rb_bson_byte_buffer_put_string(builder->buffer, value);
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_builder_string(int argc, VALUE *argv, VALUE self)
+{
+  VALUE value;
+  builder_t *builder = pvt_builder_args(self, argc, argv, 1, &value);
+
+  return pvt_builder_put(self, builder, argv, value, pvt_builder_put_string);
+}
+
+static void pvt_builder_put_null(builder_t *builder, VALUE *argv, VALUE value)
+{
+  pvt_builder_begin(builder, argv, BSON_TYPE_NULL, value);
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_builder_null(int argc, VALUE *argv, VALUE self)
+{
+  VALUE value;
+  builder_t *builder = pvt_builder_args(self, argc, argv, 0, &value);
+
+  return pvt_builder_put(self, builder, argv, value, pvt_builder_put_null);
+}
+
+static void pvt_builder_put_value(builder_t *builder, VALUE *argv, VALUE value)
+{
+  pvt_builder_begin(builder, argv, 0, value);
+  pvt_put_field(builder->b, builder->buffer, value);
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_builder_value(int argc, VALUE *argv, VALUE self)
+{
+  VALUE value;
+  builder_t *builder = pvt_builder_args(self, argc, argv, 1, &value);
+
+  return pvt_builder_put(self, builder, argv, value, pvt_builder_put_value);
+}
+
+/**
+ * Writes an embedded document or array, whose elements are added by the
+ * block.
+ */
+static void pvt_builder_put_document(builder_t *builder, VALUE *argv, VALUE value)
+{
+  pvt_builder_begin(builder, argv, BSON_TYPE_DOCUMENT, value);
+  pvt_build(builder->buffer, builder->b, builder, -1);
+}
+
+static void pvt_builder_put_array(builder_t *builder, VALUE *argv, VALUE value)
+{
+  pvt_builder_begin(builder, argv, BSON_TYPE_ARRAY, value);
+  pvt_build(builder->buffer, builder->b, builder, 0);
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_builder_document(int argc, VALUE *argv, VALUE self)
+{
+  VALUE value;
+  builder_t *builder;
+
+  rb_need_block();
+  builder = pvt_builder_args(self, argc, argv, 0, &value);
+  return pvt_builder_put(self, builder, argv, value, pvt_builder_put_document);
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_builder_array(int argc, VALUE *argv, VALUE self)
+{
+  VALUE value;
+  builder_t *builder;
+
+  rb_need_block();
+  builder = pvt_builder_args(self, argc, argv, 0, &value);
+  return pvt_builder_put(self, builder, argv, value, pvt_builder_put_array);
+}
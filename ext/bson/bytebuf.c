@@ -15,6 +15,16 @@
  */
 
 #include "bson-native.h"
+#include <ruby/encoding.h>
+#include <ruby/io.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+static void pvt_unmap(byte_buffer_t *b);
 
 /**
  * Allocates a bson byte buffer that wraps a byte_buffer_t.
@@ -25,6 +35,8 @@ VALUE rb_bson_byte_buffer_allocate(VALUE klass)
   VALUE obj = TypedData_Make_Struct(klass, byte_buffer_t, &rb_byte_buffer_data_type, b);
   b->b_ptr = b->buffer;
   b->size = BSON_BYTE_BUFFER_SIZE;
+  b->source = Qnil;
+  b->target = Qnil;
   return obj;
 }
 
@@ -33,29 +45,362 @@ VALUE rb_bson_byte_buffer_allocate(VALUE klass)
  */
 VALUE rb_bson_byte_buffer_initialize(int argc, VALUE *argv, VALUE self)
 {
-  VALUE bytes;
-  rb_scan_args(argc, argv, "01", &bytes);
+  VALUE bytes, opts, shared = Qnil, capacity = Qnil;
+  byte_buffer_t *b;
+
+  rb_scan_args(argc, argv, "01:", &bytes, &opts);
+  if (!NIL_P(opts)) {
+    shared = rb_hash_lookup(opts, ID2SYM(rb_intern("shared")));
+    capacity = rb_hash_lookup(opts, ID2SYM(rb_intern("capacity")));
+  }
+
+  if (!NIL_P(capacity)) {
+    long length = NUM2LONG(capacity);
+    if (length < 0) {
+      rb_raise(rb_eArgError, "Capacity must not be negative: %ld", length);
+    }
+    TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
+    rb_bson_reserve_buffer(b, (size_t)length);
+  }
 
   if (!NIL_P(bytes)) {
+    if (RTEST(shared)) {
+      /* A frozen copy shares the bytes of `bytes` and cannot change, even
+       * if the caller later modifies `bytes`. */
+      bytes = rb_str_new_frozen(StringValue(bytes));
+    }
     rb_bson_byte_buffer_put_bytes(self, bytes);
   }
 
+  if (RTEST(shared) && !NIL_P(bytes)) {
+    TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
+    if (shared == Qtrue) {
+      b->share_threshold = BSON_BYTE_BUFFER_SHARE_THRESHOLD;
+    } else {
+      long threshold = NUM2LONG(shared);
+      if (threshold < 1) {
+        rb_raise(rb_eArgError, "Shared string threshold must be positive: %ld", threshold);
+      }
+      b->share_threshold = (size_t)threshold;
+    }
+    b->source = bytes;
+  }
+
+  return self;
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_byte_buffer_wrap(int argc, VALUE *argv, VALUE klass)
+{
+  VALUE bytes, opts, shared = Qnil;
+  VALUE self = rb_obj_alloc(klass);
+  byte_buffer_t *b;
+
+  rb_scan_args(argc, argv, "1:", &bytes, &opts);
+  if (!NIL_P(opts)) {
+    shared = rb_hash_lookup(opts, ID2SYM(rb_intern("shared")));
+  }
+
+  /* Frozen Strings are used as they are; a frozen copy of any other
+   * String shares its memory unless it is embedded. */
+  bytes = rb_str_new_frozen(StringValue(bytes));
+
+  TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
+  b->source = bytes;
+  b->read_only = 1;
+  b->b_ptr = RSTRING_PTR(bytes);
+  b->size = RSTRING_LEN(bytes);
+  b->write_position = RSTRING_LEN(bytes);
+
+  if (shared == Qtrue) {
+    b->share_threshold = BSON_BYTE_BUFFER_SHARE_THRESHOLD;
+  } else if (RTEST(shared)) {
+    long threshold = NUM2LONG(shared);
+    if (threshold < 1) {
+      rb_raise(rb_eArgError, "Shared string threshold must be positive: %ld", threshold);
+    }
+    b->share_threshold = (size_t)threshold;
+  } else {
+    /* Values are copied even though the source is kept. */
+    b->share_threshold = SIZE_MAX;
+  }
+
+  return self;
+}
+
+#ifdef HAVE_SYS_MMAN_H
+/**
+ * Returns the madvise(2) advice named by the :advice option of
+ * ByteBuffer.mmap.
+ */
+static int pvt_mmap_advice(VALUE advice)
+{
+#ifdef HAVE_MADVISE
+  if (NIL_P(advice) || advice == ID2SYM(rb_intern("sequential"))) {
+    return MADV_SEQUENTIAL;
+  } else if (advice == ID2SYM(rb_intern("willneed"))) {
+    return MADV_WILLNEED;
+  } else if (advice == ID2SYM(rb_intern("random"))) {
+    return MADV_RANDOM;
+  } else if (advice == ID2SYM(rb_intern("normal"))) {
+    return MADV_NORMAL;
+  }
+#else
+  if (NIL_P(advice) || advice == ID2SYM(rb_intern("sequential")) ||
+      advice == ID2SYM(rb_intern("willneed")) ||
+      advice == ID2SYM(rb_intern("random")) ||
+      advice == ID2SYM(rb_intern("normal"))) {
+    return 0;
+  }
+#endif
+  rb_raise(rb_eArgError, "Invalid mmap advice: %"PRIsVALUE, rb_inspect(advice));
+}
+#endif
+
+/* The docstring is in init.c. */
+VALUE rb_bson_byte_buffer_mmap(int argc, VALUE *argv, VALUE klass)
+{
+#ifdef HAVE_SYS_MMAN_H
+  VALUE path, opts, advice = Qnil;
+  VALUE self;
+  byte_buffer_t *b;
+  struct stat st;
+  void *addr = NULL;
+  size_t length = 0;
+  int fd, flag, error;
+
+  rb_scan_args(argc, argv, "1:", &path, &opts);
+  if (!NIL_P(opts)) {
+    advice = rb_hash_lookup(opts, ID2SYM(rb_intern("advice")));
+  }
+  flag = pvt_mmap_advice(advice);
+  FilePathValue(path);
+  self = rb_obj_alloc(klass);
+
+  fd = rb_cloexec_open(RSTRING_PTR(path), O_RDONLY, 0);
+  if (fd < 0) {
+    rb_sys_fail_str(path);
+  }
+  rb_update_max_fd(fd);
+
+  if (fstat(fd, &st) < 0) {
+    error = errno;
+    close(fd);
+    errno = error;
+    rb_sys_fail_str(path);
+  }
+  if ((uint64_t)st.st_size > SIZE_MAX) {
+    close(fd);
+    rb_raise(rb_eRangeError, "File is too large to map: %"PRIsVALUE, path);
+  }
+
+  length = (size_t)st.st_size;
+  if (length > 0) {
+    addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      error = errno;
+      close(fd);
+      errno = error;
+      rb_sys_fail_str(path);
+    }
+  }
+  /* The mapping stays valid after the descriptor is closed. */
+  close(fd);
+
+  TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
+  b->read_only = 1;
+  if (addr) {
+#ifdef HAVE_MADVISE
+    /* The advice is only a hint, so failures are ignored. */
+    madvise(addr, length, flag);
+#else
+    (void)flag;
+#endif
+    b->b_ptr = addr;
+    b->mapped_length = length;
+  }
+  b->size = length;
+  b->write_position = length;
   return self;
+#else
+  rb_raise(rb_eNotImpError, "ByteBuffer.mmap is not supported on this platform");
+#endif
+}
+
+/**
+ * Unmaps the file mapped by ByteBuffer.mmap, if any. The buffer must not
+ * read its storage afterwards.
+ */
+void pvt_unmap(byte_buffer_t *b)
+{
+#ifdef HAVE_SYS_MMAN_H
+  if (b->mapped_length > 0) {
+    munmap(b->b_ptr, b->mapped_length);
+    b->mapped_length = 0;
+  }
+#endif
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_byte_buffer_is_read_only(VALUE self)
+{
+  byte_buffer_t *b;
+  TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
+  return b->read_only ? Qtrue : Qfalse;
+}
+
+/**
+ * Raises FrozenError if the buffer wraps a String and cannot be written to.
+ */
+void pvt_check_writable(byte_buffer_t *b)
+{
+  if (b->read_only) {
+    rb_raise(rb_eFrozenError, "can't modify a read-only BSON::ByteBuffer");
+  }
+}
+
+/**
+ * Moves the write position back so that the buffer holds `length` unread
+ * bytes. Positions are kept relative to the read position because the
+ * buffer moves its contents to the start of its storage when it grows.
+ * Does nothing if the buffer holds no more than `length` bytes.
+ */
+void pvt_truncate(byte_buffer_t *b, size_t length)
+{
+  if (READ_SIZE(b) <= length) {
+    return;
+  }
+  b->write_position = b->read_position + length;
+  /* Bytes written from here on would no longer match the source String. */
+  if (!NIL_P(b->source) && b->write_position < (size_t)RSTRING_LEN(b->source)) {
+    b->source = Qnil;
+  }
+}
+
+/**
+ * Returns a String with a copy of `length` bytes at `ptr`, which must be
+ * within the readable part of the buffer. If the buffer was created with
+ * `shared: true` and the bytes still belong to its source String, large
+ * values are returned as copy-on-write substrings of the source instead.
+ * The String is binary-encoded.
+ */
+VALUE pvt_buffer_substring(byte_buffer_t *b, const char *ptr, size_t length)
+{
+  if (!NIL_P(b->source) && length >= b->share_threshold) {
+    size_t offset = ptr - b->b_ptr;
+    if (offset + length <= (size_t)RSTRING_LEN(b->source)) {
+      VALUE substring = rb_str_subseq(b->source, (long)offset, (long)length);
+      rb_enc_associate_index(substring, rb_ascii8bit_encindex());
+      return substring;
+    }
+  }
+  return rb_str_new(ptr, length);
+}
+
+/**
+ * Grows the String the buffer writes into to hold at least `size` bytes.
+ * The contents keep their offsets.
+ */
+static void pvt_grow_target(byte_buffer_t *b, size_t size)
+{
+  rb_str_set_len(b->target, (long)b->write_position);
+  rb_str_modify_expand(b->target, (long)(size - b->write_position));
+  b->b_ptr = RSTRING_PTR(b->target);
+  b->size = rb_str_capacity(b->target);
+}
+
+/**
+ * Makes the empty buffer write directly into the storage of `string`, so
+ * that the encoded bytes do not have to be copied out of the buffer. The
+ * String is marked, and therefore pinned, by the buffer until it is
+ * detached.
+ */
+void rb_bson_byte_buffer_attach_target(byte_buffer_t *b, VALUE string)
+{
+  b->target = string;
+  b->b_ptr = RSTRING_PTR(string);
+  b->size = rb_str_capacity(string);
+  b->read_position = 0;
+  b->write_position = 0;
+}
+
+/**
+ * Returns the String the buffer has been writing into, holding the bytes
+ * written, and returns the buffer to its embedded storage.
+ */
+VALUE rb_bson_byte_buffer_detach_target(byte_buffer_t *b)
+{
+  VALUE string = b->target;
+
+  rb_str_resize(string, (long)b->write_position);
+  b->target = Qnil;
+  b->b_ptr = b->buffer;
+  b->size = BSON_BYTE_BUFFER_SIZE;
+  b->read_position = 0;
+  b->write_position = 0;
+  return string;
+}
+
+/**
+ * Makes room for `length` more bytes to be written without the buffer
+ * growing again. Unlike rb_bson_expand_buffer, exactly the required
+ * number of bytes is allocated.
+ */
+void rb_bson_reserve_buffer(byte_buffer_t *buffer_ptr, size_t length)
+{
+  const size_t required_size = READ_SIZE(buffer_ptr) + length;
+  char *new_b_ptr;
+
+  pvt_check_writable(buffer_ptr);
+  if (buffer_ptr->write_position + length <= buffer_ptr->size) {
+    return;
+  }
+  if (!NIL_P(buffer_ptr->target)) {
+    pvt_grow_target(buffer_ptr, buffer_ptr->write_position + length);
+    return;
+  }
+  if (required_size <= buffer_ptr->size) {
+    rb_bson_expand_buffer(buffer_ptr, length);
+    return;
+  }
+
+  buffer_ptr->source = Qnil;
+  new_b_ptr = ALLOC_N(char, required_size);
+  memcpy(new_b_ptr, READ_PTR(buffer_ptr), READ_SIZE(buffer_ptr));
+  if (buffer_ptr->b_ptr != buffer_ptr->buffer) {
+    xfree(buffer_ptr->b_ptr);
+  }
+  buffer_ptr->b_ptr = new_b_ptr;
+  buffer_ptr->size = required_size;
+  buffer_ptr->write_position -= buffer_ptr->read_position;
+  buffer_ptr->read_position = 0;
 }
 
 /**
- * Expand the byte buffer linearly.
+ * Expand the byte buffer, doubling the required size and allocating no
+ * less than BSON_BYTE_BUFFER_HEAP_MIN_SIZE bytes on the heap.
  */
 void rb_bson_expand_buffer(byte_buffer_t* buffer_ptr, size_t length)
 {
   const size_t required_size = buffer_ptr->write_position - buffer_ptr->read_position + length;
+
+  pvt_check_writable(buffer_ptr);
+
+  /* The contents are about to move, so they no longer line up with the
+   * source String. */
+  buffer_ptr->source = Qnil;
   if (required_size <= buffer_ptr->size) {
     memmove(buffer_ptr->b_ptr, READ_PTR(buffer_ptr), READ_SIZE(buffer_ptr));
     buffer_ptr->write_position -= buffer_ptr->read_position;
     buffer_ptr->read_position = 0;
+  } else if (!NIL_P(buffer_ptr->target)) {
+    pvt_grow_target(buffer_ptr, (buffer_ptr->write_position + length) * 2);
   } else {
     char *new_b_ptr;
-    const size_t new_size = required_size * 2;
+    size_t new_size = required_size * 2;
+    if (new_size < BSON_BYTE_BUFFER_HEAP_MIN_SIZE) {
+      new_size = BSON_BYTE_BUFFER_HEAP_MIN_SIZE;
+    }
     new_b_ptr = ALLOC_N(char, new_size);
     memcpy(new_b_ptr, READ_PTR(buffer_ptr), READ_SIZE(buffer_ptr));
     if (buffer_ptr->b_ptr != buffer_ptr->buffer) {
@@ -68,15 +413,108 @@ void rb_bson_expand_buffer(byte_buffer_t* buffer_ptr, size_t length)
   }
 }
 
+/* The docstring is in init.c. */
+VALUE rb_bson_byte_buffer_reserve(VALUE self, VALUE length)
+{
+  byte_buffer_t *b;
+  long n = NUM2LONG(length);
+
+  if (n < 0) {
+    rb_raise(rb_eArgError, "Cannot reserve a negative number of bytes: %ld", n);
+  }
+  TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
+  rb_bson_reserve_buffer(b, (size_t)n);
+  return self;
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_byte_buffer_shrink_to_fit(VALUE self)
+{
+  byte_buffer_t *b;
+  size_t length;
+
+  TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
+  if (!BSON_BUFFER_OWNS_HEAP(b)) {
+    return self;
+  }
+
+  length = READ_SIZE(b);
+  if (b->read_position > 0) {
+    /* The contents move, so they no longer line up with the source
+     * String. */
+    b->source = Qnil;
+    memmove(b->b_ptr, READ_PTR(b), length);
+    b->write_position = length;
+    b->read_position = 0;
+  }
+
+  if (length <= BSON_BYTE_BUFFER_SIZE) {
+    b->source = Qnil;
+    memcpy(b->buffer, b->b_ptr, length);
+    xfree(b->b_ptr);
+    b->b_ptr = b->buffer;
+    b->size = BSON_BYTE_BUFFER_SIZE;
+  } else if (length < b->size) {
+    REALLOC_N(b->b_ptr, char, length);
+    b->size = length;
+  }
+  return self;
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_byte_buffer_clear(VALUE self)
+{
+  byte_buffer_t *b;
+  TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
+  if (b->read_only) {
+    /* Let go of the wrapped String or file and write into the embedded
+     * storage from now on. */
+    pvt_unmap(b);
+    b->read_only = 0;
+    b->b_ptr = b->buffer;
+    b->size = BSON_BYTE_BUFFER_SIZE;
+    b->share_threshold = 0;
+  }
+  b->read_position = 0;
+  b->write_position = 0;
+  b->source = Qnil;
+  return self;
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_byte_buffer_truncate(VALUE self, VALUE length)
+{
+  byte_buffer_t *b;
+  const long _length = NUM2LONG(length);
+
+  TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
+  pvt_check_writable(b);
+  if (_length < 0 || (size_t)_length > READ_SIZE(b)) {
+    rb_raise(rb_eArgError, "Length given to truncate is out of bounds: %ld", _length);
+  }
+
+  pvt_truncate(b, (size_t)_length);
+  return self;
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_byte_buffer_capacity(VALUE self)
+{
+  byte_buffer_t *b;
+  TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
+  return SIZET2NUM(b->size);
+}
+
 /**
  * Free the memory for the byte buffer.
  */
 void rb_bson_byte_buffer_free(void *ptr)
 {
   byte_buffer_t *b = ptr;
-  if (b->b_ptr != b->buffer) {
+  if (BSON_BUFFER_OWNS_HEAP(b)) {
     xfree(b->b_ptr);
   }
+  pvt_unmap(b);
   xfree(b);
 }
 
@@ -87,7 +525,7 @@ VALUE rb_bson_byte_buffer_length(VALUE self)
 {
   byte_buffer_t *b;
   TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
-  return UINT2NUM(READ_SIZE(b));
+  return SIZET2NUM(READ_SIZE(b));
 }
 
 /* The docstring is in init.c. */
@@ -95,7 +533,7 @@ VALUE rb_bson_byte_buffer_read_position(VALUE self)
 {
   byte_buffer_t *b;
   TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
-  return INT2NUM(b->read_position);
+  return SIZET2NUM(b->read_position);
 }
 
 /* The docstring is in init.c. */
@@ -113,7 +551,7 @@ VALUE rb_bson_byte_buffer_write_position(VALUE self)
 {
   byte_buffer_t *b;
   TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
-  return INT2NUM(b->write_position);
+  return SIZET2NUM(b->write_position);
 }
 
 /* The docstring is in init.c. */
@@ -121,13 +559,29 @@ VALUE rb_bson_byte_buffer_to_s(VALUE self)
 {
   byte_buffer_t *b;
   TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
-  return rb_str_new(READ_PTR(b), READ_SIZE(b));
+  return pvt_buffer_substring(b, READ_PTR(b), READ_SIZE(b));
 }
 
 /**
- * Get the size of the byte_buffer_t in memory.
+ * Mark the source and target Strings of the byte buffer.
+ */
+void rb_bson_byte_buffer_mark(void *ptr)
+{
+  byte_buffer_t *b = ptr;
+  rb_gc_mark(b->source);
+  rb_gc_mark(b->target);
+}
+
+/**
+ * Get the size of the byte_buffer_t in memory, including its storage when
+ * that has been moved to the heap.
  */
 size_t rb_bson_byte_buffer_memsize(const void *ptr)
 {
-  return ptr ? sizeof(byte_buffer_t) : 0;
+  const byte_buffer_t *b = ptr;
+
+  if (!b) {
+    return 0;
+  }
+  return sizeof(byte_buffer_t) + (BSON_BUFFER_OWNS_HEAP(b) ? b->size : 0);
 }
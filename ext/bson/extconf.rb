@@ -5,4 +5,8 @@ require 'mkmf'
 
 append_cflags(["-Wall", "-g", "-std=c99"])
 
+have_func("rb_enc_interned_str", "ruby/encoding.h")
+have_header("sys/mman.h")
+have_func("madvise", "sys/mman.h")
+
 create_makefile('bson_native')
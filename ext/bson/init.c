@@ -25,7 +25,7 @@ VALUE rb_bson_registry;
 
 const rb_data_type_t rb_byte_buffer_data_type = {
   "bson/byte_buffer",
-  { NULL, rb_bson_byte_buffer_free, rb_bson_byte_buffer_memsize }
+  { rb_bson_byte_buffer_mark, rb_bson_byte_buffer_free, rb_bson_byte_buffer_memsize }
 };
 
 VALUE _ref_str, _id_str, _db_str;
@@ -61,8 +61,71 @@ void Init_bson_native()
   VALUE rb_md5_class = rb_const_get(rb_digest_class, rb_intern("MD5"));
 
   rb_define_alloc_func(rb_byte_buffer_class, rb_bson_byte_buffer_allocate);
+
+  /*
+   * call-seq:
+   *   ByteBuffer.new(bytes = nil, shared: false, capacity: nil) -> ByteBuffer
+   *
+   * Creates a buffer, optionally holding a copy of +bytes+ to be read.
+   *
+   * With +capacity+, storage for at least that many bytes is allocated up
+   * front, so that writing a document of known size does not grow the
+   * buffer repeatedly.
+   *
+   * With +shared+ set, the buffer keeps a frozen reference to +bytes+ and
+   * strings and binary payloads decoded from it are returned as
+   * copy-on-write substrings of +bytes+ instead of copies, once they are at
+   * least 1024 bytes long (or +shared+ bytes, if it is an Integer). Shared
+   * values keep all of +bytes+ alive, so only use this when the decoded
+   * values do not outlive the input by much. Writing to the buffer stops
+   * the sharing.
+   */
   rb_define_method(rb_byte_buffer_class, "initialize", rb_bson_byte_buffer_initialize, -1);
 
+  /*
+   * call-seq:
+   *   ByteBuffer.wrap(bytes, shared: false) -> ByteBuffer
+   *
+   * Creates a read-only buffer which reads +bytes+ in place instead of
+   * copying them. A String which is not frozen is replaced by a frozen
+   * copy, which shares its memory unless the String is very short.
+   *
+   * The buffer keeps +bytes+ alive. Writing to it raises FrozenError,
+   * until +clear+ detaches it from +bytes+. +shared+ behaves as it does
+   * for ByteBuffer.new.
+   */
+  rb_define_singleton_method(rb_byte_buffer_class, "wrap", rb_bson_byte_buffer_wrap, -1);
+
+  /*
+   * call-seq:
+   *   ByteBuffer.mmap(path, advice: :sequential) -> ByteBuffer
+   *
+   * Creates a read-only buffer over the contents of the file at +path+,
+   * such as a mongodump .bson file, by mapping the file into memory. The
+   * file is paged in by the OS as the buffer is read, so creating the
+   * buffer takes the same time whatever the size of the file, and bytes
+   * are not copied until values are decoded. Combine it with
+   * +each_document+ to iterate over the documents of the file.
+   *
+   * +advice+ is passed to madvise(2) as a hint about how the buffer will be
+   * read: :sequential (the default), :willneed, :random or :normal.
+   *
+   * The file is unmapped when the buffer is garbage collected or cleared.
+   * Truncating the file while it is mapped may crash the process.
+   *
+   * Raises NotImplementedError on platforms without mmap(2).
+   */
+  rb_define_singleton_method(rb_byte_buffer_class, "mmap", rb_bson_byte_buffer_mmap, -1);
+
+  /*
+   * call-seq:
+   *   buffer.read_only? -> true | false
+   *
+   * Returns whether the buffer was created by ByteBuffer.wrap and cannot be
+   * written to.
+   */
+  rb_define_method(rb_byte_buffer_class, "read_only?", rb_bson_byte_buffer_is_read_only, 0);
+
   /*
    * call-seq:
    *   buffer.length -> Fixnum
@@ -95,11 +158,42 @@ void Init_bson_native()
    * Reads a document from the byte buffer and returns it as a BSON::Document.
    *
    * @option options [ nil | :bson ] :mode Decoding mode to use.
+   * @option options [ Array<String | Symbol> ] :only The fields to decode,
+   *   as dotted paths. Other fields are skipped without being decoded.
+   * @option options [ Array<String | Symbol> ] :except The fields to skip,
+   *   as dotted paths.
    *
    * @return [ BSON::Document ] The decoded document.
    */
   rb_define_method(rb_byte_buffer_class, "get_hash", rb_bson_byte_buffer_get_hash, -1);
 
+  /*
+   * call-seq:
+   *   buffer.get_documents(count = nil, **options) -> Array
+   *
+   * Reads consecutive documents from the byte buffer, such as the
+   * documents of a cursor batch. Reads until the buffer is exhausted, or
+   * until +count+ documents have been read.
+   *
+   * Accepts the same options as get_hash; they are parsed once for all
+   * documents.
+   *
+   * @return [ Array<BSON::Document> ] The decoded documents.
+   */
+  rb_define_method(rb_byte_buffer_class, "get_documents", rb_bson_byte_buffer_get_documents, -1);
+
+  /*
+   * call-seq:
+   *   buffer.each_document(**options) { |document| ... } -> ByteBuffer
+   *   buffer.each_document(**options) -> Enumerator
+   *
+   * Reads consecutive documents from the byte buffer until it is
+   * exhausted, yielding each one as it is decoded.
+   *
+   * Accepts the same options as get_hash.
+   */
+  rb_define_method(rb_byte_buffer_class, "each_document", rb_bson_byte_buffer_each_document, -1);
+
   /*
    * call-seq:
    *   buffer.get_array(**options) -> Array
@@ -283,12 +377,21 @@ void Init_bson_native()
   /*
    * call-seq:
    *   buffer.put_hash(hash) -> ByteBuffer
+   *   buffer.put_hash(hash, exact_size: true) -> ByteBuffer
+   *   buffer.put_hash(hash, max_size: Integer) -> ByteBuffer
    *
    * Writes a Hash into the byte buffer.
    *
+   * With +exact_size+ or +max_size+, the size of the encoded document is
+   * computed first (see BSON.encoded_size) and the buffer is grown once,
+   * to exactly the required size, before the document is written. If the
+   * document would be larger than +max_size+ bytes, or than the largest
+   * size representable in BSON, BSON::Error::DocumentTooLarge is raised
+   * and nothing is written.
+   *
    * Returns the modified +self+.
    */
-  rb_define_method(rb_byte_buffer_class, "put_hash", rb_bson_byte_buffer_put_hash, 1);
+  rb_define_method(rb_byte_buffer_class, "put_hash", rb_bson_byte_buffer_put_hash, -1);
 
   /*
    * call-seq:
@@ -300,6 +403,26 @@ void Init_bson_native()
    */
   rb_define_method(rb_byte_buffer_class, "put_array", rb_bson_byte_buffer_put_array, 1);
 
+  /*
+   * call-seq:
+   *   buffer.put_documents(documents) -> Array<Integer>
+   *
+   * Writes an Array of documents back to back into the byte buffer, as in
+   * an OP_MSG document sequence or a .bson file. Hashes are encoded
+   * natively in a single call, sharing the key and type caches across the
+   * batch; other documents, such as BSON::RawDocument, are written with
+   * their to_bson method.
+   *
+   * Returns the offset of the start of each document, relative to the
+   * read position of the buffer (as for +replace_int32+), so that a batch
+   * can be split at a message size limit without encoding it again. The
+   * offset of the end of the last document is the buffer's +length+.
+   *
+   * @raise [ TypeError ] If an element is not a document. The documents
+   *   before it remain written.
+   */
+  rb_define_method(rb_byte_buffer_class, "put_documents", rb_bson_byte_buffer_put_documents, 1);
+
   /*
    * call-seq:
    *   buffer.replace_int32(position, fixnum) -> ByteBuffer
@@ -329,6 +452,62 @@ void Init_bson_native()
    */
   rb_define_method(rb_byte_buffer_class, "rewind!", rb_bson_byte_buffer_rewind, 0);
 
+  /*
+   * call-seq:
+   *   buffer.capacity -> Integer
+   *
+   * Returns the number of bytes of storage the buffer has allocated. This
+   * includes the bytes already read and written.
+   */
+  rb_define_method(rb_byte_buffer_class, "capacity", rb_bson_byte_buffer_capacity, 0);
+
+  /*
+   * call-seq:
+   *   buffer.reserve(length) -> ByteBuffer
+   *
+   * Ensures that +length+ more bytes can be written without the buffer
+   * growing. When storage must be allocated, exactly the required amount
+   * is allocated rather than double it.
+   *
+   * Returns the modified +self+.
+   */
+  rb_define_method(rb_byte_buffer_class, "reserve", rb_bson_byte_buffer_reserve, 1);
+
+  /*
+   * call-seq:
+   *   buffer.shrink_to_fit -> ByteBuffer
+   *
+   * Releases storage not needed for the unread bytes of the buffer. Bytes
+   * already read are discarded, and contents that fit are moved back into
+   * the storage embedded in the buffer object.
+   *
+   * Returns the modified +self+.
+   */
+  rb_define_method(rb_byte_buffer_class, "shrink_to_fit", rb_bson_byte_buffer_shrink_to_fit, 0);
+
+  /*
+   * call-seq:
+   *   buffer.clear -> ByteBuffer
+   *
+   * Discards the contents of the buffer by resetting its read and write
+   * positions, keeping the storage allocated for reuse.
+   *
+   * Returns the modified +self+.
+   */
+  rb_define_method(rb_byte_buffer_class, "clear", rb_bson_byte_buffer_clear, 0);
+
+  /*
+   * call-seq:
+   *   buffer.truncate(length) -> ByteBuffer
+   *
+   * Discards the unread bytes of the buffer after the first +length+ by
+   * moving the write position back, so that a partially written value
+   * can be removed. +length+ cannot exceed the buffer's length.
+   *
+   * Returns the modified +self+.
+   */
+  rb_define_method(rb_byte_buffer_class, "truncate", rb_bson_byte_buffer_truncate, 1);
+
   /*
    * call-seq:
    *   buffer.to_s -> String
@@ -345,6 +524,320 @@ void Init_bson_native()
    */
   rb_define_method(rb_byte_buffer_class, "to_s", rb_bson_byte_buffer_to_s, 0);
 
+  /*
+   * call-seq:
+   *   ByteBuffer.field_name_cache_size -> Integer
+   *
+   * Returns the number of slots in the cache of decoded field names, or
+   * zero if the cache is disabled.
+   */
+  rb_define_singleton_method(rb_byte_buffer_class, "field_name_cache_size", rb_bson_byte_buffer_field_name_cache_size, 0);
+
+  /*
+   * call-seq:
+   *   ByteBuffer.field_name_cache_size = size -> Integer
+   *
+   * Resizes the cache of decoded field names. The size is rounded up to a
+   * power of two; zero disables the cache.
+   *
+   * Applications should set BSON::Config.field_name_cache_size instead of
+   * calling this method directly.
+   */
+  rb_define_singleton_method(rb_byte_buffer_class, "field_name_cache_size=", rb_bson_byte_buffer_set_field_name_cache_size, 1);
+
+  /*
+   * call-seq:
+   *   ByteBuffer.key_cache_size -> Integer
+   *
+   * Returns the number of slots in the cache of validated hash keys used
+   * when encoding, or zero if the cache is disabled.
+   */
+  rb_define_singleton_method(rb_byte_buffer_class, "key_cache_size", rb_bson_byte_buffer_key_cache_size, 0);
+
+  /*
+   * call-seq:
+   *   ByteBuffer.key_cache_size = size -> Integer
+   *
+   * Resizes the cache of validated hash keys. The size is rounded up to a
+   * power of two; zero disables the cache.
+   *
+   * Applications should set BSON::Config.key_cache_size instead of calling
+   * this method directly.
+   */
+  rb_define_singleton_method(rb_byte_buffer_class, "key_cache_size=", rb_bson_byte_buffer_set_key_cache_size, 1);
+
+  VALUE rb_bson_raw_document_class = rb_const_get(rb_bson_module, rb_intern("RawDocument"));
+
+  /*
+   * call-seq:
+   *   raw_document[key] -> Object
+   *
+   * Returns the decoded value of the field with the given name, or nil if
+   * the document has no such field. +key+ may be a String or a Symbol.
+   *
+   * Only the requested value is decoded; the other elements are skipped
+   * using their length prefixes. Embedded documents are returned as
+   * BSON::RawDocument instances which share this document's bytes.
+   */
+  rb_define_method(rb_bson_raw_document_class, "[]", rb_bson_raw_document_aref, 1);
+
+  /*
+   * call-seq:
+   *   raw_document.key?(key) -> true | false
+   *
+   * Returns whether the document has a field with the given name, without
+   * decoding any values.
+   */
+  rb_define_method(rb_bson_raw_document_class, "key?", rb_bson_raw_document_has_key, 1);
+
+  /*
+   * call-seq:
+   *   raw_document.each { |key, value| ... } -> RawDocument
+   *
+   * Yields each field name and its decoded value in document order.
+   * Embedded documents are yielded as BSON::RawDocument instances.
+   *
+   * Returns an Enumerator when no block is given.
+   */
+  rb_define_method(rb_bson_raw_document_class, "each", rb_bson_raw_document_each, 0);
+
+  /*
+   * call-seq:
+   *   raw_document.keys -> Array
+   *
+   * Returns the field names of the document in order, without decoding
+   * any values.
+   */
+  rb_define_method(rb_bson_raw_document_class, "keys", rb_bson_raw_document_keys, 0);
+
+  /*
+   * call-seq:
+   *   raw_document.splice(edits) -> String
+   *
+   * Returns the encoded document with the edits normalized by
+   * RawDocument#with applied, walking the elements of the document and of
+   * the embedded documents which are edited. Elements which are not edited
+   * are copied without being decoded, and the length prefixes of the
+   * document and of every edited embedded document are recomputed.
+   */
+  rb_define_private_method(rb_bson_raw_document_class, "splice", rb_bson_raw_document_splice, 1);
+
+  VALUE rb_bson_stream_decoder_class = rb_const_get(rb_bson_module, rb_intern("StreamDecoder"));
+
+  /*
+   * call-seq:
+   *   decoder.feed(bytes) { |document| ... } -> StreamDecoder
+   *   decoder.feed(bytes) -> Array
+   *
+   * Appends a chunk of the stream and decodes every document which is now
+   * complete. Yields each document, or returns them as an Array if no
+   * block is given. Bytes of a partially received document are kept until
+   * the rest of it is fed.
+   *
+   * A decoder created with +raw: true+ yields BSON::RawDocument instances
+   * holding a copy of each document's bytes instead of decoding them.
+   *
+   * @raise [ BSON::Error::BSONDecodeError ] If the stream is corrupt, or
+   *   declares a document larger than the decoder's +max_document_size+.
+   *   The decoder cannot be used after this error.
+   */
+  rb_define_method(rb_bson_stream_decoder_class, "feed", rb_bson_stream_decoder_feed, 1);
+
+  /*
+   * call-seq:
+   *   buffer.document { |builder| ... } -> ByteBuffer
+   *
+   * Writes a document whose elements are added, in order, by calling the
+   * methods of the BSON::Builder yielded to the block. The elements are
+   * written straight into the buffer and the length of the document is
+   * filled in once the block returns.
+   *
+   * If the block raises an exception or otherwise exits early, everything
+   * written for the document is removed from the buffer.
+   *
+   * Returns the modified +self+.
+   */
+  rb_define_method(rb_byte_buffer_class, "document", rb_bson_byte_buffer_document, 0);
+
+  VALUE rb_bson_builder_class = rb_const_get(rb_bson_module, rb_intern("Builder"));
+
+  /*
+   * call-seq:
+   *   builder.int32(key, integer) -> Builder
+   *   builder.int32(integer) -> Builder
+   *
+   * Writes a 32-bit integer element. Array builders take no key.
+   *
+   * @raise [ RangeError ] If the integer does not fit in 32 bits.
+   */
+  rb_define_method(rb_bson_builder_class, "int32", rb_bson_builder_int32, -1);
+
+  /*
+   * call-seq:
+   *   builder.int64(key, integer) -> Builder
+   *   builder.int64(integer) -> Builder
+   *
+   * Writes a 64-bit integer element, even if the integer fits in 32 bits.
+   */
+  rb_define_method(rb_bson_builder_class, "int64", rb_bson_builder_int64, -1);
+
+  /*
+   * call-seq:
+   *   builder.double(key, numeric) -> Builder
+   *   builder.double(numeric) -> Builder
+   *
+   * Writes a double element.
+   */
+  rb_define_method(rb_bson_builder_class, "double", rb_bson_builder_double, -1);
+
+  /*
+   * call-seq:
+   *   builder.boolean(key, true_or_false) -> Builder
+   *   builder.boolean(true_or_false) -> Builder
+   *
+   * Writes a boolean element.
+   *
+   * @raise [ TypeError ] If the value is not true or false.
+   */
+  rb_define_method(rb_bson_builder_class, "boolean", rb_bson_builder_boolean, -1);
+
+  /*
+   * call-seq:
+   *   builder.string(key, string) -> Builder
+   *   builder.string(string) -> Builder
+   *
+   * Writes a string element, converting the string to UTF-8 as
+   * ByteBuffer#put_string does.
+   */
+  rb_define_method(rb_bson_builder_class, "string", rb_bson_builder_string, -1);
+
+  /*
+   * call-seq:
+   *   builder.null(key) -> Builder
+   *   builder.null -> Builder
+   *
+   * Writes a null element.
+   */
+  rb_define_method(rb_bson_builder_class, "null", rb_bson_builder_null, -1);
+
+  /*
+   * call-seq:
+   *   builder.value(key, object) -> Builder
+   *   builder.value(object) -> Builder
+   *
+   * Writes an element of any serializable type, which is determined from
+   * the object as it is for the values of a Hash.
+   */
+  rb_define_method(rb_bson_builder_class, "value", rb_bson_builder_value, -1);
+
+  /*
+   * call-seq:
+   *   builder.document(key) { |builder| ... } -> Builder
+   *   builder.document { |builder| ... } -> Builder
+   *
+   * Writes an embedded document, whose elements are added by the block
+   * using the builder yielded to it. This builder cannot be used until the
+   * block returns.
+   */
+  rb_define_method(rb_bson_builder_class, "document", rb_bson_builder_document, -1);
+
+  /*
+   * call-seq:
+   *   builder.array(key) { |builder| ... } -> Builder
+   *   builder.array { |builder| ... } -> Builder
+   *
+   * Writes an array, whose elements are added by the block using the
+   * builder yielded to it, without keys. This builder cannot be used until
+   * the block returns.
+   */
+  rb_define_method(rb_bson_builder_class, "array", rb_bson_builder_array, -1);
+
+  /*
+   * call-seq:
+   *   BSON.validate(data) -> BSON::ValidationFailure | nil
+   *
+   * Checks that +data+, a String or the unread bytes of a ByteBuffer, is
+   * exactly one well-formed BSON document, without decoding it: lengths,
+   * null terminators, type bytes, boolean values, UTF-8 strings and the
+   * nesting depth are validated.
+   *
+   * Inputs of 64 KiB or more are validated with the GVL released; the
+   * bytes of such a ByteBuffer are copied first, since other threads may
+   * write to the buffer meanwhile. Otherwise no Ruby objects are
+   * allocated unless the data is invalid.
+   *
+   * @return [ BSON::ValidationFailure | nil ] The offset of the first
+   *   error and the reason for it, or nil if the data is valid.
+   */
+  rb_define_singleton_method(rb_bson_module, "validate", rb_bson_validate, 1);
+
+  /*
+   * call-seq:
+   *   BSON.encoded_size(obj) -> Integer
+   *
+   * Returns the exact number of bytes +obj+ is encoded into as the value of
+   * a field, which for a Hash is the size of the whole document. The type
+   * byte and field name are not included.
+   *
+   * Hashes, arrays and instances of the built-in types are sized without
+   * being encoded; other values are encoded into a scratch buffer and
+   * measured.
+   */
+  rb_define_singleton_method(rb_bson_module, "encoded_size", rb_bson_encoded_size, 1);
+
+  /*
+   * call-seq:
+   *   BSON.encode(obj) -> String
+   *
+   * Returns +obj+ encoded as BSON, which for a Hash is the whole document,
+   * as a binary String.
+   *
+   * The bytes are written straight into the storage of the returned
+   * String, rather than into a ByteBuffer whose contents are then copied.
+   */
+  rb_define_singleton_method(rb_bson_module, "encode", rb_bson_encode, 1);
+
+  /*
+   * call-seq:
+   *   buffer.valid_bson? -> true | false
+   *
+   * Returns whether the unread bytes of the buffer are exactly one
+   * well-formed BSON document. Does not move the read position.
+   *
+   * @see BSON.validate
+   */
+  rb_define_method(rb_byte_buffer_class, "valid_bson?", rb_bson_byte_buffer_is_valid_bson, 0);
+
+  /* Document-module: BSON::TypeCacheHooks
+   *
+   * Prepended to the singleton classes of the classes whose BSON type
+   * bytes the native encoder caches, which are only those whose bson_type
+   * method is defined by BSON, and of their ancestors up to the module
+   * defining that method. The cache is emptied when bson_type is defined,
+   * removed or undefined in one of them, or when a module is included in
+   * or prepended to one of them.
+   *
+   * @api private
+   */
+  VALUE rb_bson_type_cache_hooks = rb_define_module_under(rb_bson_module, "TypeCacheHooks");
+  rb_define_private_method(rb_bson_type_cache_hooks, "method_added", rb_bson_type_cache_method_changed, 1);
+  rb_define_private_method(rb_bson_type_cache_hooks, "method_removed", rb_bson_type_cache_method_changed, 1);
+  rb_define_private_method(rb_bson_type_cache_hooks, "method_undefined", rb_bson_type_cache_method_changed, 1);
+  rb_define_method(rb_bson_type_cache_hooks, "include", rb_bson_type_cache_ancestors_changed, -1);
+  rb_define_method(rb_bson_type_cache_hooks, "prepend", rb_bson_type_cache_ancestors_changed, -1);
+
+  /*
+   * call-seq:
+   *   BSON::Registry.clear_type_byte_cache -> nil
+   *
+   * Empties the native encoder's cache of BSON type bytes by class. Called
+   * by BSON::Registry.register, which changes the bson_type of a class.
+   *
+   * @api private
+   */
+  rb_define_private_method(rb_singleton_class(rb_const_get(rb_bson_module, rb_intern("Registry"))),
+    "clear_type_byte_cache", rb_bson_type_cache_clear, 0);
+
   rb_define_method(rb_bson_object_id_generator_class, "next_object_id", rb_bson_object_id_generator_next, -1);
   rb_define_method(rb_bson_object_id_generator_class, "reset_counter", rb_bson_object_id_generator_reset_counter, -1);
 
@@ -361,4 +854,13 @@ void Init_bson_native()
 
   rb_bson_registry = rb_const_get(rb_bson_module, rb_intern("Registry"));
   rb_gc_register_mark_object(rb_bson_registry);
+  rb_bson_init_registry_defaults();
+  rb_bson_init_validation();
+  rb_bson_init_encoder();
+  rb_bson_init_builder();
+
+  rb_bson_field_name_cache_resize(NUM2LONG(rb_funcall(
+    rb_const_get(rb_bson_module, rb_intern("Config")), rb_intern("field_name_cache_size"), 0)));
+  rb_bson_key_cache_resize(NUM2LONG(rb_funcall(
+    rb_const_get(rb_bson_module, rb_intern("Config")), rb_intern("key_cache_size"), 0)));
 }
@@ -12,6 +12,14 @@
 #define BSON_ASSERT assert
 #define BSON_INLINE
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BSON_UTF8_USE_SSE2 1
+#endif
+
+#define BSON_UTF8_HIGH_BITS UINT64_C(0x8080808080808080)
+#define BSON_UTF8_LOW_BITS UINT64_C(0x0101010101010101)
+
 
 /*
  *--------------------------------------------------------------------------
@@ -75,9 +83,84 @@ _bson_utf8_get_sequence (const char *utf8,    /* IN */
 /*
  *--------------------------------------------------------------------------
  *
- * bson_utf8_validate --
+ * _bson_utf8_skip_ascii --
+ *
+ *       Returns the offset of the first byte at or after @i which is not
+ *       ASCII, or which is \0 when @allow_null is false. Checks 16 bytes at
+ *       a time with SSE2 where available and 8 bytes at a time otherwise,
+ *       testing for non-ASCII and null bytes in the same pass.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static BSON_INLINE size_t
+_bson_utf8_skip_ascii (const char *utf8,  /* IN */
+                       size_t i,          /* IN */
+                       size_t utf8_len,   /* IN */
+                       bool allow_null)   /* IN */
+{
+#ifdef BSON_UTF8_USE_SSE2
+   const __m128i zero = _mm_setzero_si128 ();
+
+   while (utf8_len - i >= 16) {
+      __m128i chunk = _mm_loadu_si128 ((const __m128i *) (utf8 + i));
+      int mask = _mm_movemask_epi8 (chunk);
+
+      if (!allow_null) {
+         mask |= _mm_movemask_epi8 (_mm_cmpeq_epi8 (chunk, zero));
+      }
+      if (mask) {
+#if defined(__GNUC__)
+         return i + __builtin_ctz (mask);
+#else
+         break;
+#endif
+      }
+      i += 16;
+   }
+#endif
+
+   while (utf8_len - i >= 8) {
+      uint64_t word;
+      uint64_t mask;
+
+      memcpy (&word, utf8 + i, 8);
+      mask = word & BSON_UTF8_HIGH_BITS;
+      if (!allow_null) {
+         /* Sets the high bit of every zero byte (and possibly of bytes
+          * above a zero byte, which are not inspected). */
+         mask |= (word - BSON_UTF8_LOW_BITS) & ~word & BSON_UTF8_HIGH_BITS;
+      }
+      if (mask) {
+         break;
+      }
+      i += 8;
+   }
+
+   while (i < utf8_len) {
+      unsigned char c = (unsigned char) utf8[i];
+      if (c & 0x80 || (!allow_null && !c)) {
+         break;
+      }
+      i++;
+   }
+
+   return i;
+}
+
+
+/* Reason reported by rb_bson_utf8_check for strings containing null bytes. */
+const char *const rb_bson_utf8_null_byte_reason = "contains null bytes";
+
+/* Reason reported by rb_bson_utf8_check for code points above U+10FFFF. */
+const char *const rb_bson_utf8_code_point_reason = "code point does not fit in UTF-16";
+
+/*
+ *--------------------------------------------------------------------------
  *
- *       Validates that @utf8 is a valid UTF-8 string. Note that we only
+ * rb_bson_utf8_check --
+ *
+ *       Checks that @utf8 is a valid UTF-8 string. Note that we only
  *       support UTF-8 characters which have sequence length less than or equal
  *       to 4 bytes (RFC 3629).
  *
@@ -87,51 +170,67 @@ _bson_utf8_get_sequence (const char *utf8,    /* IN */
  *       However, some languages such as Python can send UTF-8 encoded
  *       strings with NUL's in them.
  *
+ *       This function does not call into Ruby and may be used without
+ *       holding the GVL.
+ *
  * Parameters:
  *       @utf8: A UTF-8 encoded string.
  *       @utf8_len: The length of @utf8 in bytes.
  *       @allow_null: If \0 is allowed within @utf8, exclusing trailing \0.
- *       @data_type: The data type being serialized.
+ *       @error_offset: Set to the offset of the offending character if
+ *       the string is invalid. May be NULL.
+ *       @code_point: Set to the offending code point if it does not fit
+ *       in UTF-16. May be NULL.
  *
  * Returns:
- *       true if @utf8 is valid UTF-8. otherwise false.
+ *       NULL if @utf8 is valid UTF-8, otherwise a static string describing
+ *       the problem.
  *
  * Side effects:
- *       None.
+ *       @error_offset and @code_point are set on failure.
  *
  *--------------------------------------------------------------------------
  */
 
-void
-rb_bson_utf8_validate (const char *utf8, /* IN */
+const char *
+rb_bson_utf8_check (const char *utf8, /* IN */
                     size_t utf8_len,  /* IN */
                     bool allow_null, /* IN */
-                    const char *data_type)  /* IN */
+                    size_t *error_offset, /* OUT */
+                    uint32_t *code_point)  /* OUT */
 {
    uint32_t c;
    uint8_t first_mask;
    uint8_t seq_length;
-   unsigned i;
-   unsigned j;
+   size_t i;
+   size_t j;
    bool not_shortest_form;
+   const char *reason = NULL;
 
    BSON_ASSERT (utf8);
 
    for (i = 0; i < utf8_len; i += seq_length) {
+      i = _bson_utf8_skip_ascii (utf8, i, utf8_len, allow_null);
+      if (i >= utf8_len) {
+         break;
+      }
+
       _bson_utf8_get_sequence (&utf8[i], &seq_length, &first_mask);
 
       /*
        * Ensure we have a valid multi-byte sequence length.
        */
       if (!seq_length) {
-         rb_raise(rb_eEncodingError, "%s %s is not valid UTF-8: bogus initial bits", data_type, utf8);
+         reason = "bogus initial bits";
+         break;
       }
 
       /*
        * Ensure we have enough bytes left.
        */
       if ((utf8_len - i) < seq_length) {
-         rb_raise(rb_eEncodingError, "%s %s is not valid UTF-8: truncated multi-byte sequence", data_type, utf8);
+         reason = "truncated multi-byte sequence";
+         break;
       }
 
       /*
@@ -146,31 +245,32 @@ rb_bson_utf8_validate (const char *utf8, /* IN */
       for (j = i + 1; j < (i + seq_length); j++) {
          c = (c << 6) | (utf8[j] & 0x3F);
          if ((utf8[j] & 0xC0) != 0x80) {
-            rb_raise(rb_eEncodingError, "%s %s is not valid UTF-8: bogus high bits for continuation byte", data_type, utf8);
+            reason = "bogus high bits for continuation byte";
+            break;
          }
       }
+      if (reason) {
+         break;
+      }
 
       /*
-       * Check for NULL bytes afterwards.
-       *
-       * Hint: if you want to optimize this function, starting here to do
-       * this in the same pass as the data above would probably be a good
-       * idea. You would add a branch into the inner loop, but save possibly
-       * on cache-line bouncing on larger strings. Just a thought.
+       * A null byte can only be a whole one-byte sequence, since any other
+       * byte of a multi-byte sequence has its high bit set.
        */
-      if (!allow_null) {
-         for (j = 0; j < seq_length; j++) {
-            if (((i + j) > utf8_len) || !utf8[i + j]) {
-               rb_raise(rb_eArgError, "%s %s contains null bytes", data_type, utf8);
-            }
-         }
+      if (!allow_null && c == 0 && seq_length == 1) {
+         reason = rb_bson_utf8_null_byte_reason;
+         break;
       }
 
       /*
        * Code point won't fit in utf-16, not allowed.
        */
       if (c > 0x0010FFFF) {
-         rb_raise(rb_eEncodingError, "%s %s is not valid UTF-8: code point %"PRIu32" does not fit in UTF-16", data_type, utf8, c);
+         reason = rb_bson_utf8_code_point_reason;
+         if (code_point) {
+            *code_point = c;
+         }
+         break;
       }
 
       /*
@@ -178,7 +278,8 @@ rb_bson_utf8_validate (const char *utf8, /* IN */
        * for surrogate pairs.
        */
       if ((c & 0xFFFFF800) == 0xD800) {
-         rb_raise(rb_eEncodingError, "%s %s is not valid UTF-8: byte is in surrogate pair reserved range", data_type, utf8);
+         reason = "byte is in surrogate pair reserved range";
+         break;
       }
 
       /*
@@ -198,7 +299,8 @@ rb_bson_utf8_validate (const char *utf8, /* IN */
          } else if (c == 0) {
             /* Two-byte representation for NULL. */
             if (!allow_null) {
-               rb_raise(rb_eArgError, "%s %s contains null bytes", data_type, utf8);
+               reason = rb_bson_utf8_null_byte_reason;
+               break;
             }
             continue;
          }
@@ -222,9 +324,64 @@ rb_bson_utf8_validate (const char *utf8, /* IN */
       default:
          not_shortest_form = true;
       }
-      
+
+      if (reason) {
+         break;
+      }
       if (not_shortest_form) {
-        rb_raise(rb_eEncodingError, "%s %s is not valid UTF-8: not in shortest form", data_type, utf8);
+         reason = "not in shortest form";
+         break;
       }
    }
+
+   if (reason && error_offset) {
+      *error_offset = i;
+   }
+   return reason;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * bson_utf8_validate --
+ *
+ *       Validates that @utf8 is a valid UTF-8 string, raising an exception
+ *       if it is not. See rb_bson_utf8_check.
+ *
+ * Parameters:
+ *       @utf8: A UTF-8 encoded string.
+ *       @utf8_len: The length of @utf8 in bytes.
+ *       @allow_null: If \0 is allowed within @utf8, exclusing trailing \0.
+ *       @data_type: The data type being serialized.
+ *
+ * Returns:
+ *       None.
+ *
+ * Side effects:
+ *       Raises ArgumentError if @utf8 contains disallowed null bytes, or
+ *       EncodingError if it is not valid UTF-8.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+rb_bson_utf8_validate (const char *utf8, /* IN */
+                    size_t utf8_len,  /* IN */
+                    bool allow_null, /* IN */
+                    const char *data_type)  /* IN */
+{
+   uint32_t code_point = 0;
+   const char *reason = rb_bson_utf8_check (utf8, utf8_len, allow_null, NULL, &code_point);
+
+   if (!reason) {
+      return;
+   }
+   if (reason == rb_bson_utf8_null_byte_reason) {
+      rb_raise(rb_eArgError, "%s %s contains null bytes", data_type, utf8);
+   }
+   if (reason == rb_bson_utf8_code_point_reason) {
+      rb_raise(rb_eEncodingError, "%s %s is not valid UTF-8: code point %"PRIu32" does not fit in UTF-16", data_type, utf8, code_point);
+   }
+   rb_raise(rb_eEncodingError, "%s %s is not valid UTF-8: %s", data_type, utf8, reason);
 }
@@ -0,0 +1,553 @@
+/*
+ * Copyright (C) 2009-2020 MongoDB Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bson-native.h"
+#include <ruby/encoding.h>
+
+/**
+ * The state needed to walk and decode the elements of a BSON::RawDocument.
+ *
+ * `data` is the frozen String holding the encoded document, `buffer` is a
+ * scratch ByteBuffer which is lazily allocated, along with the `decoder`
+ * context reading from it, the first time a value other than an embedded
+ * document needs to be decoded.
+ */
+typedef struct {
+  VALUE self;
+  VALUE data;
+  VALUE options;
+  VALUE buffer;
+  decode_context_t decoder;
+  const char *ptr;
+  int32_t length;
+} raw_document_t;
+
+/* Callback invoked for every element; returning non-zero stops the walk. */
+typedef int (*raw_element_callback)(raw_document_t *doc, uint8_t type,
+  const char *key, size_t key_length, int32_t value_offset,
+  int32_t value_length, void *arg);
+
+static void pvt_raw_document_init(raw_document_t *doc, VALUE self);
+static void pvt_raw_walk(raw_document_t *doc, int32_t offset, int32_t length,
+  raw_element_callback callback, void *arg);
+static VALUE pvt_raw_decode_value(raw_document_t *doc, uint8_t type,
+  int32_t offset, int32_t length, int depth);
+static VALUE pvt_raw_key_string(VALUE key);
+
+/**
+ * Creates a BSON::RawDocument holding a copy of the `length` bytes of the
+ * encoded document at `ptr`, whose length prefix has already been read.
+ */
+VALUE rb_bson_raw_document_new(const char *ptr, int32_t length, VALUE options)
+{
+  VALUE raw;
+
+  if (ptr[length - 1] != 0) {
+    pvt_raise_decode_error(rb_str_new_cstr("Document is not null-terminated"));
+  }
+
+  raw = rb_obj_alloc(pvt_const_get_2("BSON", "RawDocument"));
+  rb_ivar_set(raw, rb_intern("@data"), rb_obj_freeze(rb_str_new(ptr, length)));
+  rb_ivar_set(raw, rb_intern("@options"), options);
+  return raw;
+}
+
+/**
+ * Loads the encoded bytes and decoding options of a BSON::RawDocument.
+ */
+void pvt_raw_document_init(raw_document_t *doc, VALUE self)
+{
+  doc->self = self;
+  doc->data = rb_ivar_get(self, rb_intern("@data"));
+  doc->options = rb_ivar_get(self, rb_intern("@options"));
+  doc->buffer = Qnil;
+
+  if (!RB_TYPE_P(doc->data, T_STRING)) {
+    rb_raise(rb_eTypeError, "BSON::RawDocument is not initialized");
+  }
+  if (!NIL_P(doc->options) && RHASH_SIZE(doc->options) == 0) {
+    doc->options = Qnil;
+  }
+
+  doc->ptr = RSTRING_PTR(doc->data);
+  doc->length = (int32_t)RSTRING_LEN(doc->data);
+}
+
+/**
+ * Walks the elements of the document (or array) whose encoded form occupies
+ * `length` bytes at `offset` in the raw document, invoking `callback` for
+ * each element. Values are skipped over using their length prefixes and are
+ * not decoded.
+ */
+void pvt_raw_walk(raw_document_t *doc, int32_t offset, int32_t length,
+  raw_element_callback callback, void *arg)
+{
+  const char *start = doc->ptr + offset;
+  const char *end = start + length - 1;
+  const char *p = start + 4;
+
+  while (p < end) {
+    uint8_t type = (uint8_t)*p;
+    const char *key = p + 1;
+    const char *key_end;
+    int64_t value_length;
+
+    if (type == 0) {
+      break;
+    }
+
+    key_end = memchr(key, '\0', end - key);
+    if (!key_end) {
+      pvt_raise_decode_error(rb_sprintf("Unterminated field name at offset %ld", (long)(key - doc->ptr)));
+    }
+
+    p = key_end + 1;
+    value_length = pvt_value_length(type, p, end - p);
+    if (value_length < 0) {
+      /* Raises BSON::Error::UnsupportedType for unknown type bytes. */
+      rb_funcall(rb_bson_registry, rb_intern("get"), 2, INT2FIX(type),
+        rb_enc_str_new(key, key_end - key, rb_utf8_encoding()));
+      pvt_raise_decode_error(rb_sprintf("Invalid value for field '%s' at offset %ld", key, (long)(p - doc->ptr)));
+    }
+
+    if (callback(doc, type, key, key_end - key, (int32_t)(p - doc->ptr), (int32_t)value_length, arg)) {
+      return;
+    }
+    p += value_length;
+  }
+
+  if (p != end) {
+    pvt_raise_decode_error(rb_sprintf("Expected to read %d bytes for the hash but read %ld bytes", length, (long)(p - start + 1)));
+  }
+}
+
+/**
+ * Decodes a single value. Embedded documents are returned as RawDocument
+ * instances sharing the parent's bytes and arrays are walked so that the
+ * documents they contain also remain raw. Every other type is decoded by
+ * the regular field reader.
+ */
+VALUE pvt_raw_decode_value(raw_document_t *doc, uint8_t type,
+  int32_t offset, int32_t length, int depth)
+{
+  byte_buffer_t *b;
+
+  switch (type) {
+    case BSON_TYPE_DOCUMENT: {
+      VALUE klass = rb_obj_class(doc->self);
+      VALUE raw = rb_obj_alloc(klass);
+      rb_ivar_set(raw, rb_intern("@data"), rb_obj_freeze(rb_str_substr(doc->data, offset, length)));
+      /* doc->options is nil rather than an empty Hash when there are no
+       * options, which #to_h cannot splat. */
+      rb_ivar_set(raw, rb_intern("@options"), rb_ivar_get(doc->self, rb_intern("@options")));
+      return raw;
+    }
+    case BSON_TYPE_ARRAY: {
+      VALUE array = rb_ary_new();
+      const char *start = doc->ptr + offset;
+      const char *end = start + length - 1;
+      const char *p = start + 4;
+
+      pvt_check_nesting_depth(depth);
+      while (p < end && *p != 0) {
+        uint8_t element_type = (uint8_t)*p;
+        const char *key_end = memchr(p + 1, '\0', end - p - 1);
+        int64_t value_length;
+
+        if (!key_end) {
+          pvt_raise_decode_error(rb_sprintf("Unterminated array index at offset %ld", (long)(p - doc->ptr)));
+        }
+        p = key_end + 1;
+        value_length = pvt_value_length(element_type, p, end - p);
+        if (value_length < 0) {
+          rb_funcall(rb_bson_registry, rb_intern("get"), 1, INT2FIX(element_type));
+          pvt_raise_decode_error(rb_sprintf("Invalid array element at offset %ld", (long)(p - doc->ptr)));
+        }
+        rb_ary_push(array, pvt_raw_decode_value(doc, element_type,
+          (int32_t)(p - doc->ptr), (int32_t)value_length, depth + 1));
+        p += value_length;
+      }
+      if (p != end) {
+        pvt_raise_decode_error(rb_sprintf("Expected to read %d bytes for the array but read %ld bytes", length, (long)(p - start + 1)));
+      }
+      return array;
+    }
+    default:
+      break;
+  }
+
+  if (NIL_P(doc->buffer)) {
+    doc->buffer = rb_obj_alloc(pvt_const_get_2("BSON", "ByteBuffer"));
+    pvt_init_decode_context(&doc->decoder, doc->buffer, NIL_P(doc->options) ? 0 : 1, &doc->options);
+  }
+  b = doc->decoder.b;
+
+  /* Copy only the bytes of this value into the scratch buffer. */
+  b->read_position = 0;
+  b->write_position = 0;
+  ENSURE_BSON_WRITE(b, (size_t)length);
+  memcpy(WRITE_PTR(b), doc->ptr + offset, length);
+  b->write_position = length;
+
+  return pvt_read_field(&doc->decoder, type, depth);
+}
+
+/**
+ * Returns the field name to look up for the given key, which may be a
+ * String or a Symbol.
+ */
+VALUE pvt_raw_key_string(VALUE key)
+{
+  if (RB_TYPE_P(key, T_SYMBOL)) {
+    return rb_sym2str(key);
+  }
+  return rb_String(key);
+}
+
+typedef struct {
+  const char *key;
+  size_t key_length;
+  uint8_t type;
+  int32_t value_offset;
+  int32_t value_length;
+} raw_lookup_t;
+
+static int pvt_raw_lookup_callback(raw_document_t *doc, uint8_t type,
+  const char *key, size_t key_length, int32_t value_offset,
+  int32_t value_length, void *arg)
+{
+  raw_lookup_t *lookup = (raw_lookup_t *)arg;
+
+  if (key_length == lookup->key_length && memcmp(key, lookup->key, key_length) == 0) {
+    lookup->type = type;
+    lookup->value_offset = value_offset;
+    lookup->value_length = value_length;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Finds the element with the given key. Returns 1 and fills in `lookup` if
+ * the element exists, 0 otherwise.
+ */
+static int pvt_raw_lookup(raw_document_t *doc, VALUE key, raw_lookup_t *lookup)
+{
+  VALUE key_str = pvt_raw_key_string(key);
+
+  lookup->key = RSTRING_PTR(key_str);
+  lookup->key_length = RSTRING_LEN(key_str);
+  lookup->type = 0;
+
+  pvt_raw_walk(doc, 0, doc->length, pvt_raw_lookup_callback, lookup);
+  RB_GC_GUARD(key_str);
+  return lookup->type != 0;
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_raw_document_aref(VALUE self, VALUE key)
+{
+  raw_document_t doc;
+  raw_lookup_t lookup;
+  VALUE value = Qnil;
+
+  pvt_raw_document_init(&doc, self);
+  if (pvt_raw_lookup(&doc, key, &lookup)) {
+    value = pvt_raw_decode_value(&doc, lookup.type, lookup.value_offset, lookup.value_length, 2);
+  }
+
+  RB_GC_GUARD(doc.data);
+  RB_GC_GUARD(doc.buffer);
+  return value;
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_raw_document_has_key(VALUE self, VALUE key)
+{
+  raw_document_t doc;
+  raw_lookup_t lookup;
+  int found;
+
+  pvt_raw_document_init(&doc, self);
+  found = pvt_raw_lookup(&doc, key, &lookup);
+
+  RB_GC_GUARD(doc.data);
+  return found ? Qtrue : Qfalse;
+}
+
+static int pvt_raw_each_callback(raw_document_t *doc, uint8_t type,
+  const char *key, size_t key_length, int32_t value_offset,
+  int32_t value_length, void *arg)
+{
+  VALUE field = pvt_get_field_name(key, (long)key_length);
+  VALUE value = pvt_raw_decode_value(doc, type, value_offset, value_length, 2);
+
+  rb_yield(rb_assoc_new(field, value));
+  return 0;
+}
+
+static VALUE pvt_raw_document_size(VALUE self, VALUE args, VALUE eobj)
+{
+  return LONG2NUM(RARRAY_LEN(rb_bson_raw_document_keys(self)));
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_raw_document_each(VALUE self)
+{
+  raw_document_t doc;
+
+  RETURN_SIZED_ENUMERATOR(self, 0, 0, pvt_raw_document_size);
+
+  pvt_raw_document_init(&doc, self);
+  pvt_raw_walk(&doc, 0, doc.length, pvt_raw_each_callback, NULL);
+
+  RB_GC_GUARD(doc.data);
+  RB_GC_GUARD(doc.buffer);
+  return self;
+}
+
+static int pvt_raw_keys_callback(raw_document_t *doc, uint8_t type,
+  const char *key, size_t key_length, int32_t value_offset,
+  int32_t value_length, void *arg)
+{
+  rb_ary_push((VALUE)arg, pvt_get_field_name(key, (long)key_length));
+  return 0;
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_raw_document_keys(VALUE self)
+{
+  raw_document_t doc;
+  VALUE keys = rb_ary_new();
+
+  pvt_raw_document_init(&doc, self);
+  pvt_raw_walk(&doc, 0, doc.length, pvt_raw_keys_callback, (void *)keys);
+
+  RB_GC_GUARD(doc.data);
+  return keys;
+}
+
+static const char pvt_empty_document[5] = { 5, 0, 0, 0, 0 };
+
+/**
+ * Returns whether the edits (see RawDocument#with) set any field, and
+ * would therefore create a document which does not exist yet.
+ */
+static int pvt_raw_edits_set(VALUE edits)
+{
+  long i;
+
+  for (i = 0; i < RARRAY_LEN(edits); i++) {
+    VALUE edit = RARRAY_AREF(edits, i);
+    VALUE op = RARRAY_AREF(edit, 1);
+
+    if (op == ID2SYM(rb_intern("set"))) {
+      return 1;
+    }
+    if (op == ID2SYM(rb_intern("edit")) && pvt_raw_edits_set(RARRAY_AREF(edit, 2))) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Returns whether the document of `length` bytes at `src` has a field
+ * named `name`. Stops at the first malformed element, which the caller
+ * reports.
+ */
+static int pvt_raw_splice_has_key(const char *src, int32_t length, VALUE name)
+{
+  const char *end = src + length - 1;
+  const char *p = src + 4;
+
+  while (p < end && *p != 0) {
+    const char *key = p + 1;
+    const char *key_end = memchr(key, '\0', end - key);
+    int64_t value_length;
+
+    if (!key_end) {
+      return 0;
+    }
+    if (RSTRING_LEN(name) == key_end - key && memcmp(RSTRING_PTR(name), key, key_end - key) == 0) {
+      return 1;
+    }
+    value_length = pvt_value_length((uint8_t)*p, key_end + 1, end - key_end - 1);
+    if (value_length < 0) {
+      return 0;
+    }
+    p = key_end + 1 + value_length;
+  }
+  return 0;
+}
+
+static void pvt_raw_copy(byte_buffer_t *b, const char *ptr, size_t length)
+{
+  ENSURE_BSON_WRITE(b, length);
+  memcpy(WRITE_PTR(b), ptr, length);
+  b->write_position += length;
+}
+
+/**
+ * Writes the document (or, if `is_array` is set, the array) of `length`
+ * bytes at `src` to the buffer with the edits applied, and returns nothing.
+ *
+ * Each edit is an Array of the field name, an operation (:set, :unset,
+ * :rename, :rename_target or :edit) and its argument: the value to set,
+ * the new name of the field, the name of the field renamed to this one
+ * (which removes this field only if that field exists) or the edits to
+ * apply to the embedded document. Runs of
+ * elements which are not edited are copied with a single memcpy, and the
+ * length prefix is written once the document is complete.
+ */
+static void pvt_raw_splice(byte_buffer_t *b, VALUE buffer, const char *src,
+  int32_t length, VALUE edits, int is_array, int depth)
+{
+  const ID id_set = rb_intern("set"), id_rename = rb_intern("rename"), id_edit = rb_intern("edit");
+  const ID id_rename_target = rb_intern("rename_target");
+  const long count = RARRAY_LEN(edits);
+  const char *end = src + length - 1;
+  const char *p = src + 4;
+  const char *run = p;
+  size_t position;
+  VALUE applied_holder;
+  char *applied;
+  long i;
+
+  pvt_check_nesting_depth(depth);
+  applied = ALLOCV_N(char, applied_holder, count);
+  memset(applied, 0, count);
+
+  position = READ_SIZE(b);
+  pvt_put_int32(b, 0);
+
+  while (p < end && *p != 0) {
+    uint8_t type = (uint8_t)*p;
+    const char *key = p + 1;
+    const char *key_end = memchr(key, '\0', end - key);
+    const char *value;
+    int64_t value_length;
+    VALUE edit = Qnil, op, arg;
+
+    if (!key_end) {
+      pvt_raise_decode_error(rb_sprintf("Unterminated field name at offset %ld", (long)(key - src)));
+    }
+    value = key_end + 1;
+    value_length = pvt_value_length(type, value, end - value);
+    if (value_length < 0) {
+      pvt_raise_decode_error(rb_sprintf("Invalid value for field '%s' at offset %ld", key, (long)(value - src)));
+    }
+    p = value + value_length;
+
+    for (i = 0; i < count; i++) {
+      VALUE name = RARRAY_AREF(RARRAY_AREF(edits, i), 0);
+      if (RSTRING_LEN(name) == key_end - key && memcmp(RSTRING_PTR(name), key, key_end - key) == 0) {
+        edit = RARRAY_AREF(edits, i);
+        applied[i] = 1;
+        break;
+      }
+    }
+    if (NIL_P(edit)) {
+      continue;
+    }
+
+    op = RARRAY_AREF(edit, 1);
+    arg = RARRAY_AREF(edit, 2);
+    /* A field is only replaced by a renamed one which exists. */
+    if (op == ID2SYM(id_rename_target) && !pvt_raw_splice_has_key(src, length, arg)) {
+      continue;
+    }
+
+    /* Copy the elements before this one which are not edited. */
+    pvt_raw_copy(b, run, key - 1 - run);
+    run = p;
+
+    if (op == ID2SYM(id_set)) {
+      pvt_put_type_byte(b, arg);
+      pvt_raw_copy(b, key, key_end - key + 1);
+      pvt_put_field(b, buffer, arg);
+    } else if (op == ID2SYM(id_rename)) {
+      pvt_put_byte(b, (char)type);
+      pvt_put_key(b, buffer, arg);
+      pvt_raw_copy(b, value, (size_t)value_length);
+    } else if (op == ID2SYM(id_edit)) {
+      if (type != BSON_TYPE_DOCUMENT && type != BSON_TYPE_ARRAY) {
+        rb_raise(rb_eArgError, "Cannot edit the fields of '%s', which is not a document or an array", key);
+      }
+      pvt_raw_copy(b, key - 1, key_end - key + 2);
+      pvt_raw_splice(b, buffer, value, (int32_t)value_length, arg, type == BSON_TYPE_ARRAY, depth + 1);
+    } else if (is_array) {
+      rb_raise(rb_eArgError, "Cannot remove or rename the array element '%s'", key);
+    }
+  }
+
+  if (p != end) {
+    pvt_raise_decode_error(rb_sprintf("Expected to read %d bytes for the document but read %ld bytes", length, (long)(p - src + 1)));
+  }
+  pvt_raw_copy(b, run, p - run);
+
+  /* Fields which are set but do not exist yet are appended, creating the
+   * documents which contain them. Unsetting or renaming a field which does
+   * not exist does nothing. */
+  for (i = 0; i < count; i++) {
+    VALUE edit = RARRAY_AREF(edits, i);
+    VALUE name = RARRAY_AREF(edit, 0);
+    VALUE op = RARRAY_AREF(edit, 1);
+    VALUE arg = RARRAY_AREF(edit, 2);
+
+    if (applied[i] || (op != ID2SYM(id_set) && !(op == ID2SYM(id_edit) && pvt_raw_edits_set(arg)))) {
+      continue;
+    }
+    if (is_array) {
+      rb_raise(rb_eArgError, "Cannot add the array element '%s'", RSTRING_PTR(name));
+    }
+    if (op == ID2SYM(id_set)) {
+      pvt_put_type_byte(b, arg);
+      pvt_put_key(b, buffer, name);
+      pvt_put_field(b, buffer, arg);
+    } else {
+      pvt_put_byte(b, BSON_TYPE_DOCUMENT);
+      pvt_put_key(b, buffer, name);
+      pvt_raw_splice(b, buffer, pvt_empty_document, 5, arg, 0, depth + 1);
+    }
+  }
+
+  pvt_put_byte(b, 0);
+  pvt_replace_int32(b, (int32_t)position, (int32_t)(READ_SIZE(b) - position));
+  ALLOCV_END(applied_holder);
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_raw_document_splice(VALUE self, VALUE edits)
+{
+  raw_document_t doc;
+  VALUE buffer, string;
+  byte_buffer_t *b;
+
+  Check_Type(edits, T_ARRAY);
+  pvt_raw_document_init(&doc, self);
+
+  buffer = rb_obj_alloc(pvt_const_get_2("BSON", "ByteBuffer"));
+  string = rb_str_buf_new(doc.length + BSON_BYTE_BUFFER_SIZE);
+  rb_enc_associate_index(string, rb_ascii8bit_encindex());
+  TypedData_Get_Struct(buffer, byte_buffer_t, &rb_byte_buffer_data_type, b);
+  rb_bson_byte_buffer_attach_target(b, string);
+
+  pvt_raw_splice(b, buffer, doc.ptr, doc.length, edits, 0, 1);
+
+  RB_GC_GUARD(doc.data);
+  return rb_bson_byte_buffer_detach_target(b);
+}
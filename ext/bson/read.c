@@ -17,26 +17,75 @@
 #include "bson-native.h"
 #include <ruby/encoding.h>
 
-static void pvt_raise_decode_error(volatile VALUE msg);
 static int32_t pvt_validate_length(byte_buffer_t *b);
 static uint8_t pvt_get_type_byte(byte_buffer_t *b);
 static VALUE pvt_get_int32(byte_buffer_t *b);
 static VALUE pvt_get_uint32(byte_buffer_t *b);
-static VALUE pvt_get_int64(byte_buffer_t *b, int argc, VALUE *argv);
+static VALUE pvt_get_int64(byte_buffer_t *b);
 static VALUE pvt_get_double(byte_buffer_t *b);
 static VALUE pvt_get_string(byte_buffer_t *b, const char *data_type);
-static VALUE pvt_get_symbol(byte_buffer_t *b, VALUE rb_buffer, int argc, VALUE *argv);
+static VALUE pvt_get_cstring(byte_buffer_t *b);
+static VALUE pvt_get_symbol(decode_context_t *ctx);
 static VALUE pvt_get_boolean(byte_buffer_t *b);
-static VALUE pvt_read_field(byte_buffer_t *b, VALUE rb_buffer, uint8_t type, int argc, VALUE *argv, int depth);
-static VALUE pvt_get_hash_at_depth(int argc, VALUE *argv, VALUE self, int depth);
-static VALUE pvt_get_array_at_depth(int argc, VALUE *argv, VALUE self, int depth);
-static void pvt_check_nesting_depth(int depth);
 static void pvt_skip_cstring(byte_buffer_t *b);
 static size_t pvt_strnlen(const byte_buffer_t *b);
+static VALUE pvt_read_field_from_registry(decode_context_t *ctx, uint8_t type);
+static VALUE pvt_get_object_id(byte_buffer_t *b);
+static VALUE pvt_get_datetime(byte_buffer_t *b);
+static VALUE pvt_get_binary(byte_buffer_t *b);
+static VALUE pvt_get_decimal128(decode_context_t *ctx);
+static VALUE pvt_get_regex(byte_buffer_t *b);
+static VALUE pvt_get_timestamp(byte_buffer_t *b);
+static VALUE pvt_get_code(byte_buffer_t *b);
+static VALUE pvt_get_code_with_scope(decode_context_t *ctx, int depth);
+static VALUE pvt_get_db_pointer(byte_buffer_t *b);
+static VALUE pvt_decode_document(decode_context_t *ctx, uint8_t type, int depth, VALUE projection, int exclude);
+static void pvt_skip_field(byte_buffer_t *b, uint8_t type, VALUE field);
+static VALUE pvt_compile_projection(VALUE paths);
+
+/* BSON::Registry::MAPPINGS, and the classes it held when the extension was
+ * loaded, indexed by type byte. */
+static VALUE pvt_registry_mappings = Qnil;
+static VALUE pvt_default_classes[256];
+static VALUE pvt_regexp_raw_class = Qnil;
+static VALUE pvt_decimal128_class = Qnil;
+static VALUE pvt_document_class = Qnil;
+static VALUE pvt_dbref_class = Qnil;
+static VALUE pvt_symbol_raw_class = Qnil;
+static VALUE pvt_binary_types = Qnil;
+
+/* Method and instance variable names used while decoding. */
+static ID pvt_id_get, pvt_id_new, pvt_id_from_bson, pvt_id_to_d;
+static ID pvt_id_raw_data, pvt_id_low, pvt_id_high, pvt_id_pattern,
+  pvt_id_options, pvt_id_seconds, pvt_id_increment, pvt_id_javascript,
+  pvt_id_scope, pvt_id_ref, pvt_id_id;
+
+/* A document or array whose elements are being read by
+ * pvt_decode_document. */
+typedef struct {
+  /* The Hash or Array the elements are stored in. */
+  VALUE container;
+  /* The field name (or, in an array, the index) of the container in the
+   * enclosing container. */
+  VALUE slot;
+  /* The fields selected by the projection, or nil to read every field. */
+  VALUE projection;
+  size_t start_position;
+  int32_t length;
+  uint8_t type;
+} decode_frame_t;
+
+/* Number of frames pvt_decode_document keeps on the C stack before moving
+ * its frame stack to the heap. */
+#define BSON_DECODE_INLINE_FRAMES 32
 
-/* Maximum number of nested BSON documents or arrays the decoder will accept.
- * Mirrors BSON::MAX_NESTING_DEPTH in lib/bson.rb. */
-#define BSON_RUBY_MAX_NESTING_DEPTH 200
+/* Direct-mapped cache of frozen field names, or nil when disabled. The
+ * number of slots is always a power of two. */
+static VALUE pvt_field_name_cache = Qnil;
+static unsigned long pvt_field_name_cache_mask = 0;
+
+/* Field names longer than this are never cached. */
+#define BSON_FIELD_NAME_CACHE_MAX_KEY_LENGTH 64
 
 void pvt_raise_decode_error(volatile VALUE msg) {
   VALUE klass = pvt_const_get_3("BSON", "Error", "BSONDecodeError");
@@ -82,43 +131,466 @@ int32_t pvt_validate_length(byte_buffer_t *b)
 }
 
 /**
- * Read a single field from a hash or array. `depth` is the current nesting
- * depth; nested documents/arrays bump it before recursing.
+ * Returns the number of bytes occupied by the value of a field of the given
+ * BSON type which starts at `ptr`, without decoding the value. `available` is
+ * the number of bytes that may be examined. Returns -1 if the type is not
+ * known or if the value is malformed or does not fit in `available` bytes.
+ */
+int64_t pvt_value_length(uint8_t type, const char *ptr, size_t available)
+{
+  int32_t length;
+  int64_t value_length;
+  const char *terminator;
+
+  switch(type) {
+    case BSON_TYPE_UNDEFINED:
+    case BSON_TYPE_NULL:
+    case BSON_TYPE_MIN_KEY:
+    case BSON_TYPE_MAX_KEY:
+      value_length = 0;
+      break;
+    case BSON_TYPE_BOOLEAN:
+      value_length = 1;
+      break;
+    case BSON_TYPE_INT32:
+      value_length = 4;
+      break;
+    case BSON_TYPE_DOUBLE:
+    case BSON_TYPE_DATETIME:
+    case BSON_TYPE_TIMESTAMP:
+    case BSON_TYPE_INT64:
+      value_length = 8;
+      break;
+    case BSON_TYPE_OBJECT_ID:
+      value_length = 12;
+      break;
+    case BSON_TYPE_DECIMAL128:
+      value_length = 16;
+      break;
+    case BSON_TYPE_STRING:
+    case BSON_TYPE_CODE:
+    case BSON_TYPE_SYMBOL:
+    case BSON_TYPE_DB_POINTER:
+      if (available < 4) return -1;
+      memcpy(&length, ptr, 4);
+      length = BSON_UINT32_FROM_LE(length);
+      if (length < 1) return -1;
+      value_length = 4 + (int64_t)length;
+      if (type == BSON_TYPE_DB_POINTER) value_length += 12;
+      break;
+    case BSON_TYPE_DOCUMENT:
+    case BSON_TYPE_ARRAY:
+    case BSON_TYPE_CODE_WITH_SCOPE:
+      if (available < 4) return -1;
+      memcpy(&length, ptr, 4);
+      length = BSON_UINT32_FROM_LE(length);
+      if (length < 5) return -1;
+      value_length = length;
+      break;
+    case BSON_TYPE_BINARY:
+      if (available < 4) return -1;
+      memcpy(&length, ptr, 4);
+      length = BSON_UINT32_FROM_LE(length);
+      if (length < 0) return -1;
+      value_length = 5 + (int64_t)length;
+      break;
+    case BSON_TYPE_REGEX:
+      terminator = memchr(ptr, '\0', available);
+      if (!terminator) return -1;
+      value_length = terminator - ptr + 1;
+      terminator = memchr(ptr + value_length, '\0', available - value_length);
+      if (!terminator) return -1;
+      value_length = terminator - ptr + 1;
+      break;
+    default:
+      return -1;
+  }
+
+  if ((size_t)value_length > available) {
+    return -1;
+  }
+  return value_length;
+}
+
+/**
+ * Prepares `ctx` for decoding values from `rb_buffer`. The options are
+ * parsed at most once per context, rather than for every value that
+ * depends on them.
+ * `argv` must remain valid for as long as the context is used.
  */
-VALUE pvt_read_field(byte_buffer_t *b, VALUE rb_buffer, uint8_t type, int argc, VALUE *argv, int depth)
+void pvt_init_decode_context(decode_context_t *ctx, VALUE rb_buffer, int argc, VALUE *argv)
 {
+  TypedData_Get_Struct(rb_buffer, byte_buffer_t, &rb_byte_buffer_data_type, ctx->b);
+  ctx->rb_buffer = rb_buffer;
+  ctx->argc = argc;
+  ctx->argv = argv;
+  ctx->mode = -1;
+  ctx->int64_class = Qundef;
+  ctx->symbol_class = Qundef;
+}
+
+/**
+ * Returns the :mode option of the context, parsing it on first use.
+ */
+static int pvt_decode_mode(decode_context_t *ctx)
+{
+  if (ctx->mode < 0) {
+    ctx->mode = pvt_get_mode_option(ctx->argc, ctx->argv);
+  }
+  return ctx->mode;
+}
+
+/**
+ * Read a single field from a hash or array. `depth` is the nesting depth of
+ * the hash or array containing the field.
+ */
+VALUE pvt_read_field(decode_context_t *ctx, uint8_t type, int depth)
+{
+  byte_buffer_t *b = ctx->b;
+
   switch(type) {
     case BSON_TYPE_INT32: return pvt_get_int32(b);
-    case BSON_TYPE_INT64: return pvt_get_int64(b, argc, argv);
+    case BSON_TYPE_INT64:
+      if (pvt_decode_mode(ctx) == BSON_MODE_BSON) {
+        if (ctx->int64_class == Qundef) {
+          ctx->int64_class = rb_funcall(rb_bson_registry, pvt_id_get, 1, INT2FIX(BSON_TYPE_INT64));
+        }
+        return rb_funcall(ctx->int64_class, pvt_id_new, 1, pvt_get_int64(b));
+      }
+      return pvt_get_int64(b);
     case BSON_TYPE_DOUBLE: return pvt_get_double(b);
     case BSON_TYPE_STRING: return pvt_get_string(b, "String");
-    case BSON_TYPE_SYMBOL: return pvt_get_symbol(b, rb_buffer, argc, argv);
-    case BSON_TYPE_ARRAY: return pvt_get_array_at_depth(argc, argv, rb_buffer, depth + 1);
-    case BSON_TYPE_DOCUMENT: return pvt_get_hash_at_depth(argc, argv, rb_buffer, depth + 1);
+    case BSON_TYPE_SYMBOL: return pvt_get_symbol(ctx);
+    case BSON_TYPE_ARRAY:
+    case BSON_TYPE_DOCUMENT:
+      return pvt_decode_document(ctx, type, depth + 1, Qnil, 0);
     case BSON_TYPE_BOOLEAN: return pvt_get_boolean(b);
     default:
-    {
-      VALUE klass = rb_funcall(rb_bson_registry, rb_intern("get"), 1, INT2FIX(type));
-      VALUE value;
-      if (argc > 1) {
-        rb_raise(rb_eArgError, "At most one argument is allowed");
-      } else if (argc > 0) {
-        VALUE call_args[2];
-        call_args[0] = rb_buffer;
-        Check_Type(argv[0], T_HASH);
-        call_args[1] = argv[0];
+      break;
+  }
+
+  /* The remaining types are decoded natively unless the application has
+   * registered its own class for the type byte, in which case that class'
+   * from_bson is used. */
+  if (pvt_is_default_class(type)) {
+    switch(type) {
+      case BSON_TYPE_OBJECT_ID: return pvt_get_object_id(b);
+      case BSON_TYPE_DATETIME: return pvt_get_datetime(b);
+      case BSON_TYPE_NULL: return Qnil;
+      case BSON_TYPE_BINARY: return pvt_get_binary(b);
+      case BSON_TYPE_DECIMAL128: return pvt_get_decimal128(ctx);
+      case BSON_TYPE_REGEX: return pvt_get_regex(b);
+      case BSON_TYPE_TIMESTAMP: return pvt_get_timestamp(b);
+      case BSON_TYPE_CODE: return pvt_get_code(b);
+      case BSON_TYPE_CODE_WITH_SCOPE: return pvt_get_code_with_scope(ctx, depth);
+      case BSON_TYPE_DB_POINTER: return pvt_get_db_pointer(b);
+      case BSON_TYPE_UNDEFINED:
+      case BSON_TYPE_MIN_KEY:
+      case BSON_TYPE_MAX_KEY:
+        return rb_class_new_instance(0, NULL, pvt_default_classes[type]);
+      default:
+        break;
+    }
+  }
+
+  return pvt_read_field_from_registry(ctx, type);
+}
+
+/**
+ * Reads a field by looking up the class registered for its type byte in
+ * BSON::Registry and calling its from_bson method.
+ */
+VALUE pvt_read_field_from_registry(decode_context_t *ctx, uint8_t type)
+{
+  VALUE klass = rb_funcall(rb_bson_registry, pvt_id_get, 1, INT2FIX(type));
+  VALUE value;
+  if (ctx->argc > 1) {
+    rb_raise(rb_eArgError, "At most one argument is allowed");
+  } else if (ctx->argc > 0) {
+    VALUE call_args[2];
+    call_args[0] = ctx->rb_buffer;
+    Check_Type(ctx->argv[0], T_HASH);
+    call_args[1] = ctx->argv[0];
 #ifdef RB_PASS_KEYWORDS /* Ruby 2.7+ */
-        value = rb_funcallv_kw(klass, rb_intern("from_bson"), 2, call_args, RB_PASS_KEYWORDS);
+    value = rb_funcallv_kw(klass, pvt_id_from_bson, 2, call_args, RB_PASS_KEYWORDS);
 #else /* Ruby 2.6 and below */
-        value = rb_funcallv(klass, rb_intern("from_bson"), 2, call_args);
+    value = rb_funcallv(klass, pvt_id_from_bson, 2, call_args);
 #endif
-      } else {
-        value = rb_funcall(klass, rb_intern("from_bson"), 1, rb_buffer);
-      }
-      RB_GC_GUARD(klass);
-      return value;
+  } else {
+    value = rb_funcall(klass, pvt_id_from_bson, 1, ctx->rb_buffer);
+  }
+  RB_GC_GUARD(klass);
+  return value;
+}
+
+/**
+ * Remembers the classes registered in BSON::Registry when the extension is
+ * loaded, so that the decoder can tell whether an application has since
+ * replaced the class for a type byte. Also resolves the other constants and
+ * names the decoder needs up front.
+ */
+void rb_bson_init_registry_defaults(void)
+{
+  int type;
+
+  pvt_id_get = rb_intern("get");
+  pvt_id_new = rb_intern("new");
+  pvt_id_from_bson = rb_intern("from_bson");
+  pvt_id_to_d = rb_intern("to_d");
+  pvt_id_raw_data = rb_intern("@raw_data");
+  pvt_id_low = rb_intern("@low");
+  pvt_id_high = rb_intern("@high");
+  pvt_id_pattern = rb_intern("@pattern");
+  pvt_id_options = rb_intern("@options");
+  pvt_id_seconds = rb_intern("@seconds");
+  pvt_id_increment = rb_intern("@increment");
+  pvt_id_javascript = rb_intern("@javascript");
+  pvt_id_scope = rb_intern("@scope");
+  pvt_id_ref = rb_intern("@ref");
+  pvt_id_id = rb_intern("@id");
+
+  pvt_registry_mappings = rb_const_get(rb_bson_registry, rb_intern("MAPPINGS"));
+  rb_gc_register_mark_object(pvt_registry_mappings);
+
+  for (type = 0; type < 256; type++) {
+    pvt_default_classes[type] = rb_hash_lookup2(pvt_registry_mappings, INT2FIX(type), Qundef);
+    if (pvt_default_classes[type] != Qundef) {
+      rb_gc_register_mark_object(pvt_default_classes[type]);
+    }
+  }
+
+  pvt_regexp_raw_class = pvt_const_get_3("BSON", "Regexp", "Raw");
+  rb_gc_register_mark_object(pvt_regexp_raw_class);
+  pvt_decimal128_class = pvt_const_get_2("BSON", "Decimal128");
+  rb_gc_register_mark_object(pvt_decimal128_class);
+  pvt_document_class = pvt_const_get_2("BSON", "Document");
+  rb_gc_register_mark_object(pvt_document_class);
+  pvt_dbref_class = pvt_const_get_2("BSON", "DBRef");
+  rb_gc_register_mark_object(pvt_dbref_class);
+  pvt_symbol_raw_class = pvt_const_get_3("BSON", "Symbol", "Raw");
+  rb_gc_register_mark_object(pvt_symbol_raw_class);
+  pvt_binary_types = rb_const_get(pvt_default_classes[BSON_TYPE_BINARY], rb_intern("TYPES"));
+  rb_gc_register_mark_object(pvt_binary_types);
+}
+
+/**
+ * Returns whether the registration for the type byte is still the one
+ * bson-ruby made by default, including when bson-ruby registered no class
+ * for it. Registering a class also redefines its bson_type, so the encoder
+ * uses this to decide whether a built-in class still has its stock type.
+ */
+int pvt_is_default_class(uint8_t type)
+{
+  VALUE klass = rb_hash_lookup2(pvt_registry_mappings, INT2FIX(type), Qundef);
+  return klass == pvt_default_classes[type];
+}
+
+/**
+ * Reads an ObjectId; equivalent to BSON::ObjectId.from_bson.
+ */
+VALUE pvt_get_object_id(byte_buffer_t *b)
+{
+  VALUE object_id;
+
+  ENSURE_BSON_READ(b, 12);
+  object_id = rb_obj_alloc(pvt_default_classes[BSON_TYPE_OBJECT_ID]);
+  rb_ivar_set(object_id, pvt_id_raw_data, rb_str_new(READ_PTR(b), 12));
+  b->read_position += 12;
+  return object_id;
+}
+
+/**
+ * Reads a UTC datetime as a Time in UTC; equivalent to Time.from_bson.
+ */
+VALUE pvt_get_datetime(byte_buffer_t *b)
+{
+  int64_t i64;
+  int64_t seconds;
+  int64_t milliseconds;
+  struct timespec ts;
+
+  ENSURE_BSON_READ(b, 8);
+  memcpy(&i64, READ_PTR(b), 8);
+  b->read_position += 8;
+  i64 = BSON_UINT64_FROM_LE(i64);
+
+  /* Floored division, matching Integer#divmod. */
+  seconds = i64 / 1000;
+  milliseconds = i64 % 1000;
+  if (milliseconds < 0) {
+    seconds -= 1;
+    milliseconds += 1000;
+  }
+
+  ts.tv_sec = (time_t)seconds;
+  ts.tv_nsec = (long)(milliseconds * 1000000);
+  /* An offset of INT_MAX-1 requests a UTC time. */
+  return rb_time_timespec_new(&ts, INT_MAX - 1);
+}
+
+/**
+ * Reads a binary value; equivalent to BSON::Binary.from_bson.
+ */
+VALUE pvt_get_binary(byte_buffer_t *b)
+{
+  int32_t length;
+  uint8_t subtype;
+  VALUE type;
+  VALUE data;
+  VALUE args[2];
+
+  ENSURE_BSON_READ(b, 5);
+  memcpy(&length, READ_PTR(b), 4);
+  length = BSON_UINT32_FROM_LE(length);
+  subtype = (uint8_t)*(READ_PTR(b) + 4);
+  b->read_position += 5;
+
+  type = rb_str_new((const char *)&subtype, 1);
+  if (subtype < 0x80) {
+    type = rb_hash_aref(pvt_binary_types, type);
+    if (NIL_P(type)) {
+      VALUE klass = pvt_const_get_3("BSON", "Error", "UnsupportedBinarySubtype");
+      rb_raise(klass, "BSON data contains unsupported binary subtype 0x%02x", (int)subtype);
     }
   }
+
+  if (subtype == 0x02) {
+    int32_t inner_length;
+
+    ENSURE_BSON_READ(b, 4);
+    memcpy(&inner_length, READ_PTR(b), 4);
+    inner_length = BSON_UINT32_FROM_LE(inner_length);
+    b->read_position += 4;
+    if (inner_length != length - 4) {
+      pvt_raise_decode_error(rb_sprintf("BSON binary subtype 0x02 length mismatch: outer=%d, inner=%d", length, inner_length));
+    }
+    length = inner_length;
+  }
+
+  if (length < 0) {
+    pvt_raise_decode_error(rb_sprintf("BSON binary length is negative: %d", length));
+  }
+
+  ENSURE_BSON_READ(b, length);
+  data = pvt_buffer_substring(b, READ_PTR(b), length);
+  b->read_position += length;
+
+  args[0] = data;
+  args[1] = type;
+  return rb_class_new_instance(2, args, pvt_default_classes[BSON_TYPE_BINARY]);
+}
+
+/**
+ * Reads a Decimal128; equivalent to BigDecimal.from_bson. Returns a
+ * BSON::Decimal128 when the :mode option is :bson, and a BigDecimal
+ * otherwise.
+ */
+VALUE pvt_get_decimal128(decode_context_t *ctx)
+{
+  byte_buffer_t *b = ctx->b;
+  uint64_t low;
+  uint64_t high;
+  VALUE decimal;
+
+  ENSURE_BSON_READ(b, 16);
+  memcpy(&low, READ_PTR(b), 8);
+  memcpy(&high, READ_PTR(b) + 8, 8);
+  b->read_position += 16;
+
+  decimal = rb_obj_alloc(pvt_decimal128_class);
+  rb_ivar_set(decimal, pvt_id_low, ULL2NUM(BSON_UINT64_FROM_LE(low)));
+  rb_ivar_set(decimal, pvt_id_high, ULL2NUM(BSON_UINT64_FROM_LE(high)));
+
+  if (pvt_decode_mode(ctx) == BSON_MODE_BSON) {
+    return decimal;
+  }
+  return rb_funcall(decimal, pvt_id_to_d, 0);
+}
+
+/**
+ * Reads a regular expression as a BSON::Regexp::Raw; equivalent to
+ * Regexp.from_bson.
+ */
+VALUE pvt_get_regex(byte_buffer_t *b)
+{
+  VALUE pattern = pvt_get_cstring(b);
+  VALUE options = pvt_get_cstring(b);
+  VALUE raw = rb_obj_alloc(pvt_regexp_raw_class);
+
+  rb_ivar_set(raw, pvt_id_pattern, pattern);
+  rb_ivar_set(raw, pvt_id_options, options);
+  return raw;
+}
+
+/**
+ * Reads a timestamp; equivalent to BSON::Timestamp.from_bson.
+ */
+VALUE pvt_get_timestamp(byte_buffer_t *b)
+{
+  VALUE increment = pvt_get_uint32(b);
+  VALUE seconds = pvt_get_uint32(b);
+  VALUE timestamp = rb_obj_alloc(pvt_default_classes[BSON_TYPE_TIMESTAMP]);
+
+  rb_ivar_set(timestamp, pvt_id_seconds, seconds);
+  rb_ivar_set(timestamp, pvt_id_increment, increment);
+  return timestamp;
+}
+
+/**
+ * Reads JavaScript code; equivalent to BSON::Code.from_bson.
+ */
+VALUE pvt_get_code(byte_buffer_t *b)
+{
+  VALUE code = rb_obj_alloc(pvt_default_classes[BSON_TYPE_CODE]);
+  rb_ivar_set(code, pvt_id_javascript, pvt_get_string(b, "String"));
+  return code;
+}
+
+/**
+ * Reads JavaScript code with its scope document; equivalent to
+ * BSON::CodeWithScope.from_bson.
+ */
+VALUE pvt_get_code_with_scope(decode_context_t *ctx, int depth)
+{
+  byte_buffer_t *b = ctx->b;
+  int32_t length;
+  size_t start_position = b->read_position;
+  size_t read_bytes;
+  VALUE javascript;
+  VALUE scope;
+  VALUE code;
+
+  ENSURE_BSON_READ(b, 4);
+  memcpy(&length, READ_PTR(b), 4);
+  length = BSON_UINT32_FROM_LE(length);
+  b->read_position += 4;
+
+  javascript = pvt_get_string(b, "String");
+  scope = pvt_decode_document(ctx, BSON_TYPE_DOCUMENT, depth + 1, Qnil, 0);
+
+  read_bytes = b->read_position - start_position;
+  if (read_bytes != (size_t)length) {
+    pvt_raise_decode_error(rb_sprintf("CodeWithScope invalid: claimed length %d, actual length %zu", length, read_bytes));
+  }
+
+  code = rb_obj_alloc(pvt_default_classes[BSON_TYPE_CODE_WITH_SCOPE]);
+  rb_ivar_set(code, pvt_id_javascript, javascript);
+  rb_ivar_set(code, pvt_id_scope, scope);
+  return code;
+}
+
+/**
+ * Reads a DBPointer; equivalent to BSON::DbPointer.from_bson.
+ */
+VALUE pvt_get_db_pointer(byte_buffer_t *b)
+{
+  VALUE ref = pvt_get_string(b, "String");
+  VALUE id = pvt_get_object_id(b);
+  VALUE pointer = rb_obj_alloc(pvt_default_classes[BSON_TYPE_DB_POINTER]);
+
+  rb_ivar_set(pointer, pvt_id_ref, ref);
+  rb_ivar_set(pointer, pvt_id_id, id);
+  return pointer;
 }
 
 /**
@@ -155,7 +627,7 @@ VALUE rb_bson_byte_buffer_get_bytes(VALUE self, VALUE i)
 
   TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
   ENSURE_BSON_READ(b, length);
-  bytes = rb_str_new(READ_PTR(b), length);
+  bytes = pvt_buffer_substring(b, READ_PTR(b), length);
   b->read_position += length;
   return bytes;
 }
@@ -214,34 +686,30 @@ VALUE pvt_get_string(byte_buffer_t *b, const char *data_type)
     pvt_raise_decode_error(rb_sprintf("Last byte of the string is not null: 0x%x", (int) last_byte));
   }
   rb_bson_utf8_validate(str_ptr, length - 1, true, data_type);
-  string = rb_enc_str_new(str_ptr, length - 1, rb_utf8_encoding());
+  string = pvt_buffer_substring(b, str_ptr, length - 1);
+  rb_enc_associate(string, rb_utf8_encoding());
   b->read_position += 4 + length;
   return string;
 }
 
 /**
- * Reads a UTF-8 string out of the byte buffer. If the argc/argv arguments
- * have a :mode option with the value of :bson, wraps the string in a
- * BSON::Symbol::Raw. Otherwise consults the BSON registry to determine
- * which class to instantiate (String in bson-ruby, overridden to Symbol by
- * the Ruby driver). Returns either a BSON::Symbol::Raw, Symbol or String
- * value.
+ * Reads a UTF-8 string out of the byte buffer. If the :mode option is
+ * :bson, wraps the string in a BSON::Symbol::Raw. Otherwise consults the
+ * BSON registry to determine which class to instantiate (String in
+ * bson-ruby, overridden to Symbol by the Ruby driver). Returns either a
+ * BSON::Symbol::Raw, Symbol or String value.
  */
-VALUE pvt_get_symbol(byte_buffer_t *b, VALUE rb_buffer, int argc, VALUE *argv)
+VALUE pvt_get_symbol(decode_context_t *ctx)
 {
-  VALUE value, klass;
-
-  if (pvt_get_mode_option(argc, argv) == BSON_MODE_BSON) {
-    value = pvt_get_string(b, "Symbol");
-    klass = pvt_const_get_3("BSON", "Symbol", "Raw");
-    value = rb_funcall(klass, rb_intern("new"), 1, value);
-  } else {
-    klass = rb_funcall(rb_bson_registry, rb_intern("get"), 1, INT2FIX(BSON_TYPE_SYMBOL));
-    value = rb_funcall(klass, rb_intern("from_bson"), 1, rb_buffer);
+  if (pvt_decode_mode(ctx) == BSON_MODE_BSON) {
+    VALUE value = pvt_get_string(ctx->b, "Symbol");
+    return rb_funcall(pvt_symbol_raw_class, pvt_id_new, 1, value);
   }
 
-  RB_GC_GUARD(klass);
-  return value;
+  if (ctx->symbol_class == Qundef) {
+    ctx->symbol_class = rb_funcall(rb_bson_registry, pvt_id_get, 1, INT2FIX(BSON_TYPE_SYMBOL));
+  }
+  return rb_funcall(ctx->symbol_class, pvt_id_from_bson, 1, ctx->rb_buffer);
 }
 
 /**
@@ -250,10 +718,16 @@ VALUE pvt_get_symbol(byte_buffer_t *b, VALUE rb_buffer, int argc, VALUE *argv)
 VALUE rb_bson_byte_buffer_get_cstring(VALUE self)
 {
   byte_buffer_t *b;
+
+  TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
+  return pvt_get_cstring(b);
+}
+
+VALUE pvt_get_cstring(byte_buffer_t *b)
+{
   VALUE string;
   int length;
 
-  TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
   length = (int)pvt_strnlen(b);
   ENSURE_BSON_READ(b, length);
   string = rb_enc_str_new(READ_PTR(b), length, rb_utf8_encoding());
@@ -261,6 +735,117 @@ VALUE rb_bson_byte_buffer_get_cstring(VALUE self)
   return string;
 }
 
+/**
+ * Returns a new frozen UTF-8 String for a field name. Where the interpreter
+ * supports it the String is deduplicated, so all decoded documents share a
+ * single copy of each field name.
+ */
+static VALUE pvt_new_field_name(const char *ptr, long length)
+{
+#ifdef HAVE_RB_ENC_INTERNED_STR
+  return rb_enc_interned_str(ptr, length, rb_utf8_encoding());
+#else
+  return rb_obj_freeze(rb_enc_str_new(ptr, length, rb_utf8_encoding()));
+#endif
+}
+
+/**
+ * Returns a frozen String for the field name of `length` bytes at `ptr`.
+ * Recently seen field names are served from the field name cache, so
+ * repeatedly decoding documents with the same keys does not allocate. Since
+ * the returned String is frozen, rb_hash_aset uses it as the key without
+ * copying it.
+ */
+VALUE pvt_get_field_name(const char *ptr, long length)
+{
+  uint32_t hash = 2166136261u;
+  unsigned long slot;
+  VALUE field;
+  long i;
+
+  if (NIL_P(pvt_field_name_cache) || length > BSON_FIELD_NAME_CACHE_MAX_KEY_LENGTH) {
+    return pvt_new_field_name(ptr, length);
+  }
+
+  /* FNV-1a */
+  for (i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)ptr[i]) * 16777619u;
+  }
+  slot = hash & pvt_field_name_cache_mask;
+
+  field = RARRAY_AREF(pvt_field_name_cache, slot);
+  if (!NIL_P(field) && RSTRING_LEN(field) == length && memcmp(RSTRING_PTR(field), ptr, length) == 0) {
+    return field;
+  }
+
+  field = pvt_new_field_name(ptr, length);
+  rb_ary_store(pvt_field_name_cache, slot, field);
+  return field;
+}
+
+/**
+ * Reads a field name from the buffer.
+ */
+static VALUE pvt_get_field_name_from_buffer(byte_buffer_t *b)
+{
+  VALUE field;
+  int length;
+
+  length = (int)pvt_strnlen(b);
+  ENSURE_BSON_READ(b, length);
+  field = pvt_get_field_name(READ_PTR(b), length);
+  b->read_position += length + 1;
+  return field;
+}
+
+/**
+ * Replaces the field name cache with one of at least `size` slots, rounded
+ * up to a power of two. A size of zero disables the cache.
+ */
+void rb_bson_field_name_cache_resize(long size)
+{
+  static int registered = 0;
+  unsigned long slots = 1;
+
+  if (!registered) {
+    rb_gc_register_address(&pvt_field_name_cache);
+    registered = 1;
+  }
+
+  if (size < 0) {
+    rb_raise(rb_eArgError, "Field name cache size must not be negative: %ld", size);
+  }
+
+  if (size == 0) {
+    pvt_field_name_cache = Qnil;
+    pvt_field_name_cache_mask = 0;
+    return;
+  }
+
+  while (slots < (unsigned long)size) {
+    slots <<= 1;
+  }
+  pvt_field_name_cache = rb_ary_new_capa((long)slots);
+  rb_ary_store(pvt_field_name_cache, (long)slots - 1, Qnil);
+  pvt_field_name_cache_mask = slots - 1;
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_byte_buffer_set_field_name_cache_size(VALUE klass, VALUE size)
+{
+  rb_bson_field_name_cache_resize(NUM2LONG(size));
+  return size;
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_byte_buffer_field_name_cache_size(VALUE klass)
+{
+  if (NIL_P(pvt_field_name_cache)) {
+    return INT2FIX(0);
+  }
+  return ULONG2NUM(pvt_field_name_cache_mask + 1);
+}
+
 /**
  * Reads but does not return a cstring from the buffer.
  */
@@ -322,35 +907,21 @@ VALUE rb_bson_byte_buffer_get_int64(VALUE self)
 {
   byte_buffer_t *b;
   TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
-  return pvt_get_int64(b, 0, NULL);
+  return pvt_get_int64(b);
 }
 
 /**
- * Reads a 64-bit integer out of the byte buffer into a Ruby Integer instance.
- * If the argc/argv arguments have a :mode option with the value of :bson,
- * wraps the integer in a BSON::Int64. Returns either the Integer or the
- * BSON::Int64 instance.
+ * Reads a 64-bit integer out of the byte buffer into a Ruby Integer
+ * instance. pvt_read_field wraps it in a BSON::Int64 in :bson mode.
  */
-VALUE pvt_get_int64(byte_buffer_t *b, int argc, VALUE *argv)
+VALUE pvt_get_int64(byte_buffer_t *b)
 {
   int64_t i64;
-  VALUE num;
 
   ENSURE_BSON_READ(b, 8);
   memcpy(&i64, READ_PTR(b), 8);
   b->read_position += 8;
-  num = LL2NUM(BSON_UINT64_FROM_LE(i64));
-
-  if (pvt_get_mode_option(argc, argv) == BSON_MODE_BSON) {
-    VALUE klass = rb_funcall(rb_bson_registry,rb_intern("get"),1, INT2FIX(BSON_TYPE_INT64));
-    VALUE value = rb_funcall(klass, rb_intern("new"), 1, num);
-    RB_GC_GUARD(klass);
-    return value;
-  } else {
-    return num;
-  }
-
-  RB_GC_GUARD(num);
+  return LL2NUM(BSON_UINT64_FROM_LE(i64));
 }
 
 /**
@@ -413,75 +984,411 @@ static int pvt_is_dbref(VALUE doc) {
   return 1;
 }
 
+/**
+ * Parses the options of get_hash and friends once, separating the :only
+ * and :except projection from the options which are passed on to the
+ * readers of individual values. Stores the remaining options in `opts`
+ * and returns the number of arguments to pass along with it.
+ */
+static int pvt_prepare_hash_options(int argc, VALUE *argv, VALUE *opts, VALUE *projection, int *exclude)
+{
+  VALUE only, except;
+
+  *opts = pvt_get_options_hash(argc, argv);
+  *projection = Qnil;
+  *exclude = 0;
+
+  if (NIL_P(*opts)) {
+    return 0;
+  }
+
+  only = rb_hash_lookup(*opts, ID2SYM(rb_intern("only")));
+  except = rb_hash_lookup(*opts, ID2SYM(rb_intern("except")));
+  if (NIL_P(only) && NIL_P(except)) {
+    return 1;
+  }
+  if (!NIL_P(only) && !NIL_P(except)) {
+    rb_raise(rb_eArgError, "Cannot specify both :only and :except");
+  }
+
+  *projection = pvt_compile_projection(NIL_P(only) ? except : only);
+  *exclude = !NIL_P(except);
+
+  /* The projection only applies to the top-level documents. */
+  *opts = rb_hash_dup(*opts);
+  rb_hash_delete(*opts, ID2SYM(rb_intern("only")));
+  rb_hash_delete(*opts, ID2SYM(rb_intern("except")));
+
+  return RHASH_SIZE(*opts) == 0 ? 0 : 1;
+}
+
 VALUE rb_bson_byte_buffer_get_hash(int argc, VALUE *argv, VALUE self){
-  return pvt_get_hash_at_depth(argc, argv, self, 1);
+  decode_context_t ctx;
+  VALUE opts, projection, doc;
+  int exclude;
+
+  argc = pvt_prepare_hash_options(argc, argv, &opts, &projection, &exclude);
+  pvt_init_decode_context(&ctx, self, argc, &opts);
+  doc = pvt_decode_document(&ctx, BSON_TYPE_DOCUMENT, 1, projection, exclude);
+
+  RB_GC_GUARD(opts);
+  RB_GC_GUARD(projection);
+  return doc;
 }
 
-VALUE pvt_get_hash_at_depth(int argc, VALUE *argv, VALUE self, int depth){
-  VALUE doc = Qnil;
-  byte_buffer_t *b = NULL;
-  uint8_t type;
-  VALUE cDocument = pvt_const_get_2("BSON", "Document");
-  int32_t length;
-  char *start_ptr;
+VALUE rb_bson_byte_buffer_get_documents(int argc, VALUE *argv, VALUE self){
+  decode_context_t ctx;
+  VALUE count, opts, projection, documents;
+  long limit = -1;
+  int exclude;
+
+  rb_scan_args(argc, argv, "01:", &count, &opts);
+  if (!NIL_P(count)) {
+    limit = NUM2LONG(count);
+    if (limit < 0) {
+      rb_raise(rb_eArgError, "Document count must not be negative: %ld", limit);
+    }
+  }
 
-  pvt_check_nesting_depth(depth);
+  argc = pvt_prepare_hash_options(NIL_P(opts) ? 0 : 1, &opts, &opts, &projection, &exclude);
+  pvt_init_decode_context(&ctx, self, argc, &opts);
 
-  TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
+  documents = rb_ary_new_capa(limit < 0 ? 0 : limit);
+  while (READ_SIZE(ctx.b) > 0 && (limit < 0 || RARRAY_LEN(documents) < limit)) {
+    rb_ary_push(documents, pvt_decode_document(&ctx, BSON_TYPE_DOCUMENT, 1, projection, exclude));
+  }
 
-  start_ptr = READ_PTR(b);
-  length = pvt_validate_length(b);
+  RB_GC_GUARD(opts);
+  RB_GC_GUARD(projection);
+  return documents;
+}
 
-  doc = rb_funcall(cDocument, rb_intern("allocate"), 0);
+VALUE rb_bson_byte_buffer_each_document(int argc, VALUE *argv, VALUE self){
+  decode_context_t ctx;
+  VALUE opts, projection;
+  int exclude;
 
-  while((type = pvt_get_type_byte(b)) != 0){
-    VALUE field = rb_bson_byte_buffer_get_cstring(self);
-    rb_hash_aset(doc, field, pvt_read_field(b, self, type, argc, argv, depth));
-    RB_GC_GUARD(field);
+  RETURN_ENUMERATOR(self, argc, argv);
+
+  argc = pvt_prepare_hash_options(argc, argv, &opts, &projection, &exclude);
+  pvt_init_decode_context(&ctx, self, argc, &opts);
+
+  while (READ_SIZE(ctx.b) > 0) {
+    rb_yield(pvt_decode_document(&ctx, BSON_TYPE_DOCUMENT, 1, projection, exclude));
+  }
+
+  RB_GC_GUARD(opts);
+  RB_GC_GUARD(projection);
+  return self;
+}
+
+VALUE rb_bson_stream_decoder_feed(VALUE self, VALUE bytes){
+  decode_context_t ctx;
+  byte_buffer_t *b;
+  VALUE buffer, options, opts, projection, documents = Qnil;
+  int32_t length_le;
+  int32_t length;
+  size_t bytes_length, max_document_size;
+  int exclude, argc, raw;
+
+  StringValue(bytes);
+  max_document_size = NUM2SIZET(rb_ivar_get(self, rb_intern("@max_document_size")));
+  buffer = rb_ivar_get(self, rb_intern("@buffer"));
+  options = rb_ivar_get(self, rb_intern("@options"));
+  raw = RTEST(rb_ivar_get(self, rb_intern("@raw")));
+  argc = NIL_P(options) || RHASH_SIZE(options) == 0 ? 0 : 1;
+  argc = pvt_prepare_hash_options(argc, &options, &opts, &projection, &exclude);
+
+  pvt_init_decode_context(&ctx, buffer, argc, &opts);
+  b = ctx.b;
+
+  /* Once every buffered document has been decoded, start over at the
+   * beginning of the buffer rather than moving leftover bytes around. */
+  if (READ_SIZE(b) == 0) {
+    b->read_position = 0;
+    b->write_position = 0;
   }
 
-  if (READ_PTR(b) - start_ptr != length) {
-    pvt_raise_decode_error(rb_sprintf("Expected to read %d bytes for the hash but read %ld bytes", length, READ_PTR(b) - start_ptr));
+  bytes_length = RSTRING_LEN(bytes);
+  ENSURE_BSON_WRITE(b, bytes_length);
+  memcpy(WRITE_PTR(b), RSTRING_PTR(bytes), bytes_length);
+  b->write_position += bytes_length;
+
+  if (!rb_block_given_p()) {
+    documents = rb_ary_new();
   }
 
-  if (pvt_is_dbref(doc)) {
-    VALUE cDBRef = pvt_const_get_2("BSON", "DBRef");
-    doc = rb_funcall(cDBRef, rb_intern("new"), 1, doc);
+  while (READ_SIZE(b) >= 4) {
+    VALUE doc;
+
+    memcpy(&length_le, READ_PTR(b), 4);
+    length = BSON_UINT32_FROM_LE(length_le);
+    if (length < 5) {
+      pvt_raise_decode_error(rb_sprintf("Invalid document length in stream: %d", length));
+    }
+    if ((size_t)length > max_document_size) {
+      pvt_raise_decode_error(rb_sprintf("Document length in stream of %d bytes exceeds the maximum of %zu bytes",
+        length, max_document_size));
+    }
+
+    if (READ_SIZE(b) < (size_t)length) {
+      /* Make room for the rest of the document now, so that it is moved
+       * at most once however many chunks it arrives in. */
+      if (b->size - b->read_position < (size_t)length) {
+        rb_bson_expand_buffer(b, length - READ_SIZE(b));
+      }
+      break;
+    }
+
+    if (raw) {
+      doc = rb_bson_raw_document_new(READ_PTR(b), length, options);
+      b->read_position += length;
+    } else {
+      doc = pvt_decode_document(&ctx, BSON_TYPE_DOCUMENT, 1, projection, exclude);
+    }
+    if (NIL_P(documents)) {
+      rb_yield(doc);
+    } else {
+      rb_ary_push(documents, doc);
+    }
   }
 
-  return doc;
+  RB_GC_GUARD(bytes);
+  RB_GC_GUARD(opts);
+  RB_GC_GUARD(projection);
+  return NIL_P(documents) ? self : documents;
 }
 
-VALUE rb_bson_byte_buffer_get_array(int argc, VALUE *argv, VALUE self){
-  return pvt_get_array_at_depth(argc, argv, self, 1);
+/**
+ * Starts reading the document or array at the read position into `frame`,
+ * creating the empty container its elements will be stored in.
+ */
+static void pvt_push_frame(byte_buffer_t *b, decode_frame_t *frame, uint8_t type, VALUE slot, VALUE projection)
+{
+  frame->start_position = b->read_position;
+  frame->length = pvt_validate_length(b);
+  frame->type = type;
+  frame->slot = slot;
+  frame->projection = projection;
+  if (type == BSON_TYPE_ARRAY) {
+    frame->container = rb_ary_new();
+  } else {
+    frame->container = rb_obj_alloc(pvt_document_class);
+  }
 }
 
-VALUE pvt_get_array_at_depth(int argc, VALUE *argv, VALUE self, int depth){
-  byte_buffer_t *b;
-  VALUE array = Qnil;
-  uint8_t type;
-  int32_t length;
-  char *start_ptr;
+/**
+ * Stores `value` under `slot` in the container of `frame`; a nil slot
+ * appends the value to an array.
+ */
+static void pvt_store_value(decode_frame_t *frame, VALUE slot, VALUE value)
+{
+  if (frame->type != BSON_TYPE_ARRAY) {
+    rb_hash_aset(frame->container, slot, value);
+  } else if (NIL_P(slot)) {
+    rb_ary_push(frame->container, value);
+  } else {
+    rb_ary_store(frame->container, FIX2LONG(slot), value);
+  }
+}
+
+/**
+ * Reads the document or array (according to `type`) at the read position,
+ * including everything embedded in it.
+ *
+ * Rather than recursing for every embedded document or array, the
+ * containers being filled are kept on an explicit stack of frames. Each
+ * container is stored in its parent as soon as it is started, so every
+ * container on the stack is reachable from the outermost one.
+ *
+ * `depth` is the nesting depth of the outermost container. A non-nil
+ * `projection` (see pvt_compile_projection) selects the fields to read, or
+ * with `exclude` set, the fields to skip; embedded documents are projected
+ * by the nested selections for their fields, and documents in arrays by
+ * the selection for the array. Other array elements are only read when
+ * excluding.
+ */
+VALUE pvt_decode_document(decode_context_t *ctx, uint8_t type, int depth, VALUE projection, int exclude)
+{
+  byte_buffer_t *b = ctx->b;
+  decode_frame_t inline_frames[BSON_DECODE_INLINE_FRAMES];
+  decode_frame_t *stack = inline_frames;
+  long capacity = BSON_DECODE_INLINE_FRAMES;
+  long top = 0;
+  VALUE heap_frames = 0;
+  VALUE result;
 
   pvt_check_nesting_depth(depth);
+  pvt_push_frame(b, &stack[0], type, Qnil, projection);
+
+  for (;;) {
+    decode_frame_t *frame = &stack[top];
+    uint8_t element_type = pvt_get_type_byte(b);
+    VALUE field, selection;
+
+    if (element_type == 0) {
+      size_t read_bytes = b->read_position - frame->start_position;
+      if (read_bytes != (size_t)frame->length) {
+        pvt_raise_decode_error(rb_sprintf("Expected to read %d bytes for the %s but read %zu bytes",
+          frame->length, frame->type == BSON_TYPE_ARRAY ? "array" : "hash", read_bytes));
+      }
 
-  TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
+      result = frame->container;
+      if (frame->type == BSON_TYPE_DOCUMENT && pvt_is_dbref(result)) {
+        result = rb_funcall(pvt_dbref_class, pvt_id_new, 1, result);
+        if (top > 0) {
+          pvt_store_value(&stack[top - 1], frame->slot, result);
+        }
+      }
+
+      if (top == 0) {
+        break;
+      }
+      top--;
+      continue;
+    }
+
+    if (frame->type == BSON_TYPE_ARRAY) {
+      pvt_skip_cstring(b);
+      field = Qnil;
+    } else {
+      field = pvt_get_field_name_from_buffer(b);
+    }
 
-  start_ptr = READ_PTR(b);
-  length = pvt_validate_length(b);
+    /* Work out the projection of the value: nil to read all of it, or
+     * Qundef to skip it. */
+    if (NIL_P(frame->projection)) {
+      selection = Qnil;
+    } else {
+      if (frame->type == BSON_TYPE_ARRAY) {
+        selection = frame->projection;
+      } else {
+        selection = rb_hash_lookup2(frame->projection, field, Qundef);
+        if (selection == Qundef || selection == Qtrue) {
+          /* Unnamed fields are read when excluding; named ones when
+           * including. */
+          selection = (selection == Qundef) == (exclude != 0) ? Qnil : Qundef;
+        }
+      }
+      if (RB_TYPE_P(selection, T_HASH) &&
+          element_type != BSON_TYPE_DOCUMENT && element_type != BSON_TYPE_ARRAY) {
+        selection = exclude ? Qnil : Qundef;
+      }
+    }
 
-  array = rb_ary_new();
-  while((type = pvt_get_type_byte(b)) != 0){
-    pvt_skip_cstring(b);
-    rb_ary_push(array,  pvt_read_field(b, self, type, argc, argv, depth));
+    if (selection == Qundef) {
+      pvt_skip_field(b, element_type, field);
+    } else if (element_type == BSON_TYPE_DOCUMENT || element_type == BSON_TYPE_ARRAY) {
+      VALUE slot = field;
+
+      pvt_check_nesting_depth(depth + top + 1);
+      if (top + 1 == capacity) {
+        /* The nesting depth cap bounds the number of frames needed. */
+        long needed = BSON_RUBY_MAX_NESTING_DEPTH - depth + 1;
+        decode_frame_t *frames = ALLOCV_N(decode_frame_t, heap_frames, needed);
+        MEMCPY(frames, stack, decode_frame_t, top + 1);
+        stack = frames;
+        capacity = needed;
+        frame = &stack[top];
+      }
+
+      if (frame->type == BSON_TYPE_ARRAY) {
+        slot = LONG2FIX(RARRAY_LEN(frame->container));
+      }
+      pvt_push_frame(b, &stack[top + 1], element_type, slot, selection);
+      pvt_store_value(frame, slot, stack[top + 1].container);
+      top++;
+    } else {
+      pvt_store_value(frame, field, pvt_read_field(ctx, element_type, depth + top));
+    }
+    RB_GC_GUARD(field);
+  }
+
+  if (heap_frames) {
+    ALLOCV_END(heap_frames);
+  }
+  RB_GC_GUARD(projection);
+  return result;
+}
+
+/**
+ * Advances the read position past a value using its length prefix (or its
+ * fixed size), without decoding or validating it.
+ */
+void pvt_skip_field(byte_buffer_t *b, uint8_t type, VALUE field)
+{
+  int64_t length = pvt_value_length(type, READ_PTR(b), READ_SIZE(b));
+
+  if (length < 0) {
+    /* Raises BSON::Error::UnsupportedType for unknown type bytes. */
+    rb_funcall(rb_bson_registry, rb_intern("get"), 2, INT2FIX(type), field);
+    pvt_raise_decode_error(rb_sprintf("Invalid value of type 0x%02x at offset %zu", type, b->read_position));
   }
-  RB_GC_GUARD(array);
+  b->read_position += length;
+}
+
+/**
+ * Builds a tree of nested hashes from a list of dotted field paths. Each
+ * key maps to true if the whole field is selected, or to a hash of the
+ * selected fields of its embedded documents.
+ */
+VALUE pvt_compile_projection(VALUE paths)
+{
+  VALUE tree = rb_hash_new();
+  long i;
+
+  paths = rb_Array(paths);
+  for (i = 0; i < RARRAY_LEN(paths); i++) {
+    VALUE path = RARRAY_AREF(paths, i);
+    VALUE node = tree;
+    const char *segment, *end;
+
+    if (RB_TYPE_P(path, T_SYMBOL)) {
+      path = rb_sym2str(path);
+    }
+    if (!RB_TYPE_P(path, T_STRING)) {
+      rb_raise(rb_eArgError, "Projection paths must be Strings or Symbols: %"PRIsVALUE, rb_inspect(path));
+    }
+
+    segment = RSTRING_PTR(path);
+    end = segment + RSTRING_LEN(path);
+    for (;;) {
+      const char *dot = memchr(segment, '.', end - segment);
+      const char *segment_end = dot ? dot : end;
+      VALUE key, child;
 
-  if (READ_PTR(b) - start_ptr != length) {
-    pvt_raise_decode_error(rb_sprintf("Expected to read %d bytes for the hash but read %ld bytes", length, READ_PTR(b) - start_ptr));
+      if (segment_end == segment) {
+        rb_raise(rb_eArgError, "Invalid projection path: %"PRIsVALUE, rb_inspect(path));
+      }
+
+      key = pvt_get_field_name(segment, segment_end - segment);
+      child = rb_hash_lookup2(node, key, Qundef);
+      if (!dot) {
+        rb_hash_aset(node, key, Qtrue);
+        break;
+      }
+      if (child == Qtrue) {
+        /* The whole field is already selected. */
+        break;
+      }
+      if (child == Qundef) {
+        child = rb_hash_new();
+        rb_hash_aset(node, key, child);
+      }
+      node = child;
+      segment = dot + 1;
+    }
+    RB_GC_GUARD(path);
   }
 
-  return array;
+  return tree;
+}
+
+VALUE rb_bson_byte_buffer_get_array(int argc, VALUE *argv, VALUE self){
+  decode_context_t ctx;
+
+  pvt_init_decode_context(&ctx, self, argc, argv);
+  return pvt_decode_document(&ctx, BSON_TYPE_ARRAY, 1, Qnil, 0);
 }
 
 /**
@@ -118,6 +118,24 @@ VALUE pvt_const_get_3(const char *c1, const char *c2, const char *c3) {
   return rb_const_get(pvt_const_get_2(c1, c2), rb_intern(c3));
 }
 
+/**
+ * Returns the options hash passed as keyword arguments in argc/argv, or nil
+ * if no options were given.
+ */
+VALUE pvt_get_options_hash(int argc, VALUE *argv) {
+  VALUE opts;
+
+#ifdef RB_SCAN_ARGS_LAST_HASH_KEYWORDS /* Ruby 2.7+ */
+  /* The options hash may be forwarded from a method that was not itself
+   * called with keywords (e.g. BSON::RawDocument#[]), so always treat it
+   * as keywords. */
+  rb_scan_args_kw(RB_SCAN_ARGS_LAST_HASH_KEYWORDS, argc, argv, ":", &opts);
+#else
+  rb_scan_args(argc, argv, ":", &opts);
+#endif
+  return opts;
+}
+
 /**
  * Returns the value of the :mode option, or the default if the option is not
  * specified. Raises ArgumentError if the value is not one of nil or :bson.
@@ -128,7 +146,7 @@ int pvt_get_mode_option(int argc, VALUE *argv) {
   VALUE opts;
   VALUE mode;
 
-  rb_scan_args(argc, argv, ":", &opts);
+  opts = pvt_get_options_hash(argc, argv);
   if (NIL_P(opts)) {
     return BSON_MODE_DEFAULT;
   } else {
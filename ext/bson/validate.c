@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2009-2020 MongoDB Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bson-native.h"
+#include <ruby/thread.h>
+
+/* Inputs at least this large are validated without holding the GVL. */
+#define BSON_VALIDATE_WITHOUT_GVL_THRESHOLD (64 * 1024)
+
+/**
+ * The state of a validation. Validation only reads `data` and writes the
+ * error fields, so it can run without the GVL.
+ */
+typedef struct {
+  const char *data;
+  size_t length;
+  size_t error_offset;
+  const char *error;
+  const char *error_detail;
+  volatile int interrupted;
+} bson_validation_t;
+
+/* Binary subtypes below the user-defined range which BSON::Binary knows. */
+static char pvt_known_binary_subtypes[0x80];
+
+static int pvt_validate_document(bson_validation_t *v, size_t offset, size_t available, int depth, int32_t *document_length);
+
+static int pvt_validation_error(bson_validation_t *v, size_t offset, const char *error)
+{
+  v->error_offset = offset;
+  v->error = error;
+  return 0;
+}
+
+static int32_t pvt_read_le_int32(const char *ptr)
+{
+  int32_t value;
+  memcpy(&value, ptr, 4);
+  return BSON_UINT32_FROM_LE(value);
+}
+
+/**
+ * Validates a null-terminated UTF-8 string (field name or regular
+ * expression part) at `offset`. Stores its length, including the
+ * terminator, in `cstring_length`.
+ */
+static int pvt_validate_cstring(bson_validation_t *v, size_t offset, size_t available, size_t *cstring_length)
+{
+  const char *start = v->data + offset;
+  const char *terminator = memchr(start, '\0', available);
+  size_t utf8_offset;
+  const char *reason;
+
+  if (!terminator) {
+    return pvt_validation_error(v, offset, "string is not null-terminated");
+  }
+
+  reason = rb_bson_utf8_check(start, terminator - start, false, &utf8_offset, NULL);
+  if (reason) {
+    v->error_detail = reason;
+    return pvt_validation_error(v, offset + utf8_offset, "string is not valid UTF-8");
+  }
+
+  *cstring_length = terminator - start + 1;
+  return 1;
+}
+
+/**
+ * Validates a length-prefixed UTF-8 string at `offset`. Stores the number of
+ * bytes it occupies, including the length prefix, in `string_length`.
+ */
+static int pvt_validate_string(bson_validation_t *v, size_t offset, size_t available, size_t *string_length)
+{
+  int32_t length;
+  size_t utf8_offset;
+  const char *reason;
+
+  if (available < 4) {
+    return pvt_validation_error(v, offset, "string length is truncated");
+  }
+  length = pvt_read_le_int32(v->data + offset);
+  if (length < 1) {
+    return pvt_validation_error(v, offset, "string length is not positive");
+  }
+  if ((size_t)length > available - 4) {
+    return pvt_validation_error(v, offset, "string extends past the end of the document");
+  }
+  if (v->data[offset + 4 + length - 1] != 0) {
+    return pvt_validation_error(v, offset + 4 + length - 1, "string is not null-terminated");
+  }
+
+  reason = rb_bson_utf8_check(v->data + offset + 4, length - 1, true, &utf8_offset, NULL);
+  if (reason) {
+    v->error_detail = reason;
+    return pvt_validation_error(v, offset + 4 + utf8_offset, "string is not valid UTF-8");
+  }
+
+  *string_length = 4 + (size_t)length;
+  return 1;
+}
+
+/**
+ * Validates the value at `offset` of the element whose type byte is at
+ * `type_offset`. Stores the number of bytes the value occupies in
+ * `value_length`.
+ */
+static int pvt_validate_value(bson_validation_t *v, size_t type_offset, size_t offset, size_t available, int depth, size_t *value_length)
+{
+  int32_t length;
+  size_t part_length;
+  size_t fixed_length = 0;
+  uint8_t type = (uint8_t)v->data[type_offset];
+
+  switch (type) {
+    case BSON_TYPE_UNDEFINED:
+    case BSON_TYPE_NULL:
+    case BSON_TYPE_MIN_KEY:
+    case BSON_TYPE_MAX_KEY:
+      fixed_length = 0;
+      break;
+    case BSON_TYPE_BOOLEAN:
+      if (available < 1) {
+        return pvt_validation_error(v, offset, "boolean extends past the end of the document");
+      }
+      if (v->data[offset] != 0 && v->data[offset] != 1) {
+        return pvt_validation_error(v, offset, "boolean value is not 0 or 1");
+      }
+      fixed_length = 1;
+      break;
+    case BSON_TYPE_INT32:
+      fixed_length = 4;
+      break;
+    case BSON_TYPE_DOUBLE:
+    case BSON_TYPE_DATETIME:
+    case BSON_TYPE_TIMESTAMP:
+    case BSON_TYPE_INT64:
+      fixed_length = 8;
+      break;
+    case BSON_TYPE_OBJECT_ID:
+      fixed_length = 12;
+      break;
+    case BSON_TYPE_DECIMAL128:
+      fixed_length = 16;
+      break;
+    case BSON_TYPE_STRING:
+    case BSON_TYPE_CODE:
+    case BSON_TYPE_SYMBOL:
+      return pvt_validate_string(v, offset, available, value_length);
+    case BSON_TYPE_DB_POINTER:
+      if (!pvt_validate_string(v, offset, available, &part_length)) {
+        return 0;
+      }
+      if (available - part_length < 12) {
+        return pvt_validation_error(v, offset + part_length, "DBPointer id extends past the end of the document");
+      }
+      *value_length = part_length + 12;
+      return 1;
+    case BSON_TYPE_DOCUMENT:
+    case BSON_TYPE_ARRAY:
+      if (!pvt_validate_document(v, offset, available, depth + 1, &length)) {
+        return 0;
+      }
+      *value_length = (size_t)length;
+      return 1;
+    case BSON_TYPE_BINARY: {
+      uint8_t subtype;
+
+      if (available < 5) {
+        return pvt_validation_error(v, offset, "binary header is truncated");
+      }
+      length = pvt_read_le_int32(v->data + offset);
+      subtype = (uint8_t)v->data[offset + 4];
+      if (length < 0) {
+        return pvt_validation_error(v, offset, "binary length is negative");
+      }
+      if ((size_t)length > available - 5) {
+        return pvt_validation_error(v, offset, "binary extends past the end of the document");
+      }
+      if (subtype < 0x80 && !pvt_known_binary_subtypes[subtype]) {
+        return pvt_validation_error(v, offset + 4, "binary subtype is not supported");
+      }
+      if (subtype == 0x02 && (length < 4 || pvt_read_le_int32(v->data + offset + 5) != length - 4)) {
+        return pvt_validation_error(v, offset + 5, "binary subtype 0x02 length does not match");
+      }
+      *value_length = 5 + (size_t)length;
+      return 1;
+    }
+    case BSON_TYPE_REGEX:
+      if (!pvt_validate_cstring(v, offset, available, &part_length)) {
+        return 0;
+      }
+      *value_length = part_length;
+      if (!pvt_validate_cstring(v, offset + part_length, available - part_length, &part_length)) {
+        return 0;
+      }
+      *value_length += part_length;
+      return 1;
+    case BSON_TYPE_CODE_WITH_SCOPE: {
+      int32_t scope_length;
+
+      if (available < 4) {
+        return pvt_validation_error(v, offset, "CodeWithScope length is truncated");
+      }
+      length = pvt_read_le_int32(v->data + offset);
+      if (length < 14) {
+        return pvt_validation_error(v, offset, "CodeWithScope length is too small");
+      }
+      if ((size_t)length > available) {
+        return pvt_validation_error(v, offset, "CodeWithScope extends past the end of the document");
+      }
+      if (!pvt_validate_string(v, offset + 4, length - 4, &part_length)) {
+        return 0;
+      }
+      if (!pvt_validate_document(v, offset + 4 + part_length, length - 4 - part_length, depth + 1, &scope_length)) {
+        return 0;
+      }
+      if (4 + part_length + (size_t)scope_length != (size_t)length) {
+        return pvt_validation_error(v, offset, "CodeWithScope length does not match its contents");
+      }
+      *value_length = (size_t)length;
+      return 1;
+    }
+    default:
+      return pvt_validation_error(v, type_offset, "unsupported type");
+  }
+
+  if (fixed_length > available) {
+    return pvt_validation_error(v, offset, "value extends past the end of the document");
+  }
+  *value_length = fixed_length;
+  return 1;
+}
+
+/**
+ * Validates the document or array at `offset`, which may use at most
+ * `available` bytes. Stores its length in `document_length`. Returns 1 if
+ * it is valid; otherwise records the error and returns 0.
+ */
+int pvt_validate_document(bson_validation_t *v, size_t offset, size_t available, int depth, int32_t *document_length)
+{
+  int32_t length;
+  size_t position, end;
+
+  if (depth > BSON_RUBY_MAX_NESTING_DEPTH) {
+    return pvt_validation_error(v, offset, "nesting depth exceeds the maximum");
+  }
+  if (available < 4) {
+    return pvt_validation_error(v, offset, "document length is truncated");
+  }
+  length = pvt_read_le_int32(v->data + offset);
+  if (length < 5) {
+    return pvt_validation_error(v, offset, "document length is too small");
+  }
+  if ((size_t)length > available) {
+    return pvt_validation_error(v, offset, "document extends past the end of the data");
+  }
+
+  end = offset + length - 1;
+  if (v->data[end] != 0) {
+    return pvt_validation_error(v, end, "document is not null-terminated");
+  }
+
+  position = offset + 4;
+  while (position < end) {
+    size_t type_offset = position;
+    size_t key_length, value_length;
+
+    if (v->interrupted) {
+      return 0;
+    }
+    if (v->data[type_offset] == 0) {
+      return pvt_validation_error(v, type_offset, "document has bytes after its terminator");
+    }
+
+    if (!pvt_validate_cstring(v, position + 1, end - position - 1, &key_length)) {
+      return 0;
+    }
+    position += 1 + key_length;
+
+    if (!pvt_validate_value(v, type_offset, position, end - position, depth, &value_length)) {
+      return 0;
+    }
+    position += value_length;
+  }
+
+  *document_length = length;
+  return 1;
+}
+
+/**
+ * Validates that `v->data` consists of exactly one document.
+ */
+static void *pvt_validate(void *arg)
+{
+  bson_validation_t *v = (bson_validation_t *)arg;
+  int32_t length;
+
+  if (pvt_validate_document(v, 0, v->length, 1, &length) && (size_t)length != v->length) {
+    pvt_validation_error(v, (size_t)length, "data continues after the end of the document");
+  }
+  return NULL;
+}
+
+static void pvt_interrupt_validation(void *arg)
+{
+  ((bson_validation_t *)arg)->interrupted = 1;
+}
+
+/**
+ * Validates `length` bytes at `data`, releasing the GVL if the input is
+ * large. Returns nil if the data is a valid document, otherwise a
+ * BSON::ValidationFailure describing the first error.
+ */
+static VALUE pvt_validate_bytes(const char *data, size_t length)
+{
+  bson_validation_t v;
+  VALUE reason;
+  VALUE args[2];
+
+  do {
+    memset(&v, 0, sizeof(v));
+    v.data = data;
+    v.length = length;
+
+    if (length >= BSON_VALIDATE_WITHOUT_GVL_THRESHOLD) {
+      rb_thread_call_without_gvl(pvt_validate, &v, pvt_interrupt_validation, &v);
+      if (v.interrupted) {
+        /* Runs pending interrupts; if none raises, validate again. */
+        rb_thread_check_ints();
+      }
+    } else {
+      pvt_validate(&v);
+    }
+  } while (v.interrupted);
+
+  if (!v.error) {
+    return Qnil;
+  }
+
+  reason = v.error_detail ? rb_sprintf("%s: %s", v.error, v.error_detail) : rb_str_new_cstr(v.error);
+  args[0] = SIZET2NUM(v.error_offset);
+  args[1] = reason;
+  return rb_class_new_instance(2, args, pvt_const_get_2("BSON", "ValidationFailure"));
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_validate(VALUE self, VALUE data)
+{
+  VALUE result;
+  byte_buffer_t *b;
+
+  if (rb_typeddata_is_kind_of(data, &rb_byte_buffer_data_type)) {
+    TypedData_Get_Struct(data, byte_buffer_t, &rb_byte_buffer_data_type, b);
+    if (READ_SIZE(b) < BSON_VALIDATE_WITHOUT_GVL_THRESHOLD) {
+      return pvt_validate_bytes(READ_PTR(b), READ_SIZE(b));
+    }
+    /* Another thread could write to (and reallocate or free the storage
+     * of) the buffer while the GVL is released, so a copy of its bytes is
+     * validated instead. */
+    data = rb_str_new(READ_PTR(b), (long)READ_SIZE(b));
+    result = pvt_validate_bytes(RSTRING_PTR(data), RSTRING_LEN(data));
+    RB_GC_GUARD(data);
+    return result;
+  }
+
+  StringValue(data);
+  if (RSTRING_LEN(data) < BSON_VALIDATE_WITHOUT_GVL_THRESHOLD) {
+    return pvt_validate_bytes(RSTRING_PTR(data), RSTRING_LEN(data));
+  }
+  /* A frozen copy shares the bytes, and keeps them alive and unchanged
+   * while the GVL is released even if the caller modifies `data`. */
+  data = rb_str_new_frozen(data);
+  result = pvt_validate_bytes(RSTRING_PTR(data), RSTRING_LEN(data));
+  RB_GC_GUARD(data);
+  return result;
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_byte_buffer_is_valid_bson(VALUE self)
+{
+  return NIL_P(rb_bson_validate(Qnil, self)) ? Qtrue : Qfalse;
+}
+
+/**
+ * Records the binary subtypes known to BSON::Binary.
+ */
+void rb_bson_init_validation(void)
+{
+  VALUE subtypes = rb_funcall(rb_const_get(pvt_const_get_2("BSON", "Binary"), rb_intern("TYPES")), rb_intern("keys"), 0);
+  long i;
+
+  for (i = 0; i < RARRAY_LEN(subtypes); i++) {
+    VALUE subtype = RARRAY_AREF(subtypes, i);
+    uint8_t byte = (uint8_t)RSTRING_PTR(subtype)[0];
+    if (byte < 0x80) {
+      pvt_known_binary_subtypes[byte] = 1;
+    }
+  }
+}
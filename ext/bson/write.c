@@ -22,17 +22,49 @@ typedef struct{
   VALUE buffer;
 } put_hash_context;
 
-static void pvt_replace_int32(byte_buffer_t *b, int32_t position, int32_t newval);
-static void pvt_put_field(byte_buffer_t *b, VALUE rb_buffer, VALUE val);
-static void pvt_put_byte(byte_buffer_t *b, const char byte);
-static void pvt_put_int32(byte_buffer_t *b, const int32_t i32);
 static void pvt_put_uint32(byte_buffer_t *b, const uint32_t i32);
-static void pvt_put_int64(byte_buffer_t *b, const int64_t i);
-static void pvt_put_double(byte_buffer_t *b, double f);
 static void pvt_put_cstring(byte_buffer_t *b, const char *str, int32_t length, const char *data_type);
 static void pvt_put_bson_key(byte_buffer_t *b, VALUE string);
 static VALUE pvt_bson_byte_buffer_put_bson_partial_string(VALUE self, const char *str, int32_t length);
 static VALUE pvt_bson_byte_buffer_put_binary_string(VALUE self, const char *str, int32_t length);
+static uint8_t pvt_native_type(VALUE val);
+static int pvt_put_native_value(byte_buffer_t *b, VALUE rb_buffer, VALUE val, uint8_t type);
+static VALUE pvt_put_hash(VALUE self, VALUE hash);
+static size_t pvt_field_size(VALUE val, VALUE *scratch);
+
+/* The built-in classes whose instances are encoded without calling their
+ * to_bson methods. */
+static VALUE pvt_object_id_class = Qnil;
+static VALUE pvt_binary_class = Qnil;
+static VALUE pvt_decimal128_class = Qnil;
+static VALUE pvt_raw_document_class = Qnil;
+
+static VALUE pvt_byte_buffer_class = Qnil;
+
+static ID pvt_id_raw_data, pvt_id_data, pvt_id_raw_type, pvt_id_low, pvt_id_high;
+static ID pvt_id_bson_type;
+
+/* The BSON type bytes returned by the bson_type methods of classes, keyed
+ * by class (compared by identity). Only classes whose bson_type is defined
+ * by BSON are cached (see pvt_type_byte_owner); the cache is cleared by
+ * BSON::Registry.register and when bson_type may have changed for a cached
+ * class (see pvt_hook_type_byte_cache). */
+static VALUE pvt_type_byte_cache = Qnil;
+
+/* BSON::TypeCacheHooks, which is prepended to the singleton classes of the
+ * classes added to the type byte cache and of their ancestors. */
+static VALUE pvt_type_cache_hooks = Qnil;
+
+/* The type byte cache is emptied rather than grown past this many classes,
+ * so that anonymous classes are not retained indefinitely. */
+#define BSON_TYPE_BYTE_CACHE_MAX_SIZE 1024
+
+/* Direct-mapped cache of Symbol and frozen String hash keys which have been
+ * validated for encoding, or nil when disabled. Keys are compared by
+ * identity; holding them in the cache keeps them from being collected. The
+ * number of slots is always a power of two. */
+static VALUE pvt_key_cache = Qnil;
+static unsigned long pvt_key_cache_mask = 0;
 
 /* Raise ArgumentError if length exceeds the BSON int32_t string-length limit.
  * The bound is INT32_MAX - 5 rather than INT32_MAX because the binary-string
@@ -74,12 +106,288 @@ void pvt_put_field(byte_buffer_t *b, VALUE rb_buffer, VALUE val){
       pvt_put_byte(b, 0);
       break;
     case T_HASH:
-      rb_bson_byte_buffer_put_hash(rb_buffer, val);
+      pvt_put_hash(rb_buffer, val);
       break;
     default:{
-      rb_funcall(val, rb_intern("to_bson"), 1, rb_buffer);
+      uint8_t type = pvt_native_type(val);
+      if (!type || !pvt_put_native_value(b, rb_buffer, val, type)) {
+        rb_funcall(val, rb_intern("to_bson"), 1, rb_buffer);
+      }
+      break;
+    }
+  }
+}
+
+/**
+ * Resolves the classes and instance variable names used to encode
+ * instances of the built-in classes natively.
+ */
+void rb_bson_init_encoder(void)
+{
+  pvt_object_id_class = pvt_const_get_2("BSON", "ObjectId");
+  rb_gc_register_mark_object(pvt_object_id_class);
+  pvt_binary_class = pvt_const_get_2("BSON", "Binary");
+  rb_gc_register_mark_object(pvt_binary_class);
+  pvt_decimal128_class = pvt_const_get_2("BSON", "Decimal128");
+  rb_gc_register_mark_object(pvt_decimal128_class);
+  pvt_raw_document_class = pvt_const_get_2("BSON", "RawDocument");
+  rb_gc_register_mark_object(pvt_raw_document_class);
+  pvt_byte_buffer_class = pvt_const_get_2("BSON", "ByteBuffer");
+  rb_gc_register_mark_object(pvt_byte_buffer_class);
+
+  pvt_id_raw_data = rb_intern("@raw_data");
+  pvt_id_data = rb_intern("@data");
+  pvt_id_raw_type = rb_intern("@raw_type");
+  pvt_id_low = rb_intern("@low");
+  pvt_id_high = rb_intern("@high");
+  pvt_id_bson_type = rb_intern("bson_type");
+
+  pvt_type_byte_cache = rb_hash_new();
+  rb_funcall(pvt_type_byte_cache, rb_intern("compare_by_identity"), 0);
+  rb_gc_register_mark_object(pvt_type_byte_cache);
+  pvt_type_cache_hooks = pvt_const_get_2("BSON", "TypeCacheHooks");
+  rb_gc_register_mark_object(pvt_type_cache_hooks);
+}
+
+/**
+ * Empties the type byte cache.
+ */
+static void pvt_clear_type_byte_cache(void)
+{
+  if (!NIL_P(pvt_type_byte_cache)) {
+    rb_hash_clear(pvt_type_byte_cache);
+  }
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_type_cache_method_changed(VALUE self, VALUE name)
+{
+  if (name == ID2SYM(rb_intern("bson_type"))) {
+    pvt_clear_type_byte_cache();
+  }
+  return rb_call_super(1, &name);
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_type_cache_ancestors_changed(int argc, VALUE *argv, VALUE self)
+{
+  VALUE result = rb_call_super(argc, argv);
+
+  pvt_clear_type_byte_cache();
+  return result;
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_type_cache_clear(VALUE self)
+{
+  pvt_clear_type_byte_cache();
+  return Qnil;
+}
+
+/**
+ * Returns whether the type byte of instances of `klass` may be cached:
+ * whether the class has a bson_type method (rather than answering it
+ * through method_missing, as delegators do for the object they wrap) which
+ * is defined by BSON, either in a module under the BSON namespace or by
+ * BSON::Registry.register for a registered class. bson_type methods which
+ * BSON does not control may depend on the instance.
+ *
+ * Returns the module which defines the method if so, or nil.
+ */
+static VALUE pvt_type_byte_owner(VALUE klass)
+{
+  VALUE owner, name;
+
+  if (FL_TEST(klass, FL_SINGLETON) || !rb_method_boundp(klass, pvt_id_bson_type, 0)) {
+    return Qnil;
+  }
+
+  owner = rb_funcall(rb_funcall(klass, rb_intern("instance_method"), 1, ID2SYM(pvt_id_bson_type)),
+    rb_intern("owner"), 0);
+  name = rb_mod_name(owner);
+  if (!NIL_P(name) && RSTRING_LEN(name) > 6 && strncmp(RSTRING_PTR(name), "BSON::", 6) == 0) {
+    return owner;
+  }
+  if (RTEST(rb_funcall(pvt_const_get_3("BSON", "Registry", "MAPPINGS"), rb_intern("value?"), 1, owner))) {
+    return owner;
+  }
+  return Qnil;
+}
+
+/**
+ * Prepends BSON::TypeCacheHooks to the singleton classes of `klass` and of
+ * its ancestors up to `owner`, the module defining its bson_type method.
+ * Any of them could come to shadow that method, by defining bson_type or
+ * by including or prepending a module which does, and the hooks clear the
+ * cache when that happens. Ancestors after `owner` cannot change the type.
+ */
+static void pvt_hook_type_byte_cache(VALUE klass, VALUE owner)
+{
+  VALUE ancestors = rb_mod_ancestors(klass);
+  long i;
+
+  for (i = 0; i < RARRAY_LEN(ancestors); i++) {
+    VALUE ancestor = RARRAY_AREF(ancestors, i);
+
+    rb_prepend_module(rb_singleton_class(ancestor), pvt_type_cache_hooks);
+    if (ancestor == owner) {
+      break;
+    }
+  }
+  RB_GC_GUARD(ancestors);
+}
+
+/**
+ * Returns the BSON type of the value written by the stock to_bson method
+ * of `val`, if pvt_put_field can write the value without calling into
+ * Ruby, or 0 if the value must be encoded by its to_bson method. Only
+ * instances of the built-in classes themselves are handled, not of their
+ * subclasses, and only while the class is still registered for its type.
+ *
+ * The type byte written for the field is still the one returned by
+ * bson_type, since applications may redefine it (the Ruby driver makes
+ * Symbol#bson_type return the symbol type, for example).
+ */
+uint8_t pvt_native_type(VALUE val)
+{
+  uint8_t type;
+
+  switch (TYPE(val)) {
+    case T_NIL:
+      type = BSON_TYPE_NULL;
+      break;
+    case T_SYMBOL:
+      /* Symbol#to_bson always writes a string, whatever bson_type says. */
+      return BSON_TYPE_SYMBOL;
+    case T_STRING:
+      if (rb_obj_class(val) != rb_cString) {
+        return 0;
+      }
+      type = BSON_TYPE_STRING;
+      break;
+    case T_DATA:
+      if (rb_obj_class(val) != rb_cTime) {
+        return 0;
+      }
+      type = BSON_TYPE_DATETIME;
+      break;
+    case T_OBJECT: {
+      VALUE klass = rb_obj_class(val);
+      if (klass == pvt_object_id_class) {
+        type = BSON_TYPE_OBJECT_ID;
+      } else if (klass == pvt_binary_class) {
+        type = BSON_TYPE_BINARY;
+      } else if (klass == pvt_decimal128_class) {
+        type = BSON_TYPE_DECIMAL128;
+      } else if (klass == pvt_raw_document_class) {
+        /* RawDocument is not registered for any type, it only writes. */
+        return BSON_TYPE_DOCUMENT;
+      } else {
+        return 0;
+      }
       break;
     }
+    default:
+      return 0;
+  }
+
+  return pvt_is_default_class(type) ? type : 0;
+}
+
+/**
+ * Writes the value of a field whose type was determined by
+ * pvt_native_type. Returns 0 without writing anything if the value is not
+ * in its usual form (for example an ObjectId which has not generated its
+ * bytes yet), in which case the caller falls back to to_bson.
+ */
+int pvt_put_native_value(byte_buffer_t *b, VALUE rb_buffer, VALUE val, uint8_t type)
+{
+  switch (type) {
+    case BSON_TYPE_NULL:
+      return 1;
+    case BSON_TYPE_STRING:
+      rb_bson_byte_buffer_put_string(rb_buffer, val);
+      return 1;
+    case BSON_TYPE_SYMBOL:
+      rb_bson_byte_buffer_put_symbol(rb_buffer, val);
+      return 1;
+    case BSON_TYPE_DATETIME: {
+      /* Milliseconds since the epoch, rounded down like Time#to_bson. */
+      struct timespec ts = rb_time_timespec(val);
+      if (ts.tv_sec > INT64_MAX / 1000 - 1 || ts.tv_sec < INT64_MIN / 1000 + 1) {
+        return 0;
+      }
+      pvt_put_int64(b, (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+      return 1;
+    }
+    case BSON_TYPE_OBJECT_ID: {
+      VALUE raw_data = rb_attr_get(val, pvt_id_raw_data);
+      if (!RB_TYPE_P(raw_data, T_STRING) || RSTRING_LEN(raw_data) != 12 ||
+          rb_ivar_defined(val, pvt_id_data)) {
+        return 0;
+      }
+      ENSURE_BSON_WRITE(b, 12);
+      memcpy(WRITE_PTR(b), RSTRING_PTR(raw_data), 12);
+      b->write_position += 12;
+      return 1;
+    }
+    case BSON_TYPE_BINARY: {
+      VALUE data = rb_attr_get(val, pvt_id_data);
+      VALUE raw_type = rb_attr_get(val, pvt_id_raw_type);
+      long length;
+      uint8_t subtype;
+
+      if (!RB_TYPE_P(data, T_STRING) || !RB_TYPE_P(raw_type, T_STRING) || RSTRING_LEN(raw_type) != 1) {
+        return 0;
+      }
+      length = RSTRING_LEN(data);
+      pvt_check_string_length(length);
+      subtype = (uint8_t)*RSTRING_PTR(raw_type);
+
+      /* The old binary subtype repeats the length inside the value. */
+      if (subtype == 0x02) {
+        pvt_put_int32(b, (int32_t)length + 4);
+        pvt_put_byte(b, (char)subtype);
+        pvt_put_int32(b, (int32_t)length);
+      } else {
+        pvt_put_int32(b, (int32_t)length);
+        pvt_put_byte(b, (char)subtype);
+      }
+      ENSURE_BSON_WRITE(b, length);
+      memcpy(WRITE_PTR(b), RSTRING_PTR(data), length);
+      b->write_position += length;
+      return 1;
+    }
+    case BSON_TYPE_DECIMAL128: {
+      VALUE low = rb_attr_get(val, pvt_id_low);
+      VALUE high = rb_attr_get(val, pvt_id_high);
+      if (!RB_INTEGER_TYPE_P(low) || !RB_INTEGER_TYPE_P(high)) {
+        return 0;
+      }
+      rb_bson_byte_buffer_put_decimal128(rb_buffer, low, high);
+      return 1;
+    }
+    case BSON_TYPE_DOCUMENT: {
+      /* The encoded bytes of a RawDocument are copied verbatim, once their
+       * length prefix and terminator have been checked. */
+      VALUE data = rb_attr_get(val, pvt_id_data);
+      long length;
+      int32_t prefix;
+
+      if (!RB_TYPE_P(data, T_STRING) || (length = RSTRING_LEN(data)) < 5) {
+        return 0;
+      }
+      memcpy(&prefix, RSTRING_PTR(data), 4);
+      if ((long)BSON_UINT32_FROM_LE(prefix) != length || RSTRING_PTR(data)[length - 1] != 0) {
+        return 0;
+      }
+      ENSURE_BSON_WRITE(b, length);
+      memcpy(WRITE_PTR(b), RSTRING_PTR(data), length);
+      b->write_position += length;
+      return 1;
+    }
+    default:
+      return 0;
   }
 }
 
@@ -167,15 +475,49 @@ void pvt_put_type_byte(byte_buffer_t *b, VALUE val){
       break;
     default: {
       VALUE type;
-      VALUE responds = rb_funcall(val, rb_intern("respond_to?"), 1, ID2SYM(rb_intern("bson_type")));
-      if (!RTEST(responds)) {
-        VALUE klass = pvt_const_get_3("BSON", "Error", "UnserializableClass");
-        VALUE val_str = rb_funcall(val, rb_intern("to_s"), 0);
-        rb_raise(klass, "Value does not define its BSON serialized type: %s", RSTRING_PTR(val_str));
+      VALUE klass = CLASS_OF(val);
+      VALUE cached = Qundef;
+
+      /* The bson_type methods defined by BSON depend only on the class of
+       * a value, so their results are cached by class. Classes which are
+       * not cacheable are cached as false, so that they are only checked
+       * once. Singleton classes are never looked up: the object could be
+       * given its own bson_type at any time. */
+      if (!FL_TEST(klass, FL_SINGLETON)) {
+        cached = rb_hash_lookup2(pvt_type_byte_cache, klass, Qundef);
+        if (FIXNUM_P(cached)) {
+          type_byte = (char)FIX2INT(cached);
+          break;
+        }
+      }
+
+      /* Instances of the built-in classes are known to respond to
+       * bson_type. */
+      if (!pvt_native_type(val)) {
+        VALUE responds = rb_funcall(val, rb_intern("respond_to?"), 1, ID2SYM(rb_intern("bson_type")));
+        if (!RTEST(responds)) {
+          VALUE klass = pvt_const_get_3("BSON", "Error", "UnserializableClass");
+          VALUE val_str = rb_funcall(val, rb_intern("to_s"), 0);
+          rb_raise(klass, "Value does not define its BSON serialized type: %s", RSTRING_PTR(val_str));
+        }
       }
-      type = rb_funcall(val, rb_intern("bson_type"), 0);
+      type = rb_funcall(val, pvt_id_bson_type, 0);
       type_byte = *RSTRING_PTR(type);
       RB_GC_GUARD(type);
+
+      if (cached == Qundef && !FL_TEST(klass, FL_SINGLETON)) {
+        VALUE owner = pvt_type_byte_owner(klass);
+
+        if (RHASH_SIZE(pvt_type_byte_cache) >= BSON_TYPE_BYTE_CACHE_MAX_SIZE) {
+          pvt_clear_type_byte_cache();
+        }
+        if (!NIL_P(owner)) {
+          pvt_hook_type_byte_cache(klass, owner);
+          rb_hash_aset(pvt_type_byte_cache, klass, INT2FIX((uint8_t)type_byte));
+        } else {
+          rb_hash_aset(pvt_type_byte_cache, klass, Qfalse);
+        }
+      }
       break;
     }
   }
@@ -352,6 +694,11 @@ void pvt_put_bson_key(byte_buffer_t *b, VALUE string){
 void pvt_replace_int32(byte_buffer_t *b, int32_t position, int32_t newval)
 {
   const int32_t i32 = BSON_UINT32_TO_LE(newval);
+
+  pvt_check_writable(b);
+  if (!NIL_P(b->source) && b->read_position + position < (size_t)RSTRING_LEN(b->source)) {
+    b->source = Qnil;
+  }
   memcpy(READ_PTR(b) + position, &i32, 4);
 }
 
@@ -488,32 +835,68 @@ VALUE rb_bson_byte_buffer_put_decimal128(VALUE self, VALUE low, VALUE high)
   return self;
 }
 
-static int put_hash_callback(VALUE key, VALUE val, VALUE context){
-  VALUE buffer = ((put_hash_context*)context)->buffer;
-  byte_buffer_t *b = ((put_hash_context*)context)->b;
-  VALUE key_str;
+/**
+ * Writes a String or Symbol hash key. Symbols and frozen Strings are looked
+ * up in the key cache by identity; once such a key has been validated, it
+ * is written with a single copy and without validating it again.
+ */
+static void pvt_put_hash_key(byte_buffer_t *b, VALUE key)
+{
+  VALUE key_str = RB_TYPE_P(key, T_SYMBOL) ? rb_sym2str(key) : key;
+  unsigned long slot;
+  long length;
 
-  pvt_put_type_byte(b, val);
+  if (NIL_P(pvt_key_cache) || (key_str == key && !OBJ_FROZEN(key))) {
+    pvt_put_bson_key(b, key_str);
+    return;
+  }
+
+  /* Fibonacci hashing of the object address. */
+  slot = (unsigned long)(((uint64_t)key * 0x9E3779B97F4A7C15ull) >> 32) & pvt_key_cache_mask;
+
+  if (RARRAY_AREF(pvt_key_cache, slot) != key) {
+    pvt_put_bson_key(b, key_str);
+    rb_ary_store(pvt_key_cache, slot, key);
+    return;
+  }
 
+  length = RSTRING_LEN(key_str);
+  ENSURE_BSON_WRITE(b, length + 1);
+  memcpy(WRITE_PTR(b), RSTRING_PTR(key_str), length);
+  *(WRITE_PTR(b) + length) = 0;
+  b->write_position += length + 1;
+}
+
+/**
+ * Writes the key of a document element. Keys other than Strings and
+ * Symbols are converted with their to_bson_key method.
+ */
+void pvt_put_key(byte_buffer_t *b, VALUE rb_buffer, VALUE key)
+{
   switch(TYPE(key)){
     case T_STRING:
-      pvt_put_bson_key(b, key);
-      break;
     case T_SYMBOL:
-      key_str = rb_sym_to_s(key);
-      RB_GC_GUARD(key_str);
-      pvt_put_bson_key(b, key_str);
+      pvt_put_hash_key(b, key);
       break;
     default:
-      rb_bson_byte_buffer_put_cstring(buffer, rb_funcall(key, rb_intern("to_bson_key"), 0));
+      rb_bson_byte_buffer_put_cstring(rb_buffer, rb_funcall(key, rb_intern("to_bson_key"), 0));
   }
+}
+
+static int put_hash_callback(VALUE key, VALUE val, VALUE context){
+  VALUE buffer = ((put_hash_context*)context)->buffer;
+  byte_buffer_t *b = ((put_hash_context*)context)->b;
 
+  pvt_put_type_byte(b, val);
+  pvt_put_key(b, buffer, key);
   pvt_put_field(b, buffer, val);
   return ST_CONTINUE;
 }
 
-/* The docstring is in init.c. */
-VALUE rb_bson_byte_buffer_put_hash(VALUE self, VALUE hash){
+/**
+ * Writes a Hash into the byte buffer.
+ */
+VALUE pvt_put_hash(VALUE self, VALUE hash){
   byte_buffer_t *b = NULL;
   put_hash_context context = { NULL };
   size_t position = 0;
@@ -541,6 +924,135 @@ VALUE rb_bson_byte_buffer_put_hash(VALUE self, VALUE hash){
   return self;
 }
 
+/* The docstring is in init.c. */
+VALUE rb_bson_byte_buffer_put_hash(int argc, VALUE *argv, VALUE self)
+{
+  VALUE hash, opts, exact_size = Qnil, max_size = Qnil;
+  byte_buffer_t *b;
+  size_t size;
+  long limit = INT32_MAX;
+
+  /* The options are taken as a trailing positional Hash rather than as
+   * keywords, so that put_hash('a' => 1) still receives its document. */
+  rb_scan_args(argc, argv, "11", &hash, &opts);
+  if (!NIL_P(opts)) {
+    Check_Type(opts, T_HASH);
+    exact_size = rb_hash_lookup(opts, ID2SYM(rb_intern("exact_size")));
+    max_size = rb_hash_lookup(opts, ID2SYM(rb_intern("max_size")));
+  }
+  if (!RTEST(exact_size) && NIL_P(max_size)) {
+    return pvt_put_hash(self, hash);
+  }
+
+  Check_Type(hash, T_HASH);
+  if (!NIL_P(max_size)) {
+    limit = NUM2LONG(max_size);
+  }
+
+  /* Size the document first, so that a document which is too large is
+   * rejected before anything is written and the buffer grows only once. */
+  size = pvt_encoded_size(hash);
+  if (size > (size_t)limit || size > INT32_MAX) {
+    rb_raise(pvt_const_get_3("BSON", "Error", "DocumentTooLarge"),
+      "Document of %zu bytes exceeds the maximum size of %ld bytes", size, limit);
+  }
+
+  TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
+  rb_bson_reserve_buffer(b, size);
+  return pvt_put_hash(self, hash);
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_byte_buffer_put_documents(VALUE self, VALUE documents)
+{
+  byte_buffer_t *b;
+  VALUE offsets, document_type;
+  long length, index;
+
+  TypedData_Get_Struct(self, byte_buffer_t, &rb_byte_buffer_data_type, b);
+  Check_Type(documents, T_ARRAY);
+
+  length = RARRAY_LEN(documents);
+  offsets = rb_ary_new_capa(length);
+  document_type = Qnil;
+
+  for (index = 0; index < length; index++) {
+    volatile VALUE document;
+
+    if (RARRAY_LEN(documents) != length) {
+      rb_raise(rb_eRuntimeError, "array modified during BSON serialization");
+    }
+    document = RARRAY_AREF(documents, index);
+    rb_ary_push(offsets, SIZET2NUM(READ_SIZE(b)));
+
+    if (RB_TYPE_P(document, T_HASH)) {
+      pvt_put_hash(self, document);
+      continue;
+    }
+
+    /* Other documents, such as BSON::RawDocument, encode themselves. */
+    if (NIL_P(document_type)) {
+      document_type = pvt_const_get_3("BSON", "Hash", "BSON_TYPE");
+    }
+    if (!rb_respond_to(document, pvt_id_bson_type) ||
+        !rb_equal(rb_funcall(document, pvt_id_bson_type, 0), document_type)) {
+      rb_raise(rb_eTypeError, "Element %ld of the batch is not a document: %"PRIsVALUE,
+        index, rb_obj_class(document));
+    }
+    rb_funcall(document, rb_intern("to_bson"), 1, self);
+  }
+
+  return offsets;
+}
+
+/**
+ * Replaces the key cache with one of at least `size` slots, rounded up to a
+ * power of two. A size of zero disables the cache.
+ */
+void rb_bson_key_cache_resize(long size)
+{
+  static int registered = 0;
+  unsigned long slots = 1;
+
+  if (!registered) {
+    rb_gc_register_address(&pvt_key_cache);
+    registered = 1;
+  }
+
+  if (size < 0) {
+    rb_raise(rb_eArgError, "Key cache size must not be negative: %ld", size);
+  }
+
+  if (size == 0) {
+    pvt_key_cache = Qnil;
+    pvt_key_cache_mask = 0;
+    return;
+  }
+
+  while (slots < (unsigned long)size) {
+    slots <<= 1;
+  }
+  pvt_key_cache = rb_ary_new_capa((long)slots);
+  rb_ary_store(pvt_key_cache, (long)slots - 1, Qnil);
+  pvt_key_cache_mask = slots - 1;
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_byte_buffer_set_key_cache_size(VALUE klass, VALUE size)
+{
+  rb_bson_key_cache_resize(NUM2LONG(size));
+  return size;
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_byte_buffer_key_cache_size(VALUE klass)
+{
+  if (NIL_P(pvt_key_cache)) {
+    return INT2FIX(0);
+  }
+  return ULONG2NUM(pvt_key_cache_mask + 1);
+}
+
 static const char *index_strings[] = {
    "0",   "1",   "2",   "3",   "4",   "5",   "6",   "7",   "8",   "9",   "10",
    "11",  "12",  "13",  "14",  "15",  "16",  "17",  "18",  "19",  "20",  "21",
@@ -695,3 +1207,189 @@ VALUE rb_bson_byte_buffer_put_array(VALUE self, VALUE array){
 
   return self;
 }
+
+typedef struct {
+  size_t size;
+  VALUE *scratch;
+} encoded_size_context;
+
+/**
+ * Returns the number of bytes a String occupies once converted to UTF-8,
+ * as it is by put_string and put_cstring.
+ */
+static size_t pvt_utf8_size(VALUE string)
+{
+  VALUE utf8_string;
+
+  if (ENCODING_GET(string) == rb_utf8_encindex() || rb_enc_str_asciionly_p(string)) {
+    return RSTRING_LEN(string);
+  }
+  utf8_string = pvt_bson_encode_to_utf8(string);
+  return RSTRING_LEN(utf8_string);
+}
+
+/**
+ * Returns the number of bytes written for a hash key, including its null
+ * terminator.
+ */
+static size_t pvt_key_size(VALUE key)
+{
+  switch (TYPE(key)) {
+    case T_STRING:
+      return RSTRING_LEN(key) + 1;
+    case T_SYMBOL:
+      return RSTRING_LEN(rb_sym2str(key)) + 1;
+    default:
+      key = rb_funcall(key, rb_intern("to_bson_key"), 0);
+      switch (TYPE(key)) {
+        case T_STRING:
+          return pvt_utf8_size(key) + 1;
+        case T_SYMBOL:
+          return RSTRING_LEN(rb_sym2str(key)) + 1;
+        case T_FIXNUM:
+          return RSTRING_LEN(rb_fix2str(key, 10)) + 1;
+        default:
+          rb_raise(rb_eTypeError, "Invalid type for put_cstring");
+      }
+  }
+}
+
+static int encoded_size_callback(VALUE key, VALUE val, VALUE context)
+{
+  encoded_size_context *ctx = (encoded_size_context *)context;
+
+  ctx->size += 1 + pvt_key_size(key) + pvt_field_size(val, ctx->scratch);
+  return ST_CONTINUE;
+}
+
+/**
+ * Returns the number of bytes written by to_bson for a value which
+ * pvt_put_field does not encode itself, by encoding it into a scratch
+ * buffer. The scratch buffer is allocated on first use.
+ */
+static size_t pvt_measured_size(VALUE val, VALUE *scratch)
+{
+  byte_buffer_t *b;
+
+  if (NIL_P(*scratch)) {
+    *scratch = rb_obj_alloc(pvt_const_get_2("BSON", "ByteBuffer"));
+  }
+  TypedData_Get_Struct(*scratch, byte_buffer_t, &rb_byte_buffer_data_type, b);
+  b->read_position = 0;
+  b->write_position = 0;
+
+  rb_funcall(val, rb_intern("to_bson"), 1, *scratch);
+  return b->write_position;
+}
+
+/**
+ * Returns the number of bytes pvt_put_field writes for `val`, which
+ * excludes its type byte and key. This mirrors pvt_put_field: values
+ * which it encodes itself are sized without being encoded, and other
+ * values are measured by encoding them.
+ */
+size_t pvt_field_size(VALUE val, VALUE *scratch)
+{
+  switch (TYPE(val)) {
+    case T_BIGNUM:
+    case T_FIXNUM:
+      return fits_int32(NUM2LL(val)) ? 4 : 8;
+    case T_FLOAT:
+      return 8;
+    case T_TRUE:
+    case T_FALSE:
+      return 1;
+    case T_HASH: {
+      encoded_size_context context = { 5, scratch };
+      rb_hash_foreach(val, encoded_size_callback, (VALUE)&context);
+      return context.size;
+    }
+    case T_ARRAY: {
+      size_t size = 5;
+      long index;
+      char digits[16];
+
+      for (index = 0; index < RARRAY_LEN(val); index++) {
+        size += 1 + snprintf(digits, sizeof(digits), "%ld", index) + 1;
+        size += pvt_field_size(RARRAY_AREF(val, index), scratch);
+      }
+      return size;
+    }
+    default:
+      break;
+  }
+
+  switch (pvt_native_type(val)) {
+    case BSON_TYPE_NULL:
+      return 0;
+    case BSON_TYPE_STRING:
+      return 4 + pvt_utf8_size(val) + 1;
+    case BSON_TYPE_SYMBOL:
+      return 4 + RSTRING_LEN(rb_sym2str(val)) + 1;
+    case BSON_TYPE_DATETIME:
+      return 8;
+    case BSON_TYPE_OBJECT_ID:
+      return 12;
+    case BSON_TYPE_DECIMAL128:
+      return 16;
+    case BSON_TYPE_DOCUMENT: {
+      VALUE data = rb_attr_get(val, pvt_id_data);
+
+      if (RB_TYPE_P(data, T_STRING)) {
+        return RSTRING_LEN(data);
+      }
+      break;
+    }
+    case BSON_TYPE_BINARY: {
+      VALUE data = rb_attr_get(val, pvt_id_data);
+      VALUE raw_type = rb_attr_get(val, pvt_id_raw_type);
+
+      if (RB_TYPE_P(data, T_STRING) && RB_TYPE_P(raw_type, T_STRING) && RSTRING_LEN(raw_type) == 1) {
+        return 4 + 1 + (*RSTRING_PTR(raw_type) == 0x02 ? 4 : 0) + RSTRING_LEN(data);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+
+  return pvt_measured_size(val, scratch);
+}
+
+/**
+ * Returns the number of bytes `val` is encoded into by pvt_put_field.
+ */
+size_t pvt_encoded_size(VALUE val)
+{
+  VALUE scratch = Qnil;
+  size_t size = pvt_field_size(val, &scratch);
+
+  RB_GC_GUARD(scratch);
+  return size;
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_encoded_size(VALUE self, VALUE obj)
+{
+  return SIZET2NUM(pvt_encoded_size(obj));
+}
+
+/* The docstring is in init.c. */
+VALUE rb_bson_encode(VALUE self, VALUE obj)
+{
+  VALUE rb_buffer = rb_obj_alloc(pvt_byte_buffer_class);
+  VALUE string = rb_str_buf_new(BSON_BYTE_BUFFER_SIZE);
+  byte_buffer_t *b;
+
+  TypedData_Get_Struct(rb_buffer, byte_buffer_t, &rb_byte_buffer_data_type, b);
+  rb_enc_associate_index(string, rb_ascii8bit_encindex());
+  rb_bson_byte_buffer_attach_target(b, string);
+
+  if (RB_TYPE_P(obj, T_HASH)) {
+    pvt_put_hash(rb_buffer, obj);
+  } else {
+    rb_funcall(obj, rb_intern("to_bson"), 1, rb_buffer);
+  }
+
+  return rb_bson_byte_buffer_detach_target(b);
+}
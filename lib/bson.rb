@@ -97,6 +97,8 @@ require "bson/integer"
 require "bson/array"
 require "bson/binary"
 require "bson/boolean"
+require "bson/builder"
+require "bson/byte_buffer_pool"
 require "bson/code"
 require "bson/code_with_scope"
 require "bson/date"
@@ -107,6 +109,8 @@ require "bson/big_decimal"
 require "bson/document"
 require "bson/ext_json"
 require "bson/false_class"
+require "bson/file_reader"
+require "bson/file_writer"
 require "bson/float"
 require "bson/hash"
 require "bson/dbref"
@@ -116,13 +120,16 @@ require "bson/min_key"
 require "bson/nil_class"
 require "bson/object"
 require "bson/object_id"
+require "bson/raw_document"
 require "bson/regexp"
+require "bson/stream_decoder"
 require "bson/string"
 require "bson/symbol"
 require "bson/time"
 require "bson/timestamp"
 require "bson/true_class"
 require "bson/undefined"
+require "bson/validation_failure"
 require "bson/vector"
 require "bson/version"
 
@@ -141,3 +148,5 @@ rescue LoadError => e
   $stderr.puts("Failed to load the necessary extensions: #{e.class}: #{e}")
   raise
 end
+
+BSON::ByteBuffer.extend(BSON::ByteBufferPool::Pooling)
@@ -0,0 +1,49 @@
+# frozen_string_literal: true
+# rubocop:todo all
+
+# Copyright (C) 2009-2020 MongoDB Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+
+module BSON
+
+  # Writes the elements of a document directly into a byte buffer, for
+  # code which knows the schema of the documents it encodes and would
+  # otherwise build a Hash only to serialize it immediately.
+  #
+  # Builders are yielded by ByteBuffer#document and by the #document and
+  # #array methods of another builder, and can only be used within the
+  # block they are yielded to. Each method writes one element (type byte,
+  # key and value) and the lengths of documents and arrays are filled in
+  # once their blocks return. Builders for arrays take no keys; their
+  # elements are given consecutive indexes.
+  #
+  # A method which raises, for example because its key or value is
+  # invalid, writes nothing, so the error can be rescued in the block and
+  # the document built further.
+  #
+  # The builder methods are implemented by the native extension.
+  #
+  # @example Encode a document without building a Hash.
+  #   buffer.document do |d|
+  #     d.value('_id', id)
+  #     d.int32('qty', 5)
+  #     d.document('item') do |item|
+  #       item.string('sku', sku)
+  #       item.array('tags') { |tags| tags.string('new') }
+  #     end
+  #   end
+  class Builder
+  end
+end
@@ -0,0 +1,138 @@
+# frozen_string_literal: true
+# rubocop:todo all
+
+# Copyright (C) 2009-2020 MongoDB Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+
+module BSON
+
+  # A small pool of byte buffers which are reused for encoding, so that a
+  # long-running process does not allocate (and repeatedly grow) a new
+  # buffer for every message.
+  #
+  # Buffers are lent out with #with and cleared, keeping their capacity,
+  # when they are returned. The pool retains at most +max_buffers+ buffers;
+  # returned buffers whose capacity exceeds +max_capacity+ are shrunk back
+  # to their embedded storage, which bounds the memory a pool holds on to.
+  #
+  # Pools are not thread-safe. ByteBuffer.pool returns a pool owned by the
+  # current thread (and therefore by the current Ractor).
+  #
+  # @example Encode a document with a pooled buffer.
+  #   BSON::ByteBuffer.pool.with do |buffer|
+  #     socket.write(document.to_bson(buffer).to_s)
+  #   end
+  class ByteBufferPool
+
+    # The default number of buffers a pool retains.
+    DEFAULT_MAX_BUFFERS = 4
+
+    # The default capacity, in bytes, above which returned buffers are
+    # shrunk.
+    DEFAULT_MAX_CAPACITY = 1024 * 1024
+
+    # @return [ Integer ] The maximum number of buffers retained.
+    attr_reader :max_buffers
+
+    # @return [ Integer ] The maximum capacity of a retained buffer.
+    attr_reader :max_capacity
+
+    # Create a byte buffer pool.
+    #
+    # @example Create a pool which retains buffers of up to 16 MiB.
+    #   BSON::ByteBufferPool.new(max_capacity: 16 * 1024 * 1024)
+    #
+    # @param [ Integer ] max_buffers The maximum number of buffers retained.
+    # @param [ Integer ] max_capacity The capacity, in bytes, above which
+    #   returned buffers are shrunk.
+    def initialize(max_buffers: DEFAULT_MAX_BUFFERS, max_capacity: DEFAULT_MAX_CAPACITY)
+      @max_buffers = max_buffers
+      @max_capacity = max_capacity
+      @buffers = []
+    end
+
+    # @return [ Integer ] The number of buffers available to be lent out.
+    def size
+      @buffers.size
+    end
+
+    # Take an empty buffer from the pool, or create one if the pool is
+    # empty. The buffer should be returned with #checkin.
+    #
+    # @return [ BSON::ByteBuffer ] The buffer.
+    def checkout
+      @buffers.pop || ByteBuffer.new
+    end
+
+    # Return a buffer to the pool. The buffer is cleared and must not be
+    # used by the caller afterwards.
+    #
+    # @param [ BSON::ByteBuffer ] buffer The buffer.
+    #
+    # @return [ nil ] Always nil.
+    def checkin(buffer)
+      # Buffers which cannot be cleared (on JRuby) are not reused.
+      return unless buffer.respond_to?(:clear)
+      return if @buffers.size >= max_buffers
+
+      buffer.clear
+      buffer.shrink_to_fit if buffer.capacity > max_capacity
+      @buffers.push(buffer)
+      nil
+    end
+
+    # Lend a buffer to the block and return it to the pool afterwards. The
+    # buffer must not be used once the block returns; copy out its contents
+    # with ByteBuffer#to_s instead.
+    #
+    # @example Encode a document with a pooled buffer.
+    #   bytes = pool.with { |buffer| document.to_bson(buffer).to_s }
+    #
+    # @yieldparam [ BSON::ByteBuffer ] buffer An empty buffer.
+    #
+    # @return [ Object ] The value of the block.
+    def with
+      buffer = checkout
+      begin
+        yield buffer
+      ensure
+        checkin(buffer)
+      end
+    end
+
+    # Get the pool of the current thread, creating it on first use.
+    #
+    # @return [ BSON::ByteBufferPool ] The pool.
+    def self.current
+      Thread.current.thread_variable_get(:__bson_byte_buffer_pool) ||
+        Thread.current.thread_variable_set(:__bson_byte_buffer_pool, new)
+    end
+
+    # Class methods added to ByteBuffer once it is defined by the native
+    # extension.
+    module Pooling
+
+      # Get the byte buffer pool of the current thread.
+      #
+      # @example Encode a document with a pooled buffer.
+      #   BSON::ByteBuffer.pool.with { |buffer| document.to_bson(buffer).to_s }
+      #
+      # @return [ BSON::ByteBufferPool ] The pool.
+      def pool
+        ByteBufferPool.current
+      end
+    end
+  end
+end
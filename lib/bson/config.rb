@@ -22,5 +22,78 @@ module BSON
   module Config
     extend self
 
+    # The default number of field names kept by the native decoder.
+    DEFAULT_FIELD_NAME_CACHE_SIZE = 1024
+
+    # The default number of hash keys kept by the native encoder.
+    DEFAULT_KEY_CACHE_SIZE = 1024
+
+    # Get the size of the cache of field names used when decoding hashes.
+    #
+    # @example Get the field name cache size.
+    #   BSON::Config.field_name_cache_size
+    #
+    # @return [ Integer ] The number of field names to cache.
+    def field_name_cache_size
+      @field_name_cache_size || DEFAULT_FIELD_NAME_CACHE_SIZE
+    end
+
+    # Set the size of the cache of field names used when decoding hashes.
+    #
+    # Decoded field names are frozen and deduplicated; the cache lets
+    # documents with repeated keys be decoded without allocating a String
+    # for each key. A size of zero disables the cache. Only the native
+    # extension uses this setting.
+    #
+    # @example Set the field name cache size.
+    #   BSON::Config.field_name_cache_size = 4096
+    #
+    # @param [ Integer ] size The number of field names to cache.
+    #
+    # @raise [ ArgumentError ] If the size is not a non-negative Integer.
+    def field_name_cache_size=(size)
+      unless size.is_a?(Integer) && size >= 0
+        raise ArgumentError, "Field name cache size must be a non-negative integer: #{size.inspect}"
+      end
+
+      @field_name_cache_size = size
+      if ByteBuffer.respond_to?(:field_name_cache_size=)
+        ByteBuffer.field_name_cache_size = size
+      end
+    end
+
+    # Get the size of the cache of hash keys used when encoding hashes.
+    #
+    # @example Get the key cache size.
+    #   BSON::Config.key_cache_size
+    #
+    # @return [ Integer ] The number of keys to cache.
+    def key_cache_size
+      @key_cache_size || DEFAULT_KEY_CACHE_SIZE
+    end
+
+    # Set the size of the cache of hash keys used when encoding hashes.
+    #
+    # Symbol and frozen String keys are remembered once they have been
+    # validated, so that documents with repeated keys are encoded without
+    # checking each key again. A size of zero disables the cache. Only the
+    # native extension uses this setting.
+    #
+    # @example Set the key cache size.
+    #   BSON::Config.key_cache_size = 4096
+    #
+    # @param [ Integer ] size The number of keys to cache.
+    #
+    # @raise [ ArgumentError ] If the size is not a non-negative Integer.
+    def key_cache_size=(size)
+      unless size.is_a?(Integer) && size >= 0
+        raise ArgumentError, "Key cache size must be a non-negative integer: #{size.inspect}"
+      end
+
+      @key_cache_size = size
+      if ByteBuffer.respond_to?(:key_cache_size=)
+        ByteBuffer.key_cache_size = size
+      end
+    end
   end
 end
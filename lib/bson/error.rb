@@ -7,6 +7,7 @@ module BSON
 end
 
 require 'bson/error/bson_decode_error'
+require 'bson/error/document_too_large'
 require 'bson/error/ext_json_parse_error'
 require 'bson/error/invalid_binary_type'
 require 'bson/error/invalid_dbref_argument'
@@ -0,0 +1,12 @@
+# frozen_string_literal: true
+# rubocop:todo all
+
+module BSON
+  class Error
+
+    # Exception raised when a document is larger than the maximum size it
+    # was allowed to be encoded into.
+    class DocumentTooLarge < Error
+    end
+  end
+end
@@ -0,0 +1,141 @@
+# frozen_string_literal: true
+# rubocop:todo all
+
+# Copyright (C) 2009-2020 MongoDB Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+
+module BSON
+
+  # Reads the documents of a file (or any IO) holding a sequence of BSON
+  # documents, such as the .bson files written by mongodump.
+  #
+  # The file is read in large read-ahead chunks, each of which is fed to a
+  # StreamDecoder, so every document is decoded straight out of the
+  # decoder's byte buffer without a read call or String per document.
+  # The chunk String is reused for every read.
+  #
+  # @example Count the documents of a dump.
+  #   BSON::FileReader.open('users.bson') { |reader| reader.count }
+  #
+  # @example Read documents without decoding them.
+  #   BSON::FileReader.open('users.bson', raw: true) do |reader|
+  #     reader.each { |raw| puts raw['_id'] }
+  #   end
+  class FileReader
+    include Enumerable
+
+    # The default number of bytes read from the file at a time.
+    DEFAULT_READ_AHEAD = 4 * 1024 * 1024
+
+    # @return [ Integer ] The number of bytes read from the file at a time.
+    attr_reader :read_ahead
+
+    # Open a file for reading. If a block is given the reader is yielded
+    # and closed when the block returns.
+    #
+    # @example Open a file.
+    #   BSON::FileReader.open('users.bson') { |reader| reader.to_a }
+    #
+    # @param [ String ] path The path of the file.
+    # @param [ Hash ] options The reader options; see #initialize.
+    #
+    # @return [ BSON::FileReader | Object ] The reader, or the result of
+    #   the block.
+    def self.open(path, **options)
+      reader = new(path, **options)
+      return reader unless block_given?
+
+      begin
+        yield reader
+      ensure
+        reader.close
+      end
+    end
+
+    # Create a file reader.
+    #
+    # @example Read documents from standard input.
+    #   BSON::FileReader.new($stdin)
+    #
+    # @param [ String | IO ] io_or_path The path of the file, or an IO to
+    #   read from. An IO is not closed by #close.
+    # @param [ Integer ] read_ahead The number of bytes to read at a time.
+    # @param [ true | false ] raw Whether to yield BSON::RawDocument
+    #   instances rather than decoded documents.
+    #
+    # @option options [ Integer ] :max_document_size The size, in bytes,
+    #   above which a document is rejected; see StreamDecoder#initialize.
+    # @option options [ nil | :bson ] :mode Decoding mode to use.
+    # @option options [ Array<String | Symbol> ] :only The fields to decode,
+    #   as dotted paths.
+    # @option options [ Array<String | Symbol> ] :except The fields to skip,
+    #   as dotted paths.
+    def initialize(io_or_path, read_ahead: DEFAULT_READ_AHEAD, raw: false, **options)
+      unless read_ahead.is_a?(Integer) && read_ahead > 0
+        raise ArgumentError, "Invalid read ahead: #{read_ahead.inspect}"
+      end
+
+      # Validates the options before the file is opened.
+      @decoder_options = options.merge(raw: raw)
+      StreamDecoder.new(**@decoder_options)
+
+      @read_ahead = read_ahead
+      if io_or_path.respond_to?(:read)
+        @io = io_or_path
+        @owns_io = false
+      else
+        @io = File.open(io_or_path, 'rb')
+        @owns_io = true
+        advise_sequential
+      end
+    end
+
+    # Yield each document read from the current position to the end of the
+    # file.
+    #
+    # @example Iterate over the documents.
+    #   reader.each { |doc| process(doc) }
+    #
+    # @return [ BSON::FileReader | Enumerator ] The reader, or an
+    #   enumerator if no block is given.
+    #
+    # @raise [ Error::BSONDecodeError ] If the file is corrupt or ends in
+    #   the middle of a document.
+    def each(&block)
+      return enum_for(:each) unless block_given?
+
+      decoder = StreamDecoder.new(**@decoder_options)
+      chunk = ::String.new(capacity: read_ahead)
+      while @io.read(read_ahead, chunk)
+        decoder.feed(chunk, &block)
+      end
+      decoder.finish
+      self
+    end
+
+    # Close the file, if it was opened by this reader.
+    def close
+      @io.close if @owns_io && !@io.closed?
+    end
+
+    private
+
+    def advise_sequential
+      @io.advise(:sequential)
+    rescue NotImplementedError, SystemCallError
+      # The advice is only a hint.
+    end
+  end
+end
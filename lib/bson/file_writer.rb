@@ -0,0 +1,164 @@
+# frozen_string_literal: true
+# rubocop:todo all
+
+# Copyright (C) 2009-2020 MongoDB Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+
+module BSON
+
+  # Writes a sequence of BSON documents to a file (or any IO), in the
+  # format read by FileReader and mongorestore.
+  #
+  # Documents are encoded into a single byte buffer which is written out
+  # once it holds +flush_size+ bytes and then cleared, keeping its storage,
+  # so writing a large file performs a small number of large writes and
+  # no per-document allocations for the encoded bytes.
+  #
+  # Buffered documents are only written by #flush and #close.
+  #
+  # @example Write a dump.
+  #   BSON::FileWriter.open('users.bson') do |writer|
+  #     users.each { |user| writer << user }
+  #   end
+  class FileWriter
+
+    # The default number of buffered bytes which triggers a write.
+    DEFAULT_FLUSH_SIZE = 4 * 1024 * 1024
+
+    # @return [ Integer ] The number of buffered bytes which triggers a
+    #   write.
+    attr_reader :flush_size
+
+    # Open a file for writing, truncating it. If a block is given the
+    # writer is yielded and closed when the block returns.
+    #
+    # @example Open a file.
+    #   BSON::FileWriter.open('users.bson') { |writer| writer << doc }
+    #
+    # @param [ String ] path The path of the file.
+    # @param [ Hash ] options The writer options; see #initialize.
+    #
+    # @return [ BSON::FileWriter | Object ] The writer, or the result of
+    #   the block.
+    def self.open(path, **options)
+      writer = new(path, **options)
+      return writer unless block_given?
+
+      begin
+        yield writer
+      ensure
+        writer.close
+      end
+    end
+
+    # Create a file writer.
+    #
+    # @example Write documents to standard output.
+    #   BSON::FileWriter.new($stdout)
+    #
+    # @param [ String | IO ] io_or_path The path of the file, or an IO to
+    #   write to. An IO is flushed but not closed by #close.
+    # @param [ Integer ] flush_size The number of buffered bytes which
+    #   triggers a write.
+    def initialize(io_or_path, flush_size: DEFAULT_FLUSH_SIZE)
+      unless flush_size.is_a?(Integer) && flush_size > 0
+        raise ArgumentError, "Invalid flush size: #{flush_size.inspect}"
+      end
+
+      @flush_size = flush_size
+      @buffer = new_buffer
+      if io_or_path.respond_to?(:write)
+        @io = io_or_path
+        @owns_io = false
+      else
+        @io = File.open(io_or_path, 'wb')
+        @owns_io = true
+      end
+    end
+
+    # @return [ Integer ] The number of encoded bytes not yet written.
+    def pending_bytes
+      @buffer.length
+    end
+
+    # Encode a document and buffer it, writing the buffer out if it has
+    # reached the flush size.
+    #
+    # @example Write a document.
+    #   writer.write(name: 'alice')
+    #
+    # @param [ Hash | BSON::RawDocument ] document The document.
+    #
+    # @return [ BSON::FileWriter ] The writer.
+    def write(document)
+      length = @buffer.length
+      begin
+        document.to_bson(@buffer)
+      rescue Exception
+        discard_after(length)
+        raise
+      end
+      flush if @buffer.length >= flush_size
+      self
+    end
+    alias :<< :write
+
+    # Write out the buffered documents.
+    #
+    # @return [ BSON::FileWriter ] The writer.
+    def flush
+      return self if @buffer.length.zero?
+
+      @io.write(@buffer.to_s)
+      if @buffer.respond_to?(:clear)
+        @buffer.clear
+      else
+        @buffer = new_buffer
+      end
+      self
+    end
+
+    # Write out the buffered documents and close the file, if it was
+    # opened by this writer.
+    def close
+      return if @io.closed?
+
+      flush
+      @owns_io ? @io.close : @io.flush
+    end
+
+    private
+
+    # Remove the bytes of a document which failed to encode from the
+    # buffer, keeping the first +length+ bytes.
+    def discard_after(length)
+      if @buffer.respond_to?(:truncate)
+        @buffer.truncate(length)
+      else
+        bytes = @buffer.to_s.byteslice(0, length)
+        @buffer = new_buffer
+        @buffer.put_bytes(bytes)
+      end
+    end
+
+    def new_buffer
+      if ByteBuffer.method_defined?(:reserve)
+        ByteBuffer.new(capacity: flush_size)
+      else
+        ByteBuffer.new
+      end
+    end
+  end
+end
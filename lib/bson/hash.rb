@@ -42,6 +42,24 @@ module BSON
       end
     end
 
+    # Get the hash as an encoded BSON document in a String.
+    #
+    # With the native extension the document is encoded directly into the
+    # returned String (see BSON.encode), which saves copying it out of a
+    # byte buffer.
+    #
+    # @example Get the hash as a BSON string.
+    #   { "field" => "value" }.to_bson_string
+    #
+    # @return [ String ] The encoded document, in binary encoding.
+    def to_bson_string
+      if BSON.respond_to?(:encode)
+        BSON.encode(self)
+      else
+        to_bson.to_s
+      end
+    end
+
     # Converts the hash to a normalized value in a BSON document.
     #
     # @example Convert the hash to a normalized value.
@@ -130,16 +148,31 @@ module BSON
       # @param [ ByteBuffer ] buffer The byte buffer.
       #
       # @option options [ nil | :bson ] :mode Decoding mode to use.
+      # @option options [ Array<String | Symbol> ] :only The fields to
+      #   decode, as dotted paths (e.g. 'meta.owner'). Other fields are
+      #   skipped without being decoded.
+      # @option options [ Array<String | Symbol> ] :except The fields to
+      #   leave out, as dotted paths.
       #
       # @return [ Hash ] The decoded hash.
       #
+      # @raise [ ArgumentError ] If both :only and :except are given.
+      #
       # @see http://bsonspec.org/#/specification
       def from_bson(buffer, **options)
         if buffer.respond_to?(:get_hash)
           buffer.get_hash(**options)
         else
+          only = options.delete(:only)
+          except = options.delete(:except)
           hash = parse_hash_from_buffer(buffer, **options)
-          maybe_dbref(hash)
+          if only || except
+            raise ArgumentError, 'Cannot specify both :only and :except' if only && except
+
+            project(hash, projection_tree(only || except), !except.nil?)
+          else
+            maybe_dbref(hash)
+          end
         end
       end
 
@@ -160,6 +193,65 @@ module BSON
         hash
       end
 
+      # Build a tree of nested hashes from dotted field paths. Each key maps
+      # to true if the whole field is selected, or to the tree of the
+      # selected fields of its embedded documents.
+      #
+      # @param [ Array<String | Symbol> ] paths the dotted field paths
+      #
+      # @return [ Hash ] the projection tree
+      def projection_tree(paths)
+        Array(paths).each_with_object({}) do |path, tree|
+          segments = path.to_s.split('.', -1)
+          if segments.empty? || segments.any?(&:empty?)
+            raise ArgumentError, "Invalid projection path: #{path.inspect}"
+          end
+
+          node = tree
+          segments[0..-2].each do |segment|
+            node = node[segment] ||= {}
+            break if node == true
+          end
+          node[segments.last] = true unless node == true
+        end
+      end
+
+      # Apply a projection tree to a decoded value. This is the pure Ruby
+      # counterpart of the projection done by the native get_hash, used
+      # when the buffer cannot decode hashes itself. Like the native decoder,
+      # it decodes the projected documents which look like DBRefs as such.
+      #
+      # @param [ Object ] value the decoded value
+      # @param [ Hash ] tree the projection tree
+      # @param [ true | false ] exclude whether the tree names the fields
+      #   to leave out
+      #
+      # @return [ Object ] the projected value
+      def project(value, tree, exclude)
+        case value
+        when ::Hash
+          projected = value.each_with_object(Document.allocate) do |(field, element), doc|
+            node = tree[field]
+            if node.nil? || node == true
+              doc.store(field, element) if node.nil? == exclude
+            elsif element.is_a?(::Hash) || element.is_a?(::Array)
+              doc.store(field, project(element, node, exclude))
+            elsif exclude
+              doc.store(field, element)
+            end
+          end
+          maybe_dbref(projected)
+        when ::Array
+          value.each_with_object([]) do |element, array|
+            if element.is_a?(::Hash) || element.is_a?(::Array)
+              array << project(element, tree, exclude)
+            elsif exclude
+              array << element
+            end
+          end
+        end
+      end
+
       # Given a byte buffer, extract and return a hash from it.
       #
       # @param [ ByteBuf ] buffer the buffer to read data from
@@ -0,0 +1,470 @@
+# frozen_string_literal: true
+# rubocop:todo all
+
+# Copyright (C) 2009-2020 MongoDB Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+module BSON
+
+  # A BSON document which is kept in its encoded form and whose fields are
+  # decoded on demand.
+  #
+  # Looking up a field walks the encoded elements, skipping over values by
+  # their length prefixes, and decodes only the requested value. Embedded
+  # documents are returned as RawDocument instances which share the bytes
+  # of their parent, so nested data stays encoded until it is accessed.
+  #
+  # Raw documents can be used as values of other documents and arrays, for
+  # example to pass a cached document through to a command. Their bytes
+  # are then copied verbatim, without being decoded and encoded again.
+  #
+  # Field access (#[], #key?, #each and #keys) and #with are implemented by
+  # the native extension, which also writes embedded raw documents without
+  # calling #to_bson. Where the extension does not provide them (on JRuby)
+  # the pure Ruby implementations in RawDocument::Fallback are used, which
+  # decode the values they pass over instead of skipping them.
+  #
+  # @note Embedded documents that look like DBRefs are returned as
+  #   RawDocument instances rather than BSON::DBRef; use #to_h to obtain
+  #   the fully decoded document.
+  #
+  # @example Read a single field from a document.
+  #   raw = BSON::RawDocument.from_bson(buffer)
+  #   raw['status']
+  class RawDocument
+
+    # Pure Ruby implementations of the methods which the native extension
+    # defines on RawDocument itself. Since this module is included, the
+    # native methods take precedence wherever they exist.
+    #
+    # @api private
+    module Fallback
+
+      # An encoded empty document.
+      EMPTY_DOCUMENT = "\x05\x00\x00\x00\x00".b.freeze
+
+      # @see RawDocument#[]
+      def [](key)
+        key = key.to_s
+        walk(data) { |_, field, value| return value if field == key }
+        nil
+      end
+
+      # @see RawDocument#key?
+      def key?(key)
+        key = key.to_s
+        walk(data) { |_, field| return true if field == key }
+        false
+      end
+
+      # @see RawDocument#each
+      def each
+        return enum_for(:each) { keys.size } unless block_given?
+
+        walk(data) { |_, field, value| yield [ field, value ] }
+        self
+      end
+
+      # @see RawDocument#keys
+      def keys
+        [].tap { |keys| walk(data) { |_, field| keys << field } }
+      end
+
+      private
+
+      # Walks the elements of the document encoded in +bytes+, yielding the
+      # type, name and value of each, and the offsets at which the element
+      # and its value start and at which it ends. Embedded documents are
+      # read as raw documents and arrays are read by #read_array.
+      def walk(bytes)
+        buffer = ByteBuffer.new(bytes)
+        buffer.get_int32
+        while (type = buffer.get_byte) != NULL_BYTE
+          start = buffer.read_position - 1
+          field = buffer.get_cstring
+          value_start = buffer.read_position
+          value = read_value(buffer, type, field)
+          if buffer.read_position >= bytes.bytesize
+            raise Error::BSONDecodeError, "Invalid value for field '#{field}' at offset #{value_start}"
+          end
+
+          yield type, field, value, start, value_start, buffer.read_position
+        end
+        return if buffer.read_position == bytes.bytesize
+
+        raise Error::BSONDecodeError,
+              "Expected to read #{bytes.bytesize} bytes for the hash but read #{buffer.read_position} bytes"
+      end
+
+      def read_value(buffer, type, field)
+        case type
+        when Hash::BSON_TYPE
+          self.class.from_bson(buffer, **@options)
+        when Array::BSON_TYPE
+          read_array(buffer)
+        else
+          cls = Registry.get(type, field)
+          @options.empty? ? cls.from_bson(buffer) : cls.from_bson(buffer, **@options)
+        end
+      end
+
+      # Reads an array whose documents are kept raw.
+      def read_array(buffer)
+        BSON.enter_nesting_depth
+        begin
+          start = buffer.read_position
+          length = buffer.get_int32
+          array = []
+          while (type = buffer.get_byte) != NULL_BYTE
+            array << read_value(buffer, type, buffer.get_cstring)
+          end
+          if buffer.read_position - start != length
+            raise Error::BSONDecodeError,
+                  "Expected array to take #{length} bytes but it took #{buffer.read_position - start} bytes"
+          end
+          array
+        ensure
+          BSON.leave_nesting_depth
+        end
+      end
+
+      # @see RawDocument#with
+      def splice(edits)
+        buffer = ByteBuffer.new
+        splice_document(buffer, data, edits, false)
+        buffer.to_s
+      end
+
+      # Writes the document (or array) encoded in +bytes+ with the edits
+      # applied, as the native splice does.
+      def splice_document(buffer, bytes, edits, is_array)
+        BSON.enter_nesting_depth
+        begin
+          position = buffer.length
+          buffer.put_int32(0)
+          applied = []
+          walk(bytes) do |type, field, _, start, value_start, finish|
+            index = edits.index { |name, _, _| name == field.b }
+            unless index
+              buffer.put_bytes(bytes.byteslice(start, finish - start))
+              next
+            end
+
+            applied << index
+            _, op, arg = edits[index]
+            if op == :rename_target && !element?(bytes, arg)
+              buffer.put_bytes(bytes.byteslice(start, finish - start))
+              next
+            end
+
+            case op
+            when :set
+              put_element(buffer, field, arg)
+            when :rename
+              buffer.put_byte(type)
+              buffer.put_cstring(arg)
+              buffer.put_bytes(bytes.byteslice(value_start, finish - value_start))
+            when :edit
+              unless type == Hash::BSON_TYPE || type == Array::BSON_TYPE
+                raise ArgumentError, "Cannot edit the fields of '#{field}', which is not a document or an array"
+              end
+
+              buffer.put_bytes(bytes.byteslice(start, value_start - start))
+              splice_document(buffer, bytes.byteslice(value_start, finish - value_start), arg,
+                              type == Array::BSON_TYPE)
+            else
+              raise ArgumentError, "Cannot remove or rename the array element '#{field}'" if is_array
+            end
+          end
+
+          edits.each_with_index do |(name, op, arg), index|
+            next if applied.include?(index)
+            next unless op == :set || (op == :edit && edits_set?(arg))
+            raise ArgumentError, "Cannot add the array element '#{name}'" if is_array
+
+            name = name.dup.force_encoding(Encoding::UTF_8)
+            if op == :set
+              put_element(buffer, name, arg)
+            else
+              buffer.put_byte(Hash::BSON_TYPE)
+              buffer.put_cstring(name)
+              splice_document(buffer, EMPTY_DOCUMENT, arg, false)
+            end
+          end
+
+          buffer.put_byte(NULL_BYTE)
+          buffer.replace_int32(position, buffer.length - position)
+        ensure
+          BSON.leave_nesting_depth
+        end
+      end
+
+      def put_element(buffer, name, value)
+        unless value.respond_to?(:bson_type)
+          raise Error::UnserializableClass,
+                "Value for key '#{name}' does not define its BSON serialized type: #{value}"
+        end
+
+        buffer.put_byte(value.bson_type)
+        buffer.put_cstring(name)
+        value.to_bson(buffer)
+      end
+
+      # Whether the document encoded in +bytes+ has a field with the given
+      # binary name.
+      def element?(bytes, name)
+        walk(bytes) { |_, field| return true if field.b == name }
+        false
+      end
+
+      # Whether the edits set any field, creating the document holding it
+      # if it does not exist.
+      def edits_set?(edits)
+        edits.any? { |_, op, arg| op == :set || (op == :edit && edits_set?(arg)) }
+      end
+    end
+
+    include Enumerable
+    include Fallback
+
+    # @return [ String ] The encoded document, as a frozen binary string.
+    attr_reader :data
+
+    # Create a raw document from its encoded bytes.
+    #
+    # @example Create a raw document.
+    #   BSON::RawDocument.new({ 'a' => 1 }.to_bson.to_s)
+    #
+    # @param [ String ] data The encoded document.
+    #
+    # @option options [ nil | :bson ] :mode Decoding mode to use for the
+    #   values of the document.
+    #
+    # @raise [ Error::BSONDecodeError ] If the length prefix or terminator
+    #   of the document is invalid.
+    def initialize(data, **options)
+      data = data.to_s if data.is_a?(ByteBuffer)
+      unless data.frozen? && data.encoding == Encoding::BINARY
+        data = data.b.freeze
+      end
+      validate_framing!(data)
+
+      @data = data
+      @options = options.freeze
+    end
+
+    # Get the value for the given field, raising KeyError or invoking the
+    # block if the field does not exist.
+    #
+    # @param [ String | Symbol ] key The field name.
+    #
+    # @return [ Object ] The decoded value.
+    def fetch(key, *args)
+      return self[key] if key?(key)
+      return yield(key) if block_given?
+      return args.first unless args.empty?
+
+      raise KeyError, "key not found: #{key.inspect}"
+    end
+
+    # @see #key?
+    def has_key?(key)
+      key?(key)
+    end
+    alias :include? :has_key?
+
+    # @see #each
+    def each_pair(&block)
+      each(&block)
+    end
+
+    # @return [ Array<Object> ] The decoded values, in document order.
+    def values
+      map { |_, value| value }
+    end
+
+    # @return [ Integer ] The number of fields in the document.
+    def size
+      keys.size
+    end
+    alias :length :size
+
+    # @return [ true | false ] Whether the document has no fields.
+    def empty?
+      data.bytesize == 5
+    end
+
+    # Create a copy of the document with fields set, removed or renamed,
+    # without decoding it.
+    #
+    # Fields are given as dotted paths, which may also refer to the
+    # elements of arrays by index. The encoded elements are walked to find
+    # the fields: new values are encoded in place of the old ones, fields
+    # which do not exist are appended (creating the embedded documents
+    # containing them), and every other element is copied verbatim.
+    #
+    # As with the MongoDB update operators, removing or renaming a field
+    # which does not exist does nothing, and renaming a field replaces any
+    # existing field with the new name.
+    #
+    # @example Stamp a version on a document.
+    #   raw.with(set: { 'version' => 2, 'meta.updated_at' => Time.now })
+    #
+    # @param [ Hash ] set The values to set, by path.
+    # @param [ Array<String | Symbol> ] unset The paths of the fields to
+    #   remove.
+    # @param [ Hash ] rename The new names of fields, by path. The new name
+    #   is the name of the field within the same document, not a path.
+    #
+    # @return [ BSON::RawDocument ] The edited document.
+    #
+    # @raise [ ArgumentError ] If a path is given more than once, or is
+    #   edited along with a field inside it, or if an array element would
+    #   be removed, renamed or added.
+    def with(set: {}, unset: [], rename: {})
+      edits = {}
+      set.each { |path, value| add_edit(edits, path, [ :set, value ]) }
+      unset.each { |path| add_edit(edits, path, [ :unset, nil ]) }
+      rename.each do |path, name|
+        name = name.to_s
+        if name.empty? || name.include?('.')
+          raise ArgumentError, "Invalid new name for '#{path}': #{name.inspect}"
+        end
+
+        add_edit(edits, path, [ :rename, name ])
+        parent, _, source = path.to_s.rpartition('.')
+        add_edit(edits, parent.empty? ? name : "#{parent}.#{name}",
+                 [ :rename_target, source.encode(Encoding::UTF_8).b.freeze ])
+      end
+
+      self.class.new(splice(edit_list(edits)), **@options)
+    end
+
+    # Decode the entire document, including all embedded documents.
+    #
+    # @example Decode the document.
+    #   raw.to_h
+    #
+    # @return [ BSON::Document ] The decoded document.
+    def to_h
+      ::Hash.from_bson(ByteBuffer.new(data), **@options)
+    end
+    alias :to_document :to_h
+
+    # Write the encoded document to the buffer. The bytes are copied
+    # verbatim without being decoded.
+    #
+    # @param [ BSON::ByteBuffer ] buffer The buffer to write to.
+    #
+    # @return [ BSON::ByteBuffer ] The buffer.
+    def to_bson(buffer = ByteBuffer.new)
+      buffer.put_bytes(data)
+    end
+
+    # @return [ String ] The BSON type of an embedded document.
+    def bson_type
+      Hash::BSON_TYPE
+    end
+
+    # Raw documents are equal to other raw documents with the same bytes,
+    # and to hashes with the same decoded contents.
+    #
+    # @param [ Object ] other The object to compare with.
+    #
+    # @return [ true | false ] Whether the objects are equal.
+    def ==(other)
+      case other
+      when RawDocument then data == other.data
+      when ::Hash then to_h == other
+      else false
+      end
+    end
+
+    # @return [ Hash ] The decoded document as extended JSON.
+    def as_extended_json(**options)
+      to_h.as_extended_json(**options)
+    end
+
+    # @return [ Hash ] The decoded document as JSON.
+    def as_json(*args)
+      to_h.as_json(*args)
+    end
+
+    # @return [ String ] A description of the raw document.
+    def inspect
+      "#<BSON::RawDocument size=#{data.bytesize}>"
+    end
+
+    # Read a raw document from the buffer. The document's bytes are copied
+    # out of the buffer but none of its fields are decoded.
+    #
+    # @param [ ByteBuffer ] buffer The byte buffer.
+    #
+    # @option options [ nil | :bson ] :mode Decoding mode to use for the
+    #   values of the document.
+    #
+    # @return [ BSON::RawDocument ] The raw document.
+    def self.from_bson(buffer, **options)
+      length = buffer.get_int32
+      if length < 5
+        raise Error::BSONDecodeError, "Invalid document length: #{length}"
+      end
+
+      data = [ length ].pack('l<') << buffer.get_bytes(length - 4)
+      new(data.freeze, **options)
+    end
+
+    private
+
+    # Adds the edit of a field, given by its path, to the tree of edits
+    # keyed by field name.
+    def add_edit(edits, path, edit)
+      names = path.to_s.split('.', -1)
+      if names.empty? || names.any?(&:empty?)
+        raise ArgumentError, "Invalid field path: #{path.inspect}"
+      end
+
+      *parents, name = names
+      parents.each do |parent|
+        parent_edit = (edits[parent] ||= [ :edit, {} ])
+        unless parent_edit.first == :edit
+          raise ArgumentError, "Conflicting edits of '#{path}'"
+        end
+        edits = parent_edit.last
+      end
+      raise ArgumentError, "Conflicting edits of '#{path}'" if edits.key?(name)
+
+      edits[name] = edit
+    end
+
+    # Converts the tree of edits to the arrays of [ name, operation,
+    # argument ] read by #splice.
+    def edit_list(edits)
+      edits.map do |name, (op, arg)|
+        [ name.encode(Encoding::UTF_8).b.freeze, op, op == :edit ? edit_list(arg) : arg ]
+      end
+    end
+
+    def validate_framing!(data)
+      if data.bytesize < 5 || data.unpack1('l<') != data.bytesize
+        raise Error::BSONDecodeError,
+              "Document length prefix does not match the #{data.bytesize} bytes given"
+      end
+
+      unless data.getbyte(-1) == 0
+        raise Error::BSONDecodeError, 'Document is not null-terminated'
+      end
+    end
+  end
+end
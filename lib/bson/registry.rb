@@ -63,6 +63,8 @@ module BSON
     def register(byte, type)
       MAPPINGS[byte.ord] = type
       define_type_reader(type)
+      # Provided by the native extension, which caches type bytes by class.
+      clear_type_byte_cache if respond_to?(:clear_type_byte_cache, true)
     end
 
     private
@@ -0,0 +1,151 @@
+# frozen_string_literal: true
+# rubocop:todo all
+
+# Copyright (C) 2009-2020 MongoDB Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+module BSON
+
+  # Decodes a stream of BSON documents which arrives in chunks of arbitrary
+  # size, for example from a socket or a pipe.
+  #
+  # Chunks are appended to an internal byte buffer and each document is
+  # decoded as soon as all of the bytes its length prefix declares have
+  # been received. Leftover bytes of a partial document are kept for the
+  # next chunk.
+  #
+  # The decoder never reads from an IO itself, so it works equally well
+  # with blocking reads, IO#read_nonblock and the Fiber scheduler.
+  #
+  # Decoding (#feed) is implemented by the native extension. Where the
+  # extension does not provide it (on JRuby) the pure Ruby implementation
+  # in StreamDecoder::Fallback is used, which copies the pending bytes on
+  # every call.
+  #
+  # @example Decode documents from a socket.
+  #   decoder = BSON::StreamDecoder.new
+  #   loop do
+  #     chunk = socket.read_nonblock(16 * 1024, exception: false)
+  #     break if chunk.nil?
+  #     next socket.wait_readable if chunk == :wait_readable
+  #
+  #     decoder.feed(chunk) { |doc| process(doc) }
+  #   end
+  #   decoder.finish
+  class StreamDecoder
+
+    # Pure Ruby implementation of #feed, which the native extension defines
+    # on StreamDecoder itself. Since this module is included, the native
+    # method takes precedence wherever it exists.
+    #
+    # @api private
+    module Fallback
+
+      # @see StreamDecoder#feed
+      def feed(bytes)
+        documents = [] unless block_given?
+        pending = @buffer.to_s << bytes.to_str.b
+        offset = 0
+        begin
+          while pending.bytesize - offset >= 4
+            length = pending.byteslice(offset, 4).unpack1('l<')
+            if length < 5
+              raise Error::BSONDecodeError, "Invalid document length in stream: #{length}"
+            end
+            if length > max_document_size
+              raise Error::BSONDecodeError,
+                    "Document length in stream of #{length} bytes exceeds the maximum of #{max_document_size} bytes"
+            end
+            break if pending.bytesize - offset < length
+
+            data = pending.byteslice(offset, length)
+            offset += length
+            document = if @raw
+                         RawDocument.new(data, **@options)
+                       else
+                         ::Hash.from_bson(ByteBuffer.new(data), **@options)
+                       end
+            documents ? documents << document : yield(document)
+          end
+        ensure
+          @buffer = ByteBuffer.new(pending.byteslice(offset, pending.bytesize - offset))
+        end
+        documents || self
+      end
+    end
+
+    include Fallback
+
+    # The default maximum size of a document in the stream: the largest
+    # document the server produces, 16 MiB plus 16 KiB of internal overhead.
+    DEFAULT_MAX_DOCUMENT_SIZE = 16 * 1024 * 1024 + 16 * 1024
+
+    # @return [ Integer ] The size, in bytes, above which a length prefix is
+    #   rejected.
+    attr_reader :max_document_size
+
+    # Create a stream decoder.
+    #
+    # @example Create a decoder which returns BSON types.
+    #   BSON::StreamDecoder.new(mode: :bson)
+    #
+    # @param [ true | false ] raw Whether to return each document as a
+    #   BSON::RawDocument holding its bytes, rather than decoding it.
+    # @param [ Integer ] max_document_size The size, in bytes, above which
+    #   a document is rejected before any of it is buffered, so that a
+    #   length prefix from an untrusted peer cannot make the decoder
+    #   allocate an arbitrary amount of memory.
+    #
+    # @option options [ nil | :bson ] :mode Decoding mode to use.
+    # @option options [ Array<String | Symbol> ] :only The fields to decode,
+    #   as dotted paths.
+    # @option options [ Array<String | Symbol> ] :except The fields to skip,
+    #   as dotted paths.
+    #
+    # @raise [ ArgumentError ] If raw documents are requested along with
+    #   :only or :except.
+    def initialize(raw: false, max_document_size: DEFAULT_MAX_DOCUMENT_SIZE, **options)
+      if raw && (options.key?(:only) || options.key?(:except))
+        raise ArgumentError, 'Cannot select fields of raw documents'
+      end
+      unless max_document_size.is_a?(Integer) && max_document_size >= 5
+        raise ArgumentError, "Invalid maximum document size: #{max_document_size.inspect}"
+      end
+
+      @raw = raw
+      @max_document_size = max_document_size
+      @options = options.freeze
+      @buffer = ByteBuffer.new
+    end
+
+    # @return [ Integer ] The number of bytes received which do not yet
+    #   form a complete document.
+    def pending_bytes
+      @buffer.length
+    end
+
+    # Check that the stream did not end in the middle of a document.
+    #
+    # @example Finish decoding the stream.
+    #   decoder.finish
+    #
+    # @raise [ Error::BSONDecodeError ] If a partial document is pending.
+    def finish
+      return if pending_bytes.zero?
+
+      raise Error::BSONDecodeError,
+            "Stream ended with #{pending_bytes} bytes of an incomplete document"
+    end
+  end
+end
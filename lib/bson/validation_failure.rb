@@ -0,0 +1,58 @@
+# frozen_string_literal: true
+# rubocop:todo all
+
+# Copyright (C) 2009-2020 MongoDB Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+module BSON
+
+  # Describes why data is not a valid BSON document.
+  #
+  # @see BSON.validate
+  class ValidationFailure
+
+    # @return [ Integer ] The offset of the first invalid byte.
+    attr_reader :offset
+
+    # @return [ String ] Why the data is invalid.
+    attr_reader :reason
+
+    # Create a validation failure.
+    #
+    # @param [ Integer ] offset The offset of the first invalid byte.
+    # @param [ String ] reason Why the data is invalid.
+    def initialize(offset, reason)
+      @offset = offset
+      @reason = reason.freeze
+      freeze
+    end
+
+    # @param [ Object ] other The object to compare with.
+    #
+    # @return [ true | false ] Whether the failures are the same.
+    def ==(other)
+      other.is_a?(ValidationFailure) && offset == other.offset && reason == other.reason
+    end
+
+    # @return [ String ] The reason and offset of the failure.
+    def to_s
+      "#{reason} at offset #{offset}"
+    end
+
+    # @return [ String ] A description of the failure.
+    def inspect
+      "#<BSON::ValidationFailure #{self}>"
+    end
+  end
+end
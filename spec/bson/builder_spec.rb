@@ -0,0 +1,153 @@
+# rubocop:todo all
+require 'spec_helper'
+
+describe BSON::Builder do
+  before { skip 'C native extension not used on JRuby' if BSON::Environment.jruby? }
+
+  let(:buffer) { BSON::ByteBuffer.new }
+
+  def decode(buffer)
+    Hash.from_bson(BSON::ByteBuffer.new(buffer.to_s), mode: :bson)
+  end
+
+  describe 'ByteBuffer#document' do
+    it 'writes the same bytes as the equivalent hash' do
+      buffer.document do |d|
+        d.int32('a', 1)
+        d.string(:b, 'x')
+        d.document('c') do |c|
+          c.null('n')
+          c.array('t') do |t|
+            t.int64(5)
+            t.boolean(true)
+            t.document { |x| x.double('f', 1) }
+          end
+        end
+        d.value('v', Time.at(0))
+      end
+
+      hash = {
+        'a' => 1, 'b' => 'x',
+        'c' => { 'n' => nil, 't' => [ BSON::Int64.new(5), true, { 'f' => 1.0 } ] },
+        'v' => Time.at(0),
+      }
+      expect(buffer.to_s).to eq(hash.to_bson.to_s)
+    end
+
+    it 'appends to the data already in the buffer' do
+      buffer.put_int32(7)
+      buffer.document { |d| d.int32('a', 1) }
+      expect(buffer.get_int32).to eq(7)
+      expect(buffer.get_hash).to eq('a' => 1)
+    end
+
+    it 'writes an empty document' do
+      expect(buffer.document { }.to_s).to eq({}.to_bson.to_s)
+    end
+
+    it 'requires a block' do
+      expect { buffer.document }.to raise_error(LocalJumpError)
+    end
+
+    context 'when the block raises' do
+      it 'removes the partial document' do
+        buffer.put_int32(7)
+        expect do
+          buffer.document do |d|
+            d.int32('a', 1)
+            raise 'failed'
+          end
+        end.to raise_error(RuntimeError, 'failed')
+        expect(buffer.length).to eq(4)
+      end
+
+      it 'removes the partial document after the buffer has grown' do
+        buffer.put_bytes('x' * 112)
+        buffer.get_bytes(104)
+        expect do
+          buffer.document do |d|
+            d.string('s', 'y' * 200)
+            raise 'failed'
+          end
+        end.to raise_error(RuntimeError, 'failed')
+        expect(buffer.to_s).to eq('x' * 8)
+      end
+    end
+
+    context 'when a nested block raises and the error is rescued' do
+      it 'removes the nested element and keeps the array indexes' do
+        buffer.document do |d|
+          d.array('t') do |t|
+            t.int32(1)
+            begin
+              t.document { |x| x.int32('y', 2); raise 'failed' }
+            rescue RuntimeError
+            end
+            t.int32(3)
+          end
+        end
+        expect(decode(buffer)).to eq('t' => [ 1, 3 ])
+      end
+    end
+  end
+
+  describe 'element methods' do
+    it 'validates the value before writing anything' do
+      buffer.document do |d|
+        expect { d.int32('a', 2**31) }.to raise_error(RangeError)
+        expect { d.boolean('b', nil) }.to raise_error(TypeError)
+        expect { d.string('c', 1) }.to raise_error(TypeError)
+      end
+      expect(buffer.to_s).to eq({}.to_bson.to_s)
+    end
+
+    it 'checks the number of arguments' do
+      buffer.document do |d|
+        expect { d.int32(1) }.to raise_error(ArgumentError)
+        d.array('t') { |t| expect { t.int32('k', 1) }.to raise_error(ArgumentError) }
+      end
+    end
+
+    it 'rejects keys with null bytes' do
+      buffer.document do |d|
+        expect { d.int32("a\x00b", 1) }.to raise_error(ArgumentError)
+      end
+    end
+
+    it 'leaves nothing of a rejected element behind' do
+      buffer.document do |d|
+        d.int32('a', 1)
+        expect { d.string('s', "\xff".dup.force_encoding('UTF-8')) }.to raise_error(EncodingError)
+        expect { d.int32("k\x00", 1) }.to raise_error(ArgumentError)
+        expect { d.value('v', Object.new) }.to raise_error(BSON::Error::UnserializableClass)
+        d.array('t') do |t|
+          expect { t.string("\xff".dup.force_encoding('UTF-8')) }.to raise_error(EncodingError)
+          t.int32(2)
+        end
+        d.int32('b', 2)
+      end
+      expect(BSON.validate(buffer.to_s)).to be_nil
+      expect(decode(buffer)).to eq('a' => 1, 't' => [ 2 ], 'b' => 2)
+    end
+  end
+
+  describe 'builder lifetime' do
+    it 'cannot be used after its block returns' do
+      builder = nil
+      buffer.document { |d| builder = d }
+      expect { builder.int32('a', 1) }.to raise_error(RuntimeError, /after its block/)
+    end
+
+    it 'cannot be used while a nested document is built' do
+      buffer.document do |d|
+        d.document('c') do |c|
+          expect { d.int32('a', 1) }.to raise_error(RuntimeError, /nested/)
+        end
+      end
+    end
+
+    it 'cannot be created directly' do
+      expect { described_class.new }.to raise_error(TypeError)
+    end
+  end
+end
@@ -0,0 +1,53 @@
+# rubocop:todo all
+require 'spec_helper'
+
+describe BSON::ByteBufferPool do
+  before do
+    skip 'C native extension not used on JRuby' if BSON::Environment.jruby?
+  end
+
+  let(:pool) { described_class.new(max_buffers: 2, max_capacity: 16_384) }
+
+  describe '#with' do
+    it 'lends an empty buffer and reuses it' do
+      first = pool.with { |buffer| buffer.put_bytes('abc'); buffer }
+      second = pool.with { |buffer| expect(buffer.length).to eq(0); buffer }
+      expect(second).to equal(first)
+    end
+
+    it 'returns the value of the block' do
+      expect(pool.with { |buffer| { 'a' => 1 }.to_bson(buffer).to_s }).to eq({ 'a' => 1 }.to_bson.to_s)
+    end
+
+    it 'returns the buffer when the block raises' do
+      expect do
+        pool.with { raise 'failed' }
+      end.to raise_error(RuntimeError)
+      expect(pool.size).to eq(1)
+    end
+
+    it 'keeps the capacity of returned buffers' do
+      pool.with { |buffer| buffer.put_bytes('x' * 3000) }
+      pool.with { |buffer| expect(buffer.capacity).to be >= 3000 }
+    end
+
+    it 'shrinks buffers larger than the maximum capacity' do
+      pool.with { |buffer| buffer.put_bytes('x' * 20_000) }
+      pool.with { |buffer| expect(buffer.capacity).to eq(128) }
+    end
+  end
+
+  describe '#checkin' do
+    it 'retains at most the maximum number of buffers' do
+      3.times { pool.checkin(BSON::ByteBuffer.new) }
+      expect(pool.size).to eq(2)
+    end
+  end
+
+  describe 'BSON::ByteBuffer.pool' do
+    it 'returns the pool of the current thread' do
+      expect(BSON::ByteBuffer.pool).to equal(BSON::ByteBuffer.pool)
+      expect(Thread.new { BSON::ByteBuffer.pool }.value).not_to equal(BSON::ByteBuffer.pool)
+    end
+  end
+end
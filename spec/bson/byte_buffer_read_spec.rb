@@ -195,4 +195,344 @@ describe BSON::ByteBuffer do
       expect(buffer.read_position).to eq(12)
     end
   end
+
+  describe '#get_hash' do
+
+    let(:object_id) { BSON::ObjectId.new }
+
+    let(:document) do
+      {
+        'oid' => object_id,
+        'time' => Time.at(1_500_000_000, 123_000, :usec).utc,
+        'nil' => nil,
+        'binary' => BSON::Binary.new("\x01\x02", :user),
+        'decimal' => BigDecimal('1.5'),
+        'regex' => BSON::Regexp::Raw.new('^a', 'i'),
+        'timestamp' => BSON::Timestamp.new(1, 2),
+        'code' => BSON::Code.new('f()'),
+        'scope' => BSON::CodeWithScope.new('g()', 'x' => 1),
+        'min' => BSON::MinKey.new,
+        'max' => BSON::MaxKey.new,
+      }
+    end
+
+    let(:buffer) do
+      described_class.new(document.to_bson.to_s)
+    end
+
+    it 'decodes every type' do
+      expect(buffer.get_hash).to eq(document)
+    end
+
+    it 'returns frozen field names' do
+      expect(buffer.get_hash.keys).to all(be_frozen)
+    end
+
+    it 'reuses field names across documents' do
+      other = described_class.new(document.to_bson.to_s).get_hash
+      expect(buffer.get_hash.keys.first).to equal(other.keys.first)
+    end
+
+    it 'decodes Decimal128 values in bson mode' do
+      expect(buffer.get_hash(mode: :bson)['decimal']).to eq(BSON::Decimal128.new('1.5'))
+    end
+
+    context 'when documents and arrays are deeply nested' do
+
+      let(:document) do
+        (1..100).reduce({ 'leaf' => 1 }) do |inner, i|
+          i.even? ? { 'd' => inner, 'n' => i } : { 'a' => [ i, inner ] }
+        end
+      end
+
+      it 'decodes every level' do
+        expect(buffer.get_hash).to eq(document)
+      end
+    end
+
+    context 'when arrays contain DBRefs' do
+
+      let(:document) do
+        { 'refs' => [ { '$ref' => 'users', '$id' => 1 }, [ { '$ref' => 'posts', '$id' => 2 } ] ] }
+      end
+
+      it 'decodes them as DBRefs in place' do
+        refs = buffer.get_hash['refs']
+        expect(refs.first).to be_a(BSON::DBRef)
+        expect(refs.last.first).to be_a(BSON::DBRef)
+        expect(refs.last.first.collection).to eq('posts')
+      end
+    end
+
+    it 'decodes values in nested arrays in bson mode' do
+      buffer = described_class.new({ 'a' => [ [ BSON::Int64.new(1) ] ] }.to_bson.to_s)
+      expect(buffer.get_hash(mode: :bson)['a'].first.first).to eq(BSON::Int64.new(1))
+    end
+
+    context 'when a type has been registered to another class' do
+
+      let(:timestamp_class) do
+        Class.new do
+          def self.from_bson(buffer, **options)
+            buffer.get_bytes(8)
+            :custom
+          end
+        end
+      end
+
+      around do |example|
+        BSON::Registry.register(BSON::Timestamp::BSON_TYPE, timestamp_class)
+        begin
+          example.run
+        ensure
+          BSON::Registry.register(BSON::Timestamp::BSON_TYPE, BSON::Timestamp)
+        end
+      end
+
+      it 'decodes the type using the registered class' do
+        expect(buffer.get_hash['timestamp']).to eq(:custom)
+        expect(buffer.length).to eq(0)
+      end
+    end
+  end
+
+  describe '#get_documents' do
+
+    let(:documents) do
+      [ { 'a' => 1 }, { 'b' => BSON::Int64.new(2) }, { 'c' => { 'd' => 'e' } } ]
+    end
+
+    let(:buffer) do
+      described_class.new(documents.map { |doc| doc.to_bson.to_s }.join)
+    end
+
+    it 'reads all documents' do
+      expect(buffer.get_documents).to eq([ { 'a' => 1 }, { 'b' => 2 }, { 'c' => { 'd' => 'e' } } ])
+      expect(buffer.length).to eq(0)
+    end
+
+    it 'reads the given number of documents' do
+      expect(buffer.get_documents(2)).to eq([ { 'a' => 1 }, { 'b' => 2 } ])
+      expect(buffer.get_hash).to eq('c' => { 'd' => 'e' })
+    end
+
+    it 'applies the options to every document' do
+      expect(buffer.get_documents(mode: :bson)[1]['b']).to eq(BSON::Int64.new(2))
+      buffer.rewind!
+      expect(buffer.get_documents(only: [ 'c.d' ])).to eq([ {}, {}, { 'c' => { 'd' => 'e' } } ])
+    end
+
+    it 'raises on a truncated document' do
+      buffer = described_class.new({ 'a' => 1 }.to_bson.to_s + "\x10\x00\x00\x00")
+      expect do
+        buffer.get_documents
+      end.to raise_error(RangeError)
+    end
+  end
+
+  describe '#each_document' do
+
+    let(:buffer) do
+      described_class.new({ 'a' => 1 }.to_bson.to_s + { 'b' => 2 }.to_bson.to_s)
+    end
+
+    it 'yields each document' do
+      yielded = []
+      buffer.each_document { |doc| yielded << doc }
+      expect(yielded).to eq([ { 'a' => 1 }, { 'b' => 2 } ])
+    end
+
+    it 'returns an enumerator without a block' do
+      expect(buffer.each_document(except: [ 'a' ]).to_a).to eq([ {}, { 'b' => 2 } ])
+    end
+  end
+
+  context 'when the buffer is shared with its source' do
+    before { skip 'C native extension not used on JRuby' if BSON::Environment.jruby? }
+
+    let(:long) { 'x' * 2048 }
+
+    let(:bytes) do
+      { 'long' => long, 'short' => 'y', 'data' => BSON::Binary.new('z' * 2048) }.to_bson.to_s
+    end
+
+    let(:buffer) { described_class.new(bytes, shared: true) }
+
+    it 'decodes the same values' do
+      expect(buffer.get_hash).to eq(Hash.from_bson(described_class.new(bytes)))
+    end
+
+    it 'returns strings in their usual encodings' do
+      doc = buffer.get_hash
+      expect(doc['long'].encoding).to eq(Encoding::UTF_8)
+      expect(doc['data'].data.encoding).to eq(Encoding::BINARY)
+    end
+
+    it 'returns strings that can be modified' do
+      doc = buffer.get_hash
+      doc['long'] << 'x'
+      expect(doc['long'].bytesize).to eq(2049)
+      expect(described_class.new(bytes).get_hash['long']).to eq(long)
+    end
+
+    it 'is not affected by later changes to the source' do
+      source = bytes.dup
+      buffer = described_class.new(source, shared: true)
+      source.replace('0' * source.bytesize)
+      expect(buffer.get_hash['long']).to eq(long)
+    end
+
+    it 'accepts a custom threshold' do
+      buffer = described_class.new(bytes, shared: 1)
+      expect(buffer.get_hash['short']).to eq('y')
+    end
+
+    it 'keeps decoding correctly after writes' do
+      buffer.put_int32(0)
+      expect(buffer.get_hash['long']).to eq(long)
+    end
+
+    it 'rejects a threshold below one' do
+      expect do
+        described_class.new(bytes, shared: 0)
+      end.to raise_error(ArgumentError)
+    end
+  end
+
+  describe '.wrap' do
+    before do
+      skip 'C native extension not used on JRuby' if BSON::Environment.jruby?
+    end
+
+    let(:long) { 'x' * 2048 }
+
+    let(:bytes) { { 'long' => long, 'n' => 1 }.to_bson.to_s.freeze }
+
+    let(:buffer) { described_class.wrap(bytes) }
+
+    it 'reads the string in place' do
+      expect(buffer).to be_read_only
+      expect(buffer.length).to eq(bytes.bytesize)
+      expect(buffer.get_hash).to eq('long' => long, 'n' => 1)
+      expect(buffer.length).to eq(0)
+    end
+
+    it 'copies decoded values by default' do
+      expect(buffer.get_hash['long']).not_to be_frozen
+    end
+
+    it 'shares decoded values when requested' do
+      doc = described_class.wrap(bytes, shared: true).get_hash
+      expect(doc['long']).to eq(long)
+    end
+
+    it 'accepts strings which are not frozen' do
+      source = bytes.dup
+      buffer = described_class.wrap(source)
+      source.replace('0' * source.bytesize)
+      expect(buffer.get_hash['long']).to eq(long)
+    end
+
+    it 'keeps the string alive' do
+      buffer = described_class.wrap({ 'a' => 'b' * 100 }.to_bson.to_s.freeze)
+      GC.start
+      expect(buffer.get_hash).to eq('a' => 'b' * 100)
+    end
+
+    it 'raises on writes' do
+      expect { buffer.put_int32(1) }.to raise_error(FrozenError)
+      expect { buffer.put_hash('a' => 1) }.to raise_error(FrozenError)
+      expect { buffer.replace_int32(0, 1) }.to raise_error(FrozenError)
+      expect { buffer.reserve(10) }.to raise_error(FrozenError)
+      expect(buffer.to_s).to eq(bytes)
+    end
+
+    it 'raises on writes after reads' do
+      buffer.get_int32
+      expect { buffer.put_byte('a') }.to raise_error(FrozenError)
+    end
+
+    it 'becomes writable when cleared' do
+      buffer.clear
+      expect(buffer).not_to be_read_only
+      expect(buffer.put_int32(1).to_s).to eq("\x01\x00\x00\x00".b)
+      expect(bytes).to eq({ 'long' => long, 'n' => 1 }.to_bson.to_s)
+    end
+
+    it 'does not count the string in its memsize' do
+      require 'objspace'
+      expect(ObjectSpace.memsize_of(buffer)).to be < bytes.bytesize
+    end
+  end
+
+  describe '.mmap' do
+    require 'tempfile'
+
+    before do
+      skip 'C native extension not used on JRuby' if BSON::Environment.jruby?
+    end
+
+    let(:documents) { [ { 'a' => 1 }, { 'b' => 'x' * 5000 }, { 'c' => [ true ] } ] }
+
+    let(:file) do
+      Tempfile.new([ 'dump', '.bson' ]).tap do |file|
+        file.binmode
+        documents.each { |doc| file.write(doc.to_bson.to_s) }
+        file.close
+      end
+    end
+
+    after do
+      file.unlink
+    end
+
+    let(:buffer) { described_class.mmap(file.path) }
+
+    it 'reads the documents of the file' do
+      expect(buffer).to be_read_only
+      expect(buffer.each_document.to_a).to eq(documents)
+    end
+
+    it 'reads with the get methods' do
+      expect(buffer.length).to eq(File.size(file.path))
+      expect(buffer.get_int32).to eq({ 'a' => 1 }.to_bson.length)
+    end
+
+    it 'accepts advice' do
+      expect(described_class.mmap(file.path, advice: :willneed).get_documents).to eq(documents)
+    end
+
+    it 'rejects unknown advice' do
+      expect do
+        described_class.mmap(file.path, advice: :later)
+      end.to raise_error(ArgumentError)
+    end
+
+    it 'raises on writes' do
+      expect { buffer.put_int32(1) }.to raise_error(FrozenError)
+    end
+
+    it 'becomes writable when cleared' do
+      buffer.clear
+      expect(buffer.put_int32(1).to_s).to eq("\x01\x00\x00\x00".b)
+    end
+
+    context 'when the file is empty' do
+      let(:documents) { [] }
+
+      it 'returns an empty buffer' do
+        expect(buffer.length).to eq(0)
+        expect(buffer.get_documents).to eq([])
+        expect { buffer.put_byte('a') }.to raise_error(FrozenError)
+      end
+    end
+
+    context 'when the file does not exist' do
+      it 'raises an error' do
+        expect do
+          described_class.mmap(File.join(Dir.tmpdir, 'missing-dump.bson'))
+        end.to raise_error(Errno::ENOENT)
+      end
+    end
+  end
 end
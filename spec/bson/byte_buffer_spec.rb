@@ -228,4 +228,123 @@ describe BSON::ByteBuffer do
       end
     end
   end
+
+  context 'capacity control' do
+    before do
+      skip 'C native extension not used on JRuby' if BSON::Environment.jruby?
+    end
+
+    describe '#initialize' do
+      it 'allocates the requested capacity' do
+        buffer = described_class.new(capacity: 100_000)
+        expect(buffer.capacity).to eq(100_000)
+        expect(buffer.length).to eq(0)
+      end
+
+      it 'holds the bytes given with a capacity' do
+        buffer = described_class.new('abc', capacity: 5000)
+        expect(buffer.capacity).to eq(5000)
+        expect(buffer.to_s).to eq('abc')
+      end
+
+      it 'rejects a negative capacity' do
+        expect do
+          described_class.new(capacity: -1)
+        end.to raise_error(ArgumentError)
+      end
+    end
+
+    describe '#capacity' do
+      it 'starts with the embedded storage' do
+        expect(described_class.new.capacity).to eq(128)
+      end
+
+      it 'moves to at least 1 KiB of heap storage when growing' do
+        expect(described_class.new.put_bytes('x' * 200).capacity).to eq(1024)
+      end
+
+      it 'doubles beyond that' do
+        expect(described_class.new.put_bytes('x' * 2000).capacity).to eq(4000)
+      end
+    end
+
+    describe '#reserve' do
+      let(:buffer) { described_class.new.put_bytes('ab') }
+
+      it 'makes room for the given number of bytes' do
+        buffer.reserve(10_000)
+        expect(buffer.capacity).to eq(10_002)
+        expect(buffer.to_s).to eq('ab')
+      end
+
+      it 'does nothing when there is enough room' do
+        expect(buffer.reserve(10).capacity).to eq(128)
+      end
+    end
+
+    describe '#clear' do
+      let(:buffer) { described_class.new('x' * 5000) }
+
+      it 'discards the contents and keeps the capacity' do
+        buffer.get_bytes(10)
+        buffer.clear
+        expect(buffer.length).to eq(0)
+        expect(buffer.read_position).to eq(0)
+        expect(buffer.write_position).to eq(0)
+        expect(buffer.capacity).to be >= 5000
+        expect(buffer.put_int32(1).to_s).to eq("\x01\x00\x00\x00".b)
+      end
+    end
+
+    describe '#truncate' do
+      let(:buffer) { described_class.new('abcdef') }
+
+      it 'discards the bytes after the given length' do
+        buffer.get_bytes(1)
+        buffer.truncate(2)
+        expect(buffer.to_s).to eq('bc')
+        expect(buffer.put_bytes('x').to_s).to eq('bcx')
+      end
+
+      it 'rejects a length beyond the contents' do
+        expect do
+          buffer.truncate(7)
+        end.to raise_error(ArgumentError)
+      end
+
+      it 'stops sharing values with the source string' do
+        buffer = described_class.new('x' * 5000, shared: true)
+        buffer.truncate(0).put_bytes('y' * 5000)
+        expect(buffer.get_bytes(5000)).to eq('y' * 5000)
+      end
+    end
+
+    describe '#shrink_to_fit' do
+      let(:buffer) { described_class.new('x' * 5000) }
+
+      it 'releases unused storage' do
+        buffer.reserve(100_000).shrink_to_fit
+        expect(buffer.capacity).to eq(5000)
+        expect(buffer.to_s).to eq('x' * 5000)
+      end
+
+      it 'moves small contents back into the embedded storage' do
+        buffer.get_bytes(4900)
+        buffer.shrink_to_fit
+        expect(buffer.capacity).to eq(128)
+        expect(buffer.to_s).to eq('x' * 100)
+        buffer.put_bytes('y')
+        expect(buffer.to_s).to eq('x' * 100 + 'y')
+      end
+    end
+
+    describe 'memsize' do
+      require 'objspace'
+
+      it 'includes heap storage' do
+        small = ObjectSpace.memsize_of(described_class.new)
+        expect(ObjectSpace.memsize_of(described_class.new(capacity: 1_000_000))).to be >= small + 1_000_000
+      end
+    end
+  end
 end
@@ -166,6 +166,20 @@ describe BSON::ByteBuffer do
       end
     end
 
+    context 'when string has a code point which does not fit in utf-16' do
+      let(:string) do
+        Utils.make_byte_string([0xf4, 0x90, 0x80, 0x80], 'utf-8')
+      end
+
+      it 'raises EncodingError naming the code point' do
+        skip 'C native extension not used on JRuby' if BSON::Environment.jruby?
+
+        expect do
+          modified
+        end.to raise_error(EncodingError, /code point 1114112 does not fit in UTF-16/)
+      end
+    end
+
     context 'when string is in binary encoding and cannot be encoded in utf-8' do
       let(:string) do
         Utils.make_byte_string([254, 253, 255], 'binary')
@@ -307,6 +321,30 @@ describe BSON::ByteBuffer do
         end
       end
 
+      context "when a long string contains a null byte after its first block" do
+
+        let(:string) do
+          "#{'a' * 37}#{BSON::NULL_BYTE}#{'b' * 20}"
+        end
+
+        it 'raises ArgumentError' do
+          expect {
+            modified
+          }.to raise_error(ArgumentError, /String .* contains null bytes/)
+        end
+      end
+
+      context "when a long string mixes ASCII and multi-byte characters" do
+
+        let(:string) do
+          "#{'a' * 21}\u00e9#{'b' * 17}\u20ac#{'c' * 5}"
+        end
+
+        it 'writes the string' do
+          expect(modified.to_s).to eq("#{string}#{BSON::NULL_BYTE}".b)
+        end
+      end
+
       context 'when string is in an encoding other than utf-8' do
         let(:string) do
           # "\xfe"
@@ -852,4 +890,286 @@ describe BSON::ByteBuffer do
       end
     end
   end
+
+  describe '#put_hash' do
+
+    # Encodes a single-field document by calling the value's own to_bson.
+    def encode_with_to_bson(value)
+      buffer = described_class.new
+      buffer.put_int32(0)
+      buffer.put_byte(value.bson_type)
+      buffer.put_cstring('a')
+      value.to_bson(buffer)
+      buffer.put_byte(BSON::NULL_BYTE)
+      buffer.replace_int32(0, buffer.length)
+      buffer.to_s
+    end
+
+    [
+      nil,
+      :symbol,
+      'string',
+      BSON::ObjectId.new,
+      Time.at(1_600_000_000, 999_999, :usec),
+      Time.at(-1, -1, :nsec),
+      BSON::Binary.new("\x00\x01".b),
+      BSON::Binary.new('abc', :old),
+      BSON::Decimal128.new('-1.5'),
+    ].each do |value|
+      it "encodes #{value.inspect} like its to_bson method" do
+        expect(described_class.new.put_hash('a' => value).to_s).to eq(encode_with_to_bson(value))
+      end
+    end
+
+    it 'encodes object ids which have not generated their bytes yet' do
+      object_id = BSON::ObjectId.allocate
+      bytes = described_class.new.put_hash('a' => object_id).to_s
+      expect(bytes[7, 12]).to eq(object_id.to_bson.to_s)
+    end
+
+    context 'when a subclass overrides to_bson' do
+
+      let(:string_class) do
+        Class.new(String) do
+          def to_bson(buffer = BSON::ByteBuffer.new)
+            buffer.put_string('custom')
+          end
+        end
+      end
+
+      it 'calls the override' do
+        doc = Hash.from_bson(described_class.new(described_class.new.put_hash('a' => string_class.new('x')).to_s))
+        expect(doc['a']).to eq('custom')
+      end
+    end
+
+    context 'when bson_type is redefined' do
+
+      around do |example|
+        Symbol.class_eval do
+          alias_method :original_bson_type, :bson_type
+          def bson_type
+            BSON::Symbol::BSON_TYPE
+          end
+        end
+        begin
+          example.run
+        ensure
+          Symbol.class_eval do
+            alias_method :bson_type, :original_bson_type
+            remove_method :original_bson_type
+          end
+        end
+      end
+
+      it 'writes the redefined type' do
+        expect(described_class.new.put_hash('a' => :b).to_s.getbyte(4)).to eq(BSON::Symbol::BSON_TYPE.ord)
+      end
+    end
+
+    context 'when a custom class is encoded' do
+
+      let(:custom_class) do
+        Class.new do
+          def bson_type
+            BSON::String::BSON_TYPE
+          end
+
+          def to_bson(buffer = BSON::ByteBuffer.new)
+            buffer.put_string('custom')
+          end
+        end
+      end
+
+      let(:value) { custom_class.new }
+
+      def type_byte(value)
+        described_class.new.put_hash('a' => value).to_s.getbyte(4)
+      end
+
+      it 'writes the type returned by bson_type' do
+        expect(type_byte(value)).to eq(BSON::String::BSON_TYPE.ord)
+      end
+
+      it 'picks up a redefined bson_type' do
+        type_byte(value)
+        custom_class.class_eval do
+          def bson_type
+            BSON::Code::BSON_TYPE
+          end
+        end
+        expect(type_byte(value)).to eq(BSON::Code::BSON_TYPE.ord)
+      end
+
+      it 'picks up a bson_type from an included module' do
+        type_byte(value)
+        custom_class.send(:prepend, Module.new do
+          def bson_type
+            BSON::Code::BSON_TYPE
+          end
+        end)
+        expect(type_byte(value)).to eq(BSON::Code::BSON_TYPE.ord)
+      end
+
+      it 'uses the bson_type of the singleton class' do
+        type_byte(value)
+        def value.bson_type
+          BSON::Code::BSON_TYPE
+        end
+        expect(type_byte(value)).to eq(BSON::Code::BSON_TYPE.ord)
+        expect(type_byte(custom_class.new)).to eq(BSON::String::BSON_TYPE.ord)
+      end
+    end
+
+    context 'when a module overriding bson_type is added to a cached class' do
+      let(:base_class) { Class.new(BSON::Timestamp) }
+
+      let(:custom_class) { Class.new(base_class) }
+
+      let(:value) { custom_class.new(1, 2) }
+
+      let(:override) do
+        Module.new do
+          def bson_type
+            BSON::Int64::BSON_TYPE
+          end
+        end
+      end
+
+      def type_byte(value)
+        described_class.new.put_hash('a' => value).to_s.getbyte(4)
+      end
+
+      it 'picks up a bson_type from a prepended module' do
+        expect(type_byte(value)).to eq(BSON::Timestamp::BSON_TYPE.ord)
+        custom_class.prepend(override)
+        expect(type_byte(value)).to eq(BSON::Int64::BSON_TYPE.ord)
+      end
+
+      it 'picks up a bson_type from an included module' do
+        expect(type_byte(value)).to eq(BSON::Timestamp::BSON_TYPE.ord)
+        custom_class.include(override)
+        expect(type_byte(value)).to eq(BSON::Int64::BSON_TYPE.ord)
+      end
+
+      it 'picks up a bson_type from a module added to a superclass' do
+        expect(type_byte(value)).to eq(BSON::Timestamp::BSON_TYPE.ord)
+        base_class.prepend(override)
+        expect(type_byte(value)).to eq(BSON::Int64::BSON_TYPE.ord)
+      end
+    end
+
+    context 'when values are wrapped in delegators' do
+      require 'delegate'
+
+      it 'writes the type of each wrapped value' do
+        bytes = described_class.new.put_hash('a' => SimpleDelegator.new(1.5), 'b' => SimpleDelegator.new('x')).to_s
+        expect(bytes.getbyte(4)).to eq(BSON::Float::BSON_TYPE.ord)
+        expect(bytes.getbyte(4 + 3 + 8)).to eq(BSON::String::BSON_TYPE.ord)
+      end
+    end
+
+    context 'when a registered class defines method_added without calling super' do
+
+      let(:custom_class) do
+        Class.new do
+          def self.method_added(name); end
+
+          def to_bson(buffer = BSON::ByteBuffer.new)
+            buffer.put_int32(1)
+          end
+        end.tap do |klass|
+          klass.const_set(:BSON_TYPE, BSON::Int32::BSON_TYPE)
+        end
+      end
+
+      let(:custom_type) { 0x71.chr }
+
+      before { BSON::Registry.register(custom_type, custom_class) }
+
+      after { BSON::Registry::MAPPINGS.delete(custom_type.ord) }
+
+      it 'picks up a redefined bson_type' do
+        described_class.new.put_hash('a' => custom_class.new)
+        custom_class.class_eval do
+          def bson_type
+            BSON::Code::BSON_TYPE
+          end
+        end
+        expect(described_class.new.put_hash('a' => custom_class.new).to_s.getbyte(4)).to eq(BSON::Code::BSON_TYPE.ord)
+      end
+    end
+
+    context 'when the same keys are encoded repeatedly' do
+
+      let(:key) { 'frozen'.freeze }
+
+      it 'writes the keys' do
+        2.times do
+          bytes = described_class.new.put_hash(key => 1, symbol: 2, 'mutable'.dup => 3).to_s
+          expect(Hash.from_bson(described_class.new(bytes))).to eq('frozen' => 1, 'symbol' => 2, 'mutable' => 3)
+        end
+      end
+
+      it 'rejects invalid keys every time' do
+        2.times do
+          expect do
+            described_class.new.put_hash("a\x00b".freeze => 1)
+          end.to raise_error(ArgumentError)
+          expect do
+            described_class.new.put_hash(:"a\x00b" => 1)
+          end.to raise_error(ArgumentError)
+        end
+      end
+    end
+  end
+
+  describe '#put_documents' do
+    before { skip 'C native extension not used on JRuby' if BSON::Environment.jruby? }
+
+    let(:documents) { [ { 'a' => 1 }, { 'b' => 'x' * 100 }, { 'c' => [ 1, 2 ] } ] }
+
+    let(:buffer) { described_class.new }
+
+    it 'writes the documents back to back' do
+      buffer.put_documents(documents)
+      expect(buffer.to_s).to eq(documents.map { |doc| doc.to_bson.to_s }.join)
+    end
+
+    it 'returns the offset of each document' do
+      buffer.put_int32(0)
+      offsets = buffer.put_documents(documents)
+
+      expect(offsets).to eq([ 4, 16, 129 ])
+      bytes = buffer.to_s
+      documents.each_with_index do |doc, i|
+        expect(bytes[offsets[i], doc.to_bson.length]).to eq(doc.to_bson.to_s)
+      end
+    end
+
+    it 'returns offsets relative to the read position' do
+      buffer.put_int32(7)
+      buffer.get_int32
+      expect(buffer.put_documents(documents).first).to eq(0)
+    end
+
+    it 'writes raw documents verbatim' do
+      raw = BSON::RawDocument.new({ 'r' => true }.to_bson.to_s)
+      expect(buffer.put_documents([ raw, documents.first ])).to eq([ 0, raw.data.bytesize ])
+      expect(buffer.to_s).to eq(raw.data + documents.first.to_bson.to_s)
+    end
+
+    it 'returns an empty array for an empty batch' do
+      expect(buffer.put_documents([])).to eq([])
+      expect(buffer.length).to eq(0)
+    end
+
+    context 'when an element is not a document' do
+      it 'raises a TypeError' do
+        expect do
+          buffer.put_documents([ { 'a' => 1 }, 1 ])
+        end.to raise_error(TypeError, /Element 1/)
+      end
+    end
+  end
 end
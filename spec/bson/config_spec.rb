@@ -3,4 +3,73 @@ require "spec_helper"
 
 describe BSON::Config do
 
+  describe '#field_name_cache_size=' do
+
+    after do
+      described_class.field_name_cache_size = BSON::Config::DEFAULT_FIELD_NAME_CACHE_SIZE
+    end
+
+    it 'sets the cache size' do
+      described_class.field_name_cache_size = 16
+      expect(described_class.field_name_cache_size).to eq(16)
+    end
+
+    context 'when the native extension is loaded', unless: BSON::Environment.jruby? do
+
+      it 'resizes the native cache' do
+        described_class.field_name_cache_size = 100
+        expect(BSON::ByteBuffer.field_name_cache_size).to eq(128)
+      end
+
+      it 'disables the cache when the size is zero' do
+        described_class.field_name_cache_size = 0
+        expect(BSON::ByteBuffer.field_name_cache_size).to eq(0)
+        expect(BSON::ByteBuffer.new({ 'a' => 1 }.to_bson.to_s).get_hash).to eq('a' => 1)
+      end
+    end
+
+    context 'when the size is negative' do
+
+      it 'raises an error' do
+        expect do
+          described_class.field_name_cache_size = -1
+        end.to raise_error(ArgumentError)
+      end
+    end
+  end
+
+  describe '#key_cache_size=' do
+
+    after do
+      described_class.key_cache_size = BSON::Config::DEFAULT_KEY_CACHE_SIZE
+    end
+
+    it 'sets the cache size' do
+      described_class.key_cache_size = 16
+      expect(described_class.key_cache_size).to eq(16)
+    end
+
+    context 'when the native extension is loaded', unless: BSON::Environment.jruby? do
+
+      it 'resizes the native cache' do
+        described_class.key_cache_size = 100
+        expect(BSON::ByteBuffer.key_cache_size).to eq(128)
+      end
+
+      it 'disables the cache when the size is zero' do
+        described_class.key_cache_size = 0
+        expect(BSON::ByteBuffer.key_cache_size).to eq(0)
+        expect(BSON::ByteBuffer.new({ a: 1 }.to_bson.to_s).get_hash).to eq('a' => 1)
+      end
+    end
+
+    context 'when the size is negative' do
+
+      it 'raises an error' do
+        expect do
+          described_class.key_cache_size = -1
+        end.to raise_error(ArgumentError)
+      end
+    end
+  end
 end
@@ -0,0 +1,59 @@
+# rubocop:todo all
+require 'spec_helper'
+
+describe 'BSON.encode' do
+  before do
+    skip 'C native extension not used on JRuby' if BSON::Environment.jruby?
+  end
+
+  let(:document) do
+    {
+      'name' => 'test',
+      'list' => [ 1, 2.5, nil, { 'a' => 'b' } ],
+      'id' => BSON::ObjectId.new,
+      'regex' => /^a/i,
+      'data' => 'x' * 10_000,
+    }
+  end
+
+  it 'returns the encoded document' do
+    expect(BSON.encode(document)).to eq(document.to_bson.to_s)
+  end
+
+  it 'returns a binary string' do
+    expect(BSON.encode({}).encoding).to eq(Encoding::BINARY)
+    expect(BSON.encode({})).to eq("\x05\x00\x00\x00\x00".b)
+  end
+
+  it 'encodes values which are not hashes' do
+    expect(BSON.encode([ 1, 'a' ])).to eq([ 1, 'a' ].to_bson.to_s)
+    raw = BSON::RawDocument.new({ 'a' => 1 }.to_bson.to_s)
+    expect(BSON.encode(raw)).to eq(raw.data)
+  end
+
+  it 'returns independent strings' do
+    first = BSON.encode('a' => 1)
+    second = BSON.encode('a' => 2)
+    expect(first).to eq({ 'a' => 1 }.to_bson.to_s)
+    expect(second).to eq({ 'a' => 2 }.to_bson.to_s)
+  end
+
+  context 'when a value encodes itself with the buffer' do
+    let(:value_class) do
+      Class.new do
+        def bson_type
+          BSON::String::BSON_TYPE
+        end
+
+        def to_bson(buffer = BSON::ByteBuffer.new)
+          buffer.put_string('y' * 5000)
+        end
+      end
+    end
+
+    it 'writes into the same string' do
+      document = { 'a' => value_class.new, 'b' => 1 }
+      expect(BSON.encode(document)).to eq(document.to_bson.to_s)
+    end
+  end
+end
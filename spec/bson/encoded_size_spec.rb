@@ -0,0 +1,80 @@
+# rubocop:todo all
+require 'spec_helper'
+
+describe 'BSON.encoded_size' do
+  before do
+    skip 'C native extension not used on JRuby' if BSON::Environment.jruby?
+  end
+
+  let(:document) do
+    {
+      'name' => 'test',
+      :symbol => :value,
+      'count' => 42,
+      'big' => 2**40,
+      'float' => 1.5,
+      'flag' => false,
+      'nil' => nil,
+      'time' => Time.at(1_600_000_000),
+      'nested' => { 'list' => (0..12).to_a + [ { 'a' => 'b' } ] },
+      'id' => BSON::ObjectId.new,
+      'binary' => BSON::Binary.new('abc', :old),
+      'decimal' => BSON::Decimal128.new('1.5'),
+      'regex' => /^a/i,
+      'scope' => BSON::CodeWithScope.new('f()', 'x' => 1),
+      'latin1' => "caf\xE9".force_encoding('ISO-8859-1'),
+      1 => 'integer key',
+    }
+  end
+
+  it 'returns the size of the encoded document' do
+    expect(BSON.encoded_size(document)).to eq(document.to_bson.length)
+  end
+
+  it 'returns the size of values' do
+    [ 'string', 1, 1.5, [ 1, 'a' ], BSON::MaxKey.new ].each do |value|
+      expect(BSON.encoded_size(value)).to eq(value.to_bson.length)
+    end
+  end
+
+  it 'returns the size of empty documents' do
+    expect(BSON.encoded_size({})).to eq(5)
+  end
+end
+
+describe 'BSON::ByteBuffer#put_hash' do
+  before do
+    skip 'C native extension not used on JRuby' if BSON::Environment.jruby?
+  end
+
+  let(:document) { { 'data' => 'x' * 5000, 'list' => [ 1, 2, 3 ] } }
+
+  let(:buffer) { BSON::ByteBuffer.new }
+
+  it 'accepts a document given without braces' do
+    expect(buffer.put_hash('a' => 1).to_s).to eq({ 'a' => 1 }.to_bson.to_s)
+  end
+
+  context 'when exact_size is given' do
+
+    it 'writes the document' do
+      buffer.put_byte('a')
+      buffer.put_hash(document, exact_size: true)
+      expect(buffer.to_s).to eq('a' + document.to_bson.to_s)
+    end
+  end
+
+  context 'when max_size is given' do
+
+    it 'writes documents within the limit' do
+      expect(buffer.put_hash(document, max_size: 16 * 1024 * 1024).to_s).to eq(document.to_bson.to_s)
+    end
+
+    it 'raises an error without writing larger documents' do
+      expect do
+        buffer.put_hash(document, max_size: 5000)
+      end.to raise_error(BSON::Error::DocumentTooLarge)
+      expect(buffer.length).to eq(0)
+    end
+  end
+end
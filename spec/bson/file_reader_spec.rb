@@ -0,0 +1,84 @@
+# rubocop:todo all
+require 'spec_helper'
+require 'tempfile'
+
+describe BSON::FileReader do
+  let(:documents) do
+    Array.new(50) { |i| { 'i' => i, 'name' => 'x' * (i * 10) } }
+  end
+
+  let(:file) do
+    Tempfile.new([ 'documents', '.bson' ]).tap do |f|
+      f.binmode
+      documents.each { |doc| f.write(doc.to_bson.to_s) }
+      f.flush
+    end
+  end
+
+  after { file.close! }
+
+  describe '.open' do
+    it 'yields the reader and returns the result of the block' do
+      expect(described_class.open(file.path) { |reader| reader.count }).to eq(50)
+    end
+
+    it 'returns the reader without a block' do
+      reader = described_class.open(file.path)
+      expect(reader.to_a).to eq(documents)
+      reader.close
+    end
+  end
+
+  describe '#each' do
+    it 'yields documents which span read-ahead chunks' do
+      described_class.open(file.path, read_ahead: 7) do |reader|
+        expect(reader.to_a).to eq(documents)
+      end
+    end
+
+    it 'reads from an IO' do
+      io = StringIO.new(documents.map { |doc| doc.to_bson.to_s }.join)
+      expect(described_class.new(io).first(2)).to eq(documents.first(2))
+    end
+
+    context 'when decoding options are given' do
+      it 'applies them to every document' do
+        described_class.open(file.path, only: [ 'i' ]) do |reader|
+          expect(reader.map(&:keys).uniq).to eq([ [ 'i' ] ])
+        end
+      end
+    end
+
+    context 'when raw documents are requested' do
+      it 'yields raw documents' do
+        described_class.open(file.path, raw: true) do |reader|
+          raws = reader.to_a
+          expect(raws).to all(be_a(BSON::RawDocument))
+          expect(raws.last['i']).to eq(49)
+          expect(raws.map(&:to_h)).to eq(documents)
+        end
+      end
+    end
+
+    context 'when the file ends in the middle of a document' do
+      before do
+        file.write("\x10\x00\x00\x00\x10")
+        file.flush
+      end
+
+      it 'raises a decode error' do
+        described_class.open(file.path) do |reader|
+          expect { reader.to_a }.to raise_error(BSON::Error::BSONDecodeError)
+        end
+      end
+    end
+  end
+
+  describe '#initialize' do
+    it 'rejects an invalid read ahead' do
+      expect do
+        described_class.new(file.path, read_ahead: 0)
+      end.to raise_error(ArgumentError)
+    end
+  end
+end
@@ -0,0 +1,85 @@
+# rubocop:todo all
+require 'spec_helper'
+require 'tempfile'
+
+describe BSON::FileWriter do
+  let(:documents) do
+    Array.new(50) { |i| { 'i' => i, 'name' => 'x' * (i * 10) } }
+  end
+
+  let(:bytes) { documents.map { |doc| doc.to_bson.to_s }.join }
+
+  let(:file) { Tempfile.new([ 'documents', '.bson' ]) }
+
+  after { file.close! }
+
+  describe '.open' do
+    it 'writes the documents and closes the file' do
+      writer = described_class.open(file.path) do |w|
+        documents.each { |doc| w << doc }
+        w
+      end
+
+      expect(File.binread(file.path)).to eq(bytes)
+      expect(writer.pending_bytes).to eq(0)
+    end
+  end
+
+  describe '#write' do
+    let(:io) { StringIO.new(''.b) }
+
+    let(:writer) { described_class.new(io, flush_size: 1024) }
+
+    it 'buffers documents until the flush size is reached' do
+      writer.write(documents.first)
+      expect(io.string).to be_empty
+      expect(writer.pending_bytes).to eq(documents.first.to_bson.length)
+
+      documents.each { |doc| writer.write(doc) }
+      expect(io.string.bytesize).to be >= 1024
+      expect(writer.pending_bytes).to be < 1024
+    end
+
+    it 'writes raw documents verbatim' do
+      writer.write(BSON::RawDocument.new(documents.last.to_bson.to_s))
+      writer.flush
+      expect(io.string).to eq(documents.last.to_bson.to_s)
+    end
+
+    context 'when a document fails to encode' do
+      it 'discards its partially encoded bytes' do
+        writer << documents.first
+        expect do
+          writer << { 'c' => "\xff".dup.force_encoding('UTF-8') }
+        end.to raise_error(EncodingError)
+        writer << documents.last
+        writer.close
+
+        expect(io.string).to eq(documents.first.to_bson.to_s + documents.last.to_bson.to_s)
+      end
+    end
+  end
+
+  describe '#close' do
+    let(:io) { StringIO.new(''.b) }
+
+    it 'flushes but does not close an IO it did not open' do
+      writer = described_class.new(io)
+      documents.each { |doc| writer << doc }
+      writer.close
+
+      expect(io.string).to eq(bytes)
+      expect(io).not_to be_closed
+    end
+  end
+
+  context 'when read back with a file reader' do
+    it 'round-trips the documents' do
+      described_class.open(file.path, flush_size: 100) do |writer|
+        documents.each { |doc| writer << doc }
+      end
+
+      expect(BSON::FileReader.open(file.path, &:to_a)).to eq(documents)
+    end
+  end
+end
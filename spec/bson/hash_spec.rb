@@ -240,6 +240,15 @@ describe Hash do
     end
   end
 
+  describe '#to_bson_string' do
+    let(:hash) { { 'a' => 1, 'b' => [ 'c' ] } }
+
+    it 'returns the encoded document' do
+      expect(hash.to_bson_string).to eq(hash.to_bson.to_s)
+      expect(hash.to_bson_string.encoding).to eq(Encoding::BINARY)
+    end
+  end
+
   describe '#to_bson' do
     context 'when a key is not valid utf-8' do
       let(:key) { Utils.make_byte_string([254, 253, 255]) }
@@ -389,6 +398,88 @@ describe Hash do
         end
       end
     end
+
+    shared_examples 'a projected decode' do |native|
+      let(:document) do
+        {
+          '_id' => 1,
+          'status' => 'active',
+          'meta' => { 'owner' => 'alice', 'size' => 2 },
+          'items' => [ { 'sku' => 'a', 'qty' => 1 }, { 'sku' => 'b', 'qty' => 2 }, 3 ],
+          'blob' => 'x' * 1000,
+          'ref' => { '$ref' => 'users', '$id' => 1, 'x' => 2 },
+        }
+      end
+
+      it 'keeps only the selected fields' do
+        expect(Hash.from_bson(buffer, only: [ '_id', :status, 'meta.owner' ])).to eq(
+          '_id' => 1, 'status' => 'active', 'meta' => { 'owner' => 'alice' }
+        )
+      end
+
+      it 'projects the documents in arrays' do
+        expect(Hash.from_bson(buffer, only: [ 'items.sku' ])).to eq(
+          'items' => [ { 'sku' => 'a' }, { 'sku' => 'b' } ]
+        )
+      end
+
+      it 'leaves out the excluded fields' do
+        expect(Hash.from_bson(buffer, except: [ 'blob', 'meta.size', 'items.qty', 'ref' ])).to eq(
+          '_id' => 1,
+          'status' => 'active',
+          'meta' => { 'owner' => 'alice' },
+          'items' => [ { 'sku' => 'a' }, { 'sku' => 'b' }, 3 ],
+        )
+      end
+
+      it 'selects whole fields over their paths' do
+        expect(Hash.from_bson(buffer, only: [ 'meta.owner', 'meta' ])).to eq(
+          'meta' => { 'owner' => 'alice', 'size' => 2 }
+        )
+      end
+
+      it 'decodes projected subdocuments which are DBRefs' do
+        ref = Hash.from_bson(buffer, only: [ 'ref.$ref', 'ref.$id' ])['ref']
+        expect(ref).to be_a(BSON::DBRef)
+        expect(ref.collection).to eq('users')
+        expect(ref.id).to eq(1)
+      end
+
+      it 'consumes the whole document' do
+        Hash.from_bson(buffer, only: [ '_id' ])
+        expect(buffer.length).to eq(0)
+      end
+
+      it 'does not validate skipped values' do
+        bytes = { 'a' => 1, 'b' => 'x' }.to_bson.to_s
+        bytes[-3] = "\xff".b
+        expect(Hash.from_bson(BSON::ByteBuffer.new(bytes), only: [ 'a' ])).to eq('a' => 1)
+      end if native
+
+      it 'raises when both :only and :except are given' do
+        expect do
+          Hash.from_bson(buffer, only: [ '_id' ], except: [ 'blob' ])
+        end.to raise_error(ArgumentError)
+      end
+    end
+
+    context 'with a projection' do
+      let(:buffer) { BSON::ByteBuffer.new(document.to_bson.to_s) }
+
+      it_behaves_like 'a projected decode', !BSON::Environment.jruby?
+    end
+
+    context 'with a projection and a buffer which cannot read hashes' do
+      let(:buffer) do
+        BSON::ByteBuffer.new(document.to_bson.to_s).tap do |buffer|
+          def buffer.respond_to?(name, *args)
+            name != :get_hash && super
+          end
+        end
+      end
+
+      it_behaves_like 'a projected decode', false
+    end
   end
 
   describe '#as_extended_json' do
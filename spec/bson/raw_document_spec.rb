@@ -0,0 +1,285 @@
+# rubocop:todo all
+require 'spec_helper'
+
+describe BSON::RawDocument do
+  let(:object_id) { BSON::ObjectId.new }
+
+  let(:hash) do
+    {
+      'name' => 'test',
+      'count' => 42,
+      'meta' => { 'owner' => 'alice', 'tags' => [ 'a', { 'b' => 1 } ] },
+      '_id' => object_id,
+    }
+  end
+
+  let(:bytes) { hash.to_bson.to_s }
+
+  let(:raw_class) { described_class }
+
+  let(:raw) { raw_class.new(bytes) }
+
+  describe '#initialize' do
+    it 'freezes the data' do
+      expect(raw.data).to be_frozen
+      expect(raw.data.encoding).to eq(Encoding::BINARY)
+    end
+
+    context 'when the length prefix does not match' do
+      it 'raises a decode error' do
+        expect do
+          described_class.new(bytes + "\x00")
+        end.to raise_error(BSON::Error::BSONDecodeError)
+      end
+    end
+
+    context 'when the document is not null-terminated' do
+      it 'raises a decode error' do
+        expect do
+          described_class.new("\x05\x00\x00\x00\x01")
+        end.to raise_error(BSON::Error::BSONDecodeError)
+      end
+    end
+  end
+
+  describe '#to_h' do
+    it 'decodes the whole document' do
+      expect(raw.to_h).to eq(hash)
+      expect(raw.to_h).to be_a(BSON::Document)
+    end
+  end
+
+  describe '#to_bson' do
+    it 'writes the original bytes' do
+      expect(raw.to_bson.to_s).to eq(bytes)
+    end
+
+    it 'can be embedded in a hash' do
+      expect({ 'doc' => raw }.to_bson.to_s).to eq({ 'doc' => hash }.to_bson.to_s)
+    end
+
+    it 'can be embedded in an array' do
+      expect({ 'docs' => [ raw, raw ] }.to_bson.to_s).to eq({ 'docs' => [ hash, hash ] }.to_bson.to_s)
+    end
+
+    it 'is counted by encoded_size' do
+      skip 'C native extension not used on JRuby' if BSON::Environment.jruby?
+      expect(BSON.encoded_size('doc' => raw)).to eq({ 'doc' => hash }.to_bson.length)
+    end
+
+    context 'when embedded by the native extension' do
+      before { skip 'C native extension not used on JRuby' if BSON::Environment.jruby? }
+
+      let(:subclass) do
+        Class.new(described_class) do
+          def to_bson(buffer = BSON::ByteBuffer.new)
+            buffer.put_bytes({ 'sub' => true }.to_bson.to_s)
+          end
+        end
+      end
+
+      it 'copies the bytes without calling to_bson' do
+        raw.define_singleton_method(:to_bson) { |*| raise 'to_bson called' }
+        expect({ 'doc' => raw }.to_bson.to_s).to eq({ 'doc' => hash }.to_bson.to_s)
+      end
+
+      it 'calls to_bson on subclasses' do
+        doc = subclass.new(bytes)
+        expect(Hash.from_bson(BSON::ByteBuffer.new({ 'doc' => doc }.to_bson.to_s))).to eq('doc' => { 'sub' => true })
+      end
+    end
+  end
+
+  shared_examples 'raw document access' do
+    describe '.from_bson' do
+      let(:buffer) { BSON::ByteBuffer.new(bytes + { 'x' => 1 }.to_bson.to_s) }
+
+      it 'reads one document from the buffer' do
+        expect(raw_class.from_bson(buffer)['name']).to eq('test')
+        expect(Hash.from_bson(buffer)).to eq('x' => 1)
+      end
+    end
+
+    describe '#[]' do
+      it 'decodes the requested value' do
+        expect(raw['count']).to eq(42)
+        expect(raw['_id']).to eq(object_id)
+      end
+
+      it 'accepts symbol keys' do
+        expect(raw[:name]).to eq('test')
+      end
+
+      it 'returns nil for missing keys' do
+        expect(raw['missing']).to be_nil
+      end
+
+      it 'returns embedded documents as raw documents' do
+        expect(raw['meta']).to be_a(raw_class)
+        expect(raw['meta']['owner']).to eq('alice')
+      end
+
+      it 'keeps documents inside arrays raw' do
+        tags = raw['meta']['tags']
+        expect(tags.first).to eq('a')
+        expect(tags.last).to be_a(raw_class)
+        expect(tags.last['b']).to eq(1)
+      end
+
+      context 'when the mode option is given' do
+        let(:raw) { raw_class.new({ 'n' => BSON::Int64.new(1) }.to_bson.to_s, mode: :bson) }
+
+        it 'decodes the value using the mode' do
+          expect(raw['n']).to eq(BSON::Int64.new(1))
+        end
+      end
+
+      context 'when a field has an unknown type' do
+        let(:bytes) { "\x0c\x00\x00\x00\x77a\x00\x01\x00\x00\x00\x00".b }
+
+        it 'raises UnsupportedType' do
+          expect do
+            raw['a']
+          end.to raise_error(BSON::Error::UnsupportedType)
+        end
+      end
+
+      context 'when a value overruns the document' do
+        let(:bytes) { "\x0c\x00\x00\x00\x02a\x00\x01\x00\x00\x00\x00".b }
+
+        it 'raises a decode error' do
+          expect do
+            raw['a']
+          end.to raise_error(BSON::Error::BSONDecodeError)
+        end
+      end
+    end
+
+    describe '#key?' do
+      it 'finds existing keys' do
+        expect(raw.key?('meta')).to be true
+        expect(raw.key?('missing')).to be false
+      end
+    end
+
+    describe '#fetch' do
+      it 'raises KeyError for missing keys' do
+        expect { raw.fetch('missing') }.to raise_error(KeyError)
+      end
+
+      it 'returns the default for missing keys' do
+        expect(raw.fetch('missing', 1)).to eq(1)
+      end
+    end
+
+    describe '#each' do
+      it 'yields the fields in order' do
+        expect(raw.map(&:first)).to eq(hash.keys)
+      end
+
+      it 'returns an enumerator without a block' do
+        expect(raw.each.size).to eq(4)
+      end
+    end
+
+    describe '#keys' do
+      it 'returns the field names' do
+        expect(raw.keys).to eq(hash.keys)
+      end
+    end
+
+    describe '#with' do
+      it 'sets existing fields in place' do
+        edited = raw.with(set: { 'count' => 43, 'meta.owner' => 'bob' })
+        expect(edited).to be_a(raw_class)
+        expect(edited.keys).to eq(hash.keys)
+        expect(edited.to_h).to eq(hash.merge('count' => 43, 'meta' => hash['meta'].merge('owner' => 'bob')))
+      end
+
+      it 'appends new fields and creates the documents containing them' do
+        edited = raw.with(set: { version: 2, 'audit.by' => 'me' })
+        expect(edited.keys).to eq(hash.keys + [ 'version', 'audit' ])
+        expect(edited['audit'].to_h).to eq('by' => 'me')
+      end
+
+      it 'removes fields' do
+        edited = raw.with(unset: [ 'count', 'meta.tags', 'missing.field' ])
+        expect(edited.to_h).to eq('name' => 'test', 'meta' => { 'owner' => 'alice' }, '_id' => object_id)
+      end
+
+      it 'renames fields, replacing an existing field with the new name' do
+        edited = raw.with(rename: { 'name' => 'title', 'meta.owner' => 'user' })
+        expect(edited.keys).to eq([ 'title', 'count', 'meta', '_id' ])
+        expect(edited['meta'].keys).to eq([ 'user', 'tags' ])
+
+        expect(raw.with(rename: { 'name' => 'count' }).to_h).to eq(hash.reject { |k, _| k == 'name' }.merge('count' => 'test'))
+        expect(raw.with(rename: { 'count' => 'name' }).to_h).to eq(hash.reject { |k, _| k == 'count' }.merge('name' => 42))
+      end
+
+      it 'keeps the field with the new name when the renamed field does not exist' do
+        expect(raw.with(rename: { 'missing' => 'count', 'meta.missing' => 'owner' }).data).to eq(bytes)
+      end
+
+      it 'edits documents inside arrays' do
+        expect(raw.with(set: { 'meta.tags.1.b' => 2 })['meta']['tags'].last.to_h).to eq('b' => 2)
+      end
+
+      it 'writes the same bytes as encoding the edited hash' do
+        edited = raw.with(set: { 'meta.owner' => 'a much longer owner name' })
+        expected = hash.merge('meta' => hash['meta'].merge('owner' => 'a much longer owner name'))
+        expect(edited.data).to eq(expected.to_bson.to_s)
+      end
+
+      it 'does not change the original document' do
+        raw.with(set: { 'count' => 1 })
+        expect(raw.data).to eq(bytes)
+      end
+
+      it 'keeps the decoding options' do
+        doc = raw_class.new({ 'n' => BSON::Int64.new(1) }.to_bson.to_s, mode: :bson)
+        expect(doc.with(set: { 'm' => 1 })['n']).to eq(BSON::Int64.new(1))
+      end
+
+      context 'when the edits conflict' do
+        it 'raises an ArgumentError' do
+          expect { raw.with(set: { 'meta' => 1 }, unset: [ 'meta.owner' ]) }.to raise_error(ArgumentError)
+          expect { raw.with(set: { 'count' => 1 }, unset: [ 'count' ]) }.to raise_error(ArgumentError)
+          expect { raw.with(set: { 'a..b' => 1 }) }.to raise_error(ArgumentError)
+        end
+      end
+
+      context 'when a path goes through a field which is not a document' do
+        it 'raises an ArgumentError' do
+          expect { raw.with(set: { 'count.x' => 1 }) }.to raise_error(ArgumentError, /count/)
+        end
+      end
+
+      context 'when an array element would be added or removed' do
+        it 'raises an ArgumentError' do
+          expect { raw.with(unset: [ 'meta.tags.0' ]) }.to raise_error(ArgumentError)
+          expect { raw.with(set: { 'meta.tags.5' => 1 }) }.to raise_error(ArgumentError)
+        end
+      end
+    end
+  end
+
+  it_behaves_like 'raw document access'
+
+  context 'with the pure Ruby implementation' do
+    let(:raw_class) do
+      Class.new(described_class) { prepend BSON::RawDocument::Fallback }
+    end
+
+    it_behaves_like 'raw document access'
+  end
+
+  describe '#==' do
+    it 'compares with hashes by content' do
+      expect(raw).to eq(hash)
+    end
+
+    it 'compares with raw documents by bytes' do
+      expect(raw).to eq(described_class.new(bytes))
+    end
+  end
+end
@@ -43,4 +43,33 @@ describe BSON::Registry do
       end
     end
   end
+
+  describe ".register" do
+
+    let(:custom_class) do
+      Class.new do
+        def bson_type
+          BSON::String::BSON_TYPE
+        end
+
+        def to_bson(buffer = BSON::ByteBuffer.new)
+          buffer.put_int32(1)
+        end
+      end.tap do |klass|
+        klass.const_set(:BSON_TYPE, BSON::Int32::BSON_TYPE)
+      end
+    end
+
+    let(:custom_type) { 0x70.chr }
+
+    after do
+      BSON::Registry::MAPPINGS.delete(custom_type.ord)
+    end
+
+    it "changes the type the class is serialized with" do
+      { 'a' => custom_class.new }.to_bson
+      described_class.register(custom_type, custom_class)
+      expect({ 'a' => custom_class.new }.to_bson.to_s.getbyte(4)).to eq(BSON::Int32::BSON_TYPE.ord)
+    end
+  end
 end
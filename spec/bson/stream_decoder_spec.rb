@@ -0,0 +1,121 @@
+# rubocop:todo all
+require 'spec_helper'
+
+describe BSON::StreamDecoder do
+  let(:documents) do
+    [ { 'a' => 1 }, { 'b' => 'x' * 200 }, { 'c' => { 'd' => 3 } } ]
+  end
+
+  let(:stream) { documents.map { |doc| doc.to_bson.to_s }.join }
+
+  let(:decoder_class) { described_class }
+
+  let(:decoder) { decoder_class.new }
+
+  shared_examples 'stream decoding' do
+    describe '#feed' do
+      it 'yields documents as they are completed' do
+        yielded = []
+        stream.each_char.each_slice(7) do |chunk|
+          decoder.feed(chunk.join) { |doc| yielded << doc }
+        end
+
+        expect(yielded).to eq(documents)
+        expect(decoder.pending_bytes).to eq(0)
+      end
+
+      it 'returns the completed documents without a block' do
+        first = documents.first.to_bson.to_s
+        expect(decoder.feed(first + stream[first.length, 3])).to eq([ documents.first ])
+        expect(decoder.pending_bytes).to eq(3)
+        expect(decoder.feed(stream[first.length + 3..-1])).to eq(documents[1..-1])
+      end
+
+      it 'keeps the partial document between chunks' do
+        expect(decoder.feed(stream[0, 2])).to eq([])
+        expect(decoder.pending_bytes).to eq(2)
+      end
+
+      context 'when options are given' do
+        let(:decoder) { decoder_class.new(only: [ 'c.d' ]) }
+
+        it 'applies them to every document' do
+          expect(decoder.feed(stream)).to eq([ {}, {}, { 'c' => { 'd' => 3 } } ])
+        end
+      end
+
+      context 'when raw documents are requested' do
+        let(:decoder) { decoder_class.new(raw: true) }
+
+        it 'yields raw documents holding the bytes' do
+          raws = decoder.feed(stream)
+          expect(raws).to all(be_a(BSON::RawDocument))
+          expect(raws.map(&:data)).to eq(documents.map { |doc| doc.to_bson.to_s })
+          expect(raws.last['c']['d']).to eq(3)
+        end
+
+        it 'shares frozen options with the raw documents' do
+          raws = decoder.feed(stream)
+          expect(raws.map { |raw| raw.instance_variable_get(:@options) }).to all(be_frozen)
+        end
+
+        it 'rejects field selection' do
+          expect do
+            decoder_class.new(raw: true, except: [ 'a' ])
+          end.to raise_error(ArgumentError)
+        end
+      end
+
+      context 'when the length prefix exceeds the maximum document size' do
+        let(:decoder) { decoder_class.new(max_document_size: 100) }
+
+        it 'raises a decode error before buffering the document' do
+          expect(decoder.feed(documents.first.to_bson.to_s)).to eq([ documents.first ])
+          expect do
+            decoder.feed("\x00\x00\x00\x7f")
+          end.to raise_error(BSON::Error::BSONDecodeError, /exceeds the maximum of 100 bytes/)
+        end
+
+        it 'defaults to the largest document the server produces' do
+          expect(decoder_class.new.max_document_size).to eq(16 * 1024 * 1024 + 16 * 1024)
+        end
+
+        it 'rejects an invalid maximum' do
+          expect { decoder_class.new(max_document_size: 0) }.to raise_error(ArgumentError)
+        end
+      end
+
+      context 'when the length prefix is invalid' do
+        it 'raises a decode error' do
+          expect do
+            decoder.feed("\x01\x00\x00\x00")
+          end.to raise_error(BSON::Error::BSONDecodeError)
+        end
+      end
+    end
+
+    describe '#finish' do
+      it 'raises when a partial document is pending' do
+        decoder.feed(stream[0, 3])
+        expect do
+          decoder.finish
+        end.to raise_error(BSON::Error::BSONDecodeError)
+      end
+
+      it 'succeeds at a document boundary' do
+        decoder.feed(stream)
+        expect { decoder.finish }.not_to raise_error
+      end
+    end
+  end
+
+  it_behaves_like 'stream decoding'
+
+  context 'with the pure Ruby implementation' do
+    let(:decoder_class) do
+      Class.new(described_class) { prepend BSON::StreamDecoder::Fallback }
+    end
+
+    it_behaves_like 'stream decoding'
+  end
+end
@@ -0,0 +1,134 @@
+# rubocop:todo all
+require 'spec_helper'
+
+describe 'BSON.validate' do
+  before do
+    skip 'C native extension not used on JRuby' if BSON::Environment.jruby?
+  end
+
+  let(:document) do
+    {
+      'name' => 'test',
+      'flag' => true,
+      'nested' => { 'list' => [ 1, 2.5, nil, BSON::ObjectId.new ] },
+      'binary' => BSON::Binary.new('abc', :old),
+      'regex' => BSON::Regexp::Raw.new('^a', 'i'),
+      'scope' => BSON::CodeWithScope.new('f()', 'x' => 1),
+      'decimal' => BSON::Decimal128.new('1.5'),
+    }
+  end
+
+  let(:bytes) { document.to_bson.to_s }
+
+  def failure(bytes)
+    BSON.validate(bytes)
+  end
+
+  it 'returns nil for a valid document' do
+    expect(failure(bytes)).to be_nil
+  end
+
+  it 'accepts a byte buffer' do
+    buffer = BSON::ByteBuffer.new(bytes)
+    expect(BSON.validate(buffer)).to be_nil
+    expect(buffer.read_position).to eq(0)
+  end
+
+  it 'does not allocate objects for small valid documents' do
+    failure(bytes)
+    allocated = GC.stat(:total_allocated_objects)
+    1000.times { failure(bytes) }
+    expect(GC.stat(:total_allocated_objects) - allocated).to be < 10
+  end
+
+  it 'validates large documents' do
+    large = { 'data' => 'x' * 100_000, 'bad' => 'y' }.to_bson.to_s
+    expect(failure(large)).to be_nil
+
+    large[-3] = "\xff".b
+    expect(failure(large).reason).to match(/not valid UTF-8/)
+    expect(failure(large).offset).to eq(large.bytesize - 3)
+  end
+
+  context 'when the document length is wrong' do
+    it 'reports the offset and reason' do
+      result = failure(bytes + "\x00")
+      expect(result).to be_a(BSON::ValidationFailure)
+      expect(result.offset).to eq(bytes.bytesize)
+      expect(result.reason).to eq('data continues after the end of the document')
+    end
+
+    it 'reports truncated data' do
+      expect(failure(bytes[0..-2]).reason).to eq('document extends past the end of the data')
+    end
+  end
+
+  context 'when a boolean is invalid' do
+    let(:bytes) { "\x09\x00\x00\x00\x08a\x00\x02\x00".b }
+
+    it 'reports the boolean' do
+      expect(failure(bytes)).to eq(BSON::ValidationFailure.new(7, 'boolean value is not 0 or 1'))
+    end
+  end
+
+  context 'when the type byte is unknown' do
+    let(:bytes) { "\x08\x00\x00\x00\x77a\x00\x00".b }
+
+    it 'reports the type byte' do
+      expect(failure(bytes)).to eq(BSON::ValidationFailure.new(4, 'unsupported type'))
+    end
+  end
+
+  context 'when a field name is not valid UTF-8' do
+    let(:bytes) { "\x0c\x00\x00\x00\x10\xff\x00\x01\x00\x00\x00\x00".b }
+
+    it 'reports the field name' do
+      expect(failure(bytes).offset).to eq(5)
+      expect(failure(bytes).reason).to match(/string is not valid UTF-8/)
+    end
+  end
+
+  context 'when a string is not null-terminated' do
+    let(:bytes) { "\x0e\x00\x00\x00\x02a\x00\x02\x00\x00\x00bb\x00".b }
+
+    it 'reports the string' do
+      expect(failure(bytes).reason).to eq('string is not null-terminated')
+    end
+  end
+
+  context 'when the nesting depth is too large' do
+    let(:bytes) do
+      doc = {}
+      300.times { doc = { 'a' => doc } }
+      doc.to_bson.to_s
+    end
+
+    it 'reports the depth' do
+      expect(failure(bytes).reason).to eq('nesting depth exceeds the maximum')
+    end
+  end
+end
+
+describe BSON::ByteBuffer do
+  before do
+    skip 'C native extension not used on JRuby' if BSON::Environment.jruby?
+  end
+
+  describe '#valid_bson?' do
+    it 'returns true for a valid document' do
+      expect(described_class.new({ 'a' => 1 }.to_bson.to_s).valid_bson?).to be true
+    end
+
+    it 'returns false for an invalid document' do
+      expect(described_class.new("\x05\x00\x00\x00\x01").valid_bson?).to be false
+    end
+
+    it 'validates large buffers while other threads write to them' do
+      buffer = described_class.new({ 'data' => 'x' * 100_000 }.to_bson.to_s)
+      writer = Thread.new { 1000.times { buffer.put_bytes('y' * 1000) } }
+      5.times { buffer.valid_bson? }
+      writer.join
+      expect(buffer.get_hash['data'].bytesize).to eq(100_000)
+    end
+  end
+end